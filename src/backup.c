@@ -22,18 +22,24 @@
 #define __USE_LARGEFILE64
 // #define _LARGEFILE_SOURCE
 #define _LARGEFILE64_SOURCE
+#define _GNU_SOURCE				// fallocate()
 
+#include <errno.h>
 #include <fcntl.h>
 #include <ncurses.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 #include <sys/stat.h>
+#include <sys/statfs.h>
 #ifdef PARTCLONE
   #include <libpartclone.h>
 #endif
+#include "backup.h"				// diskJobs
 #include "cli.h"					// validOperation
 #include "drive.h"				// types, testMode, mapTypes
 #include "fileEngine.h"
@@ -41,18 +47,24 @@
 #include "partition.h"
 #include "partutil.h"			// readable
 #include "sysres_debug.h"	// debug()
+#include "sysres_blockmap.h"	// SYSRES_BLOCKMAP_Select()
+#include "sysres_pclone.h"	// SYSRES_PCLONE_Map()
 #include "window.h"     	// globalPath
 
 extern navImage image1;
 extern int termWidth;
 
 
-extern unsigned char md_value[];
+extern __thread unsigned char md_value[];
 extern int md_len;
 
 char *imagePath(char *append);
+char *readableTime(unsigned int elapsed, char bufLoc);
+void readableSize(unsigned long val);
+void showEstimate(unsigned long data, unsigned long archived, unsigned long seconds, unsigned long avail);
 extern int segment_size;
 extern char compression;
+extern int pcloneSum;
 
 extern char imageDevice[];
 extern unsigned char mapMask;
@@ -62,6 +74,42 @@ unsigned int globalOps; // total number of backup operations
 int backupPID = 0;
 extern volatile sig_atomic_t has_interrupted;
 
+// jobs= images several disks at once. The archive layout doesn't change (index first, then
+// one file per partition in index order): the writer images the disk it's on itself, and
+// copies the other disks' partitions from spools that worker threads compress them into.
+#define JOB_WAIT 0	// not claimed yet
+#define JOB_RUN 1	// a worker owns it; spooled grows until DONE or FAIL
+#define JOB_DONE 2
+#define JOB_FAIL 3
+#define JOB_LIVE 4	// the writer images it straight into the archive
+#define JOBBUF IOBUFSIZE	// bytes per device read and per spool copy, a pool buffer
+#define JOBPOLL 250	// ms between progress/cancel checks while waiting on a worker
+
+typedef struct {
+	char *device;
+	unsigned int major, minor;
+	unsigned char state, type;	// ST_CLONE or ST_FULL, PART_*
+	unsigned long length;	// bytes to copy for ST_FULL
+	disk *d;		// a disk's jobs run in order, on one thread
+	char *spoolName;
+	int fd;		// spool, unlinked once open
+	unsigned long spooled;	// compressed bytes in the spool
+	unsigned long originalBytes;	// uncompressed bytes behind them
+	unsigned long expected;	// uncompressed total, once known
+	char status;
+	} backupJob;
+
+int diskJobs = 1; // jobs= option; disks backed up or restored at once
+backupJob *jobList = NULL;
+int jobCount = 0;
+int jobThreads = 0;
+pthread_t jobTID[JOBSMAX];
+pthread_mutex_t jobLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t jobCond = PTHREAD_COND_INITIALIZER;
+bool jobStop = false;
+
+bool createBackupIndex(archive *arch, char pass);
+void endBackupJobs(void);
 
 
 void exitConsole(void) { // go back to UI
@@ -92,96 +140,201 @@ bool ddEngine(char *device, int major, int minor, unsigned char type, archive *a
 	return false;
 	}
 
-#define ARGCOUNT 6
+#define ARGCOUNT 10
+
+// sumMode and sumSpan hold the argument strings argv points at
+void pcloneArgs(char **argv, char *sumMode, char *sumSpan, char *device) {
+	char *args[] = { "pclone", "-c", "-a", sumMode, "-k", sumSpan, "-o", "-", "-s", device }; // -d3
+	memcpy(argv,args,sizeof(args));
+	sprintf(sumMode,"%i",pcloneSum?1:0); // the descriptor records mode and span; Map() then marks the checksums CRC32C
+	sprintf(sumSpan,"%i",pcloneSum?pcloneSum:1);
+	}
 
 bool pcloneEngine(char *device, int major, int minor, unsigned char type, archive *arch) {
-	pc_hdr hdr;
-	unsigned char buf[4096];
+	SYSRES_PCLONE_IMAGE_T image;
+	SYSRES_PCLONE_STREAM_T stream;
+	unsigned char *buf;
+	ioBuf *io;
 	int n;
-	char *argv[] = { "pclone", "-c", "-o", "-", "-s", NULL }; // -d3
-	argv[ARGCOUNT-1] = device;
+	char sumMode[2], sumSpan[12];
+	char *argv[ARGCOUNT];
+	pcloneArgs(argv,sumMode,sumSpan,device);
 	if (addFileToArchive(major,minor,ST_CLONE | compression,arch) != 1) {
 		debug(ABORT,0,"Error adding file to archive; check disk space");
 		return true;
 		}
-	int mypipe[2];
-	pid_t pid;
-	int status;
-	if (pipe(mypipe)) debug(EXIT,0,"Unable to create pipe\n");
-	pid = fork();
-	if (pid == (pid_t) 0) { // child process
-		close(mypipe[0]);
-		// signal(SIGQUIT,SIG_DFL) // for production
-#ifdef PARTCLONE
-		LIBPARTCLONE_MainEntry(type,mypipe[1],ARGCOUNT,argv);
-#endif
-		close(mypipe[1]);
-		_exit(0);
-		}
-	else if (pid < (pid_t) 0) debug(EXIT,0,"Unable to fork\n");
-	else { // parent
-		close(mypipe[1]);
-		if (ui_mode) {
-			progressBar(0,PROGRESS_GREEN,PROGRESS_INIT); // reset progress bar for feedback
-			if (progressBar(0,0,PROGRESS_UPDATE)) { // it was cancelled
-				close(mypipe[0]);
-				wait(pid);
-				feedbackComplete("*** CANCELLED ***");
-				return true;
-				}
-			}
-		setStatus("Scanning used blocks...");
-		backupPID = pid;
-		startTimer(1);
-		// printf("%s Scanning used blocks...",&globalBuf[30]); fflush(stdout);
-		if ((n = read(mypipe[0],&hdr,sizeof(pc_hdr))) != sizeof(pc_hdr)) {
-			if (has_interrupted) progressBar(0,0,PROGRESS_CANCEL);
-			backupPID = 0;
-			close(mypipe[0]);
-			wait(pid,&status,0);
-			stopTimer();
-			if (has_interrupted) { feedbackComplete("*** CANCELLED ***"); return true; }
-			else setStatus(NULL);
-			if (type == PART_EXT2 || type == PART_EXT3 || type == PART_EXT4) debug(ABORT,1,"Image header issue; try e2fsck first");
-			else debug(ABORT,1,"Image header issue"); // except when doing DD; then it's something else
+	if (ui_mode) {
+		progressBar(0,PROGRESS_GREEN,PROGRESS_INIT); // reset progress bar for feedback
+		if (progressBar(0,0,PROGRESS_UPDATE)) { // it was cancelled
+			feedbackComplete("*** CANCELLED ***");
 			return true;
 			}
-		backupPID = 0;
-		stopTimer();
-		debug(INFO,1,"block: %i, fixed: %i, used: %lu, total: %lu\n",hdr.blocksize,PC_FIXED,hdr.usedblocks,hdr.totalblocks);
-		if (ui_mode) setStatus("Processing");
-		progressBar(hdr.usedblocks * (hdr.blocksize + 4) + PC_FIXED + hdr.totalblocks, PROGRESS_GREEN, PROGRESS_INIT);
-		if (writeFile(&hdr,n,arch) == -1) {
-			close(mypipe[0]);
-			wait(pid);
+		}
+	setStatus("Scanning used blocks...");
+	startTimer(1);
+	// printf("%s Scanning used blocks...",&globalBuf[30]); fflush(stdout);
+	n = SYSRES_PCLONE_Map(type,ARGCOUNT,argv,NULL,&image); // partclone scans; we send its image
+	stopTimer();
+	if (n) {
+		if (has_interrupted) { progressBar(0,0,PROGRESS_CANCEL); feedbackComplete("*** CANCELLED ***"); return true; }
+		else setStatus(NULL);
+		if (type == PART_EXT2 || type == PART_EXT3 || type == PART_EXT4) debug(ABORT,1,"Image header issue; try e2fsck first");
+		else debug(ABORT,1,"Image header issue"); // except when doing DD; then it's something else
+		return true;
+		}
+	debug(INFO,1,"block: %u, used: %llu, total: %llu, sum: %u\n",image.blockSize,image.usedBlocks,image.totalBlocks,image.sumBlocks);
+	if (ui_mode) setStatus("Processing");
+	progressBar(SYSRES_PCLONE_Bytes(&image), PROGRESS_GREEN, PROGRESS_INIT);
+	buf = (io = poolGet(true))->data;
+	if (SYSRES_PCLONE_Open(&image,device,&stream)) {
+		poolPut(io);
+		SYSRES_PCLONE_Release(&image);
+		debug(ABORT,1,"Unable to open %s",device);
+		return true;
+		}
+	while((n = SYSRES_PCLONE_Stream(&stream,buf,SYSRES_PCLONE_BATCH_D)) > 0) {
+		if (writeFile(buf,n,arch) == -1) {
+			SYSRES_PCLONE_Close(&stream);
+			SYSRES_PCLONE_Release(&image);
+			poolPut(io);
 			feedbackComplete("*** WRITE ERROR ***");
 			return true;
-			}; // write out header
-		while((n = read(mypipe[0],buf,4096)) > 0) {
-			if (writeFile(buf,n,arch) == -1) {
-				close(mypipe[0]);
-                        	wait(pid);
-                        	feedbackComplete("*** WRITE ERROR ***");
-                        	return true;
-				}
-			if (progressBar(arch->originalBytes, arch->fileBytes, PROGRESS_UPDATE)) { // it was cancelled
-				close(mypipe[0]);
-				wait(pid);
-				feedbackComplete("*** CANCELLED ***");
-				return true;
-				}
 			}
-		// if (hdr.usedblock * (hdr.blocksize + 4) + PC_FIXED + hdr.totalblocks != arch->originalBytes)...
-		close(mypipe[0]);
-		signFile(arch);
-//		wait(pid);
-		waitpid(pid,&status,0);
-		if (status) { debug(ABORT,1,"Non-zero exit code from pclone engine"); return true; }
-		progressBar(0, arch->fileBytes, PROGRESS_OK);
+		if (progressBar(arch->originalBytes, arch->fileBytes, PROGRESS_UPDATE)) { // it was cancelled
+			SYSRES_PCLONE_Close(&stream);
+			SYSRES_PCLONE_Release(&image);
+			poolPut(io);
+			feedbackComplete("*** CANCELLED ***");
+			return true;
+			}
 		}
+	SYSRES_PCLONE_Close(&stream);
+	SYSRES_PCLONE_Release(&image);
+	poolPut(io);
+	if (n < 0) {
+		if (has_interrupted) { // between batches
+			progressBar(0,0,PROGRESS_CANCEL);
+			feedbackComplete("*** CANCELLED ***");
+			}
+		else debug(ABORT,1,"Error reading %s",device);
+		return true;
+		}
+	signFile(arch);
+	progressBar(0, arch->fileBytes, PROGRESS_OK);
 	return false;
 	}
 
+// --estimate (F4 in the UI) samples what each entry would store and trial-compresses the samples with the
+// chosen codec before anything is written. Partclone entries are sampled among their used blocks, read from
+// the bitmap partclone sends ahead of them, so the ratio applies to the data it would actually send.
+#define ESTIMATE_SAMPLES 64	// samples per entry, spread evenly over its data
+#define ESTIMATE_SAMPLE (1024 * 1024)	// most bytes read per sample
+#define ESTIMATE_PROBE (32 * 1024 * 1024)	// sequential bytes read to time the device
+
+struct {
+	unsigned long data;	// bytes the engines would send
+	unsigned long archived;	// what they'd compress to
+	double seconds;
+	} estimate;
+
+// partclone's used blocks as a block map; returns the bytes its image would be, 0 when it can't tell us
+unsigned long pcloneMap(char *device, unsigned char type, SYSRES_BLOCKMAP_T *map, unsigned int *blockSize) {
+	SYSRES_PCLONE_IMAGE_T image;
+	char sumMode[2], sumSpan[12];
+	char *argv[ARGCOUNT];
+	pcloneArgs(argv,sumMode,sumSpan,device);
+	if (SYSRES_PCLONE_Map(type,ARGCOUNT,argv,NULL,&image)) return 0;
+	*map = image.map; // ours now
+	*blockSize = image.blockSize;
+	return SYSRES_PCLONE_Bytes(&image);
+	}
+
+// one sample: read it, then compress it into the trial spool
+bool estimateSample(int fd, unsigned long offset, unsigned long length, unsigned char *buf, archive *trial, unsigned long *sampled, unsigned long *codecTime) {
+	unsigned long start;
+	int n;
+	if ((n = pread64(fd,buf,length,offset)) <= 0) return (n < 0);
+	start = nanoTime();
+	if (writeFile(buf,n,trial) == -1) return true;
+	*codecTime += nanoTime() - start;
+	*sampled += n;
+	return false;
+	}
+
+bool estimateEntry(unsigned char state, unsigned char type, char *device, unsigned long length) {
+	archive trial;
+	SYSRES_BLOCKMAP_T map = { 0 };
+	unsigned char *buf = ioBuffer();
+	unsigned long long block, end, used, blocks;
+	unsigned long data = 0;
+	unsigned long sampled = 0, codecTime = 0, probed = 0, readTime, archived;
+	unsigned int blockSize = 0;
+	int i, n, fd, sink, count = ESTIMATE_SAMPLES;
+	bool failed = false;
+	double readRate, codecRate, rate;
+	if (state == ST_CLONE) data = pcloneMap(device,type,&map,&blockSize);
+	if (!data) data = length; // a full image, or partclone's used blocks aren't known: the whole partition
+	if ((fd = open(device,O_RDONLY | O_LARGEFILE)) < 0) { SYSRES_BLOCKMAP_Free(&map); debug(ABORT,1,"Unable to open %s",device); return true; }
+	if ((sink = open("/dev/null",O_WRONLY)) < 0 || createSpool(sink,compression,&trial) != 1) debug(EXIT,0,"Unable to start the trial compressor\n");
+
+	// the device's sequential rate, from the front of it
+	readTime = nanoTime();
+	while (probed < ESTIMATE_PROBE && probed < length && (n = ioRead(fd,buf,IOBUFSIZE)) > 0) probed += n;
+	readTime = nanoTime() - readTime;
+	posix_fadvise(fd,0,probed,POSIX_FADV_DONTNEED);
+
+	if (map.chunk == NULL && length / ESTIMATE_SAMPLE < count) count = (length + ESTIMATE_SAMPLE - 1) / ESTIMATE_SAMPLE; // small enough to read it all
+	for (i = 0; i < count && !failed && !has_interrupted; i++) {
+		if (map.chunk == NULL) { // evenly across the partition
+			failed = estimateSample(fd,(length / count * i) & ~(IOALIGN - 1L),ESTIMATE_SAMPLE,buf,&trial,&sampled,&codecTime);
+			continue;
+			}
+		// evenly among the used blocks: find the rank'th, then take the run of used blocks from there
+		if (!SYSRES_BLOCKMAP_Select(&map,map.used * (2 * i + 1) / (2 * ESTIMATE_SAMPLES),&block) || !SYSRES_BLOCKMAP_Next(&map,&block,&end)) break;
+		if ((end - block) * blockSize > ESTIMATE_SAMPLE) end = block + (ESTIMATE_SAMPLE + blockSize - 1) / blockSize;
+		failed = estimateSample(fd,block * blockSize,(end - block) * blockSize,buf,&trial,&sampled,&codecTime);
+		}
+	if (endSpool(&trial) == -1) failed = true;
+	close(sink);
+	close(fd);
+	used = map.used;
+	blocks = map.blocks;
+	SYSRES_BLOCKMAP_Free(&map);
+	if (has_interrupted) return true;
+	if (failed) { debug(ABORT,1,"Unable to sample %s",device); return true; }
+
+	archived = sampled?(unsigned long)((double)data * trial.fileBytes / sampled):data;
+	readRate = (readTime && probed)?(double)probed / readTime:0.0; // bytes per ns
+	codecRate = (codecTime && sampled)?(double)sampled / codecTime:0.0;
+	// partclone reads in its own thread while sysres compresses; the dd engine does one after the other
+	if (state != ST_CLONE) estimate.seconds += (readRate?data / 1e9 / readRate:0) + (codecRate?data / 1e9 / codecRate:0);
+	else if ((rate = (readRate && codecRate && codecRate < readRate)?codecRate:readRate?readRate:codecRate)) estimate.seconds += data / 1e9 / rate;
+	estimate.data += data;
+	estimate.archived += archived;
+	debug(INFO,3,"Estimate for %s: %lu of %lu bytes sampled, %llu used of %llu blocks, read %.0fMB/s, compress %.0fMB/s\n",device,sampled,data,used,blocks,readRate * 1000,codecRate * 1000);
+	if (!ui_mode) {
+		readableSize(data);
+		printf(" %9s",readable);
+		readableSize(archived);
+		printf(" => %9s\n",readable);
+		}
+	return false;
+	}
+
+// runs the data passes of a backup with nothing written, then shows the totals against the target's free space
+void estimateBackup(void) {
+	struct statfs64 fs;
+	unsigned long avail = 0;
+	bzero(&estimate,sizeof(estimate));
+	opCount = 0;
+	if (createBackupIndex(NULL,2 | 8) || createBackupIndex(NULL,3 | 8)) {
+		if (ui_mode) feedbackComplete(has_interrupted?"*** CANCELLED ***":"*** ESTIMATE FAILED ***");
+		return;
+		}
+	if (*currentImage.imagePath && strncmp(currentImage.imagePath,"http://",7) && !statfs64(currentImage.imagePath,&fs)) avail = fs.f_bavail * fs.f_bsize;
+	showEstimate(estimate.data,estimate.archived,(unsigned long)(estimate.seconds + 0.5),avail);
+	}
+
 char *getEngine(unsigned char type, unsigned char state) {
 	switch(state) {
 		case ST_IMG: return (type == DISK_MSDOS)?"mbr":(type == DISK_GPT)?"gpt":"prtimg"; break;
@@ -197,6 +350,244 @@ char *getEngine(unsigned char type, unsigned char state) {
 		}
 	}
 
+// called for the spooled entries on a planning pass, in archive order
+void planJob(unsigned char state, unsigned char type, unsigned int major, unsigned int minor, unsigned long length, char *device, disk *d) {
+	backupJob *job;
+	if ((jobList = realloc(jobList,(jobCount + 1) * sizeof(backupJob))) == NULL) debug(EXIT,0,"Unable to allocate backup jobs\n");
+	job = &jobList[jobCount++];
+	bzero(job,sizeof(backupJob));
+	job->device = device;
+	job->major = major;
+	job->minor = minor;
+	job->state = state;
+	job->type = type & TYPE_MASK;
+	job->length = (state == ST_FULL)?d->sectorSize * length:0;
+	job->d = d;
+	job->fd = -1;
+	}
+
+backupJob *findJob(char *device) {
+	int i;
+	for (i=0;i<jobCount;i++) if (jobList[i].device == device) return &jobList[i];
+	return NULL;
+	}
+
+// claim every job on d for the writer (JOB_LIVE) or a worker (JOB_RUN); the caller holds jobLock
+bool claimDisk(disk *d, char status) {
+	int i;
+	for (i=0;i<jobCount;i++) if (jobList[i].d == d && jobList[i].status != JOB_WAIT) return false;
+	for (i=0;i<jobCount;i++) if (jobList[i].d == d) jobList[i].status = status;
+	return true;
+	}
+
+// true if the writer should image this entry itself: parallel jobs are off, or no worker got to its disk first
+bool liveJob(backupJob *job) {
+	bool live;
+	if (job == NULL) return true;
+	pthread_mutex_lock(&jobLock);
+	live = (job->status == JOB_LIVE || claimDisk(job->d,JOB_LIVE));
+	pthread_mutex_unlock(&jobLock);
+	return live;
+	}
+
+// make what's been compressed so far visible to the writer; true means stop
+bool publishJob(backupJob *job, archive *spool) {
+	bool stop;
+	pthread_mutex_lock(&jobLock);
+	job->spooled = spool->segmentOffset;
+	job->originalBytes = spool->originalBytes;
+	stop = jobStop;
+	pthread_cond_broadcast(&jobCond);
+	pthread_mutex_unlock(&jobLock);
+	return (stop || has_interrupted);
+	}
+
+// Map() polls this while partclone scans for a job
+bool jobCancelled(void) {
+	bool stop;
+	pthread_mutex_lock(&jobLock);
+	stop = jobStop;
+	pthread_mutex_unlock(&jobLock);
+	return stop;
+	}
+
+// images one job into its spool on a worker thread; true on error or cancel
+bool spoolJob(backupJob *job, unsigned char *buf) {
+	archive spool;
+	SYSRES_PCLONE_IMAGE_T image;
+	SYSRES_PCLONE_STREAM_T stream;
+	char sumMode[2], sumSpan[12];
+	char *argv[ARGCOUNT];
+	unsigned long bytes = 0;
+	int n, fd;
+	bool failed = false;
+	if (createSpool(job->fd,compression,&spool) != 1) return true;
+	if (job->state == ST_FULL) {
+		if ((fd = open(job->device,O_RDONLY | O_LARGEFILE)) < 0) { debug(INFO,0,"Unable to open %s\n",job->device); return true; }
+		job->expected = job->length;
+		while (bytes < job->length && (n = read(fd,buf,(job->length - bytes < JOBBUF)?job->length - bytes:JOBBUF)) > 0) {
+			bytes += n;
+			if (writeFile(buf,n,&spool) == -1 || publishJob(job,&spool)) break;
+			}
+		close(fd);
+		failed = (bytes != job->length);
+		}
+	else {
+		pcloneArgs(argv,sumMode,sumSpan,job->device);
+		if ((n = SYSRES_PCLONE_Map(job->type,ARGCOUNT,argv,jobCancelled,&image))) {
+			if (n != EINTR) debug(INFO,0,"Unable to scan %s with pclone\n",job->device);
+			return true;
+			}
+		if (SYSRES_PCLONE_Open(&image,job->device,&stream)) {
+			SYSRES_PCLONE_Release(&image);
+			debug(INFO,0,"Unable to open %s\n",job->device);
+			return true;
+			}
+		pthread_mutex_lock(&jobLock);
+		job->expected = SYSRES_PCLONE_Bytes(&image);
+		pthread_mutex_unlock(&jobLock);
+		while ((n = SYSRES_PCLONE_Stream(&stream,buf,JOBBUF)) > 0) {
+			if (writeFile(buf,n,&spool) == -1 || publishJob(job,&spool)) break;
+			}
+		failed = (n != 0);
+		SYSRES_PCLONE_Close(&stream);
+		SYSRES_PCLONE_Release(&image);
+		}
+	if (failed || endSpool(&spool) == -1) return true;
+	return publishJob(job,&spool);
+	}
+
+// takes the next disk nobody has claimed, past the one the writer starts on
+void *backupWorker(void *arg) {
+	unsigned char *buf;
+	ioBuf *io;
+	disk *d;
+	int i;
+	bool failed;
+	buf = (io = poolGet(true))->data;
+	while (1) {
+		pthread_mutex_lock(&jobLock);
+		for (i=0,d=NULL;i<jobCount && !jobStop;i++) if (jobList[i].d != jobList[0].d && claimDisk(jobList[i].d,JOB_RUN)) { d = jobList[i].d; break; }
+		pthread_mutex_unlock(&jobLock);
+		if (d == NULL) break;
+		for (failed=false,i=0;i<jobCount;i++) {
+			if (jobList[i].d != d) continue;
+			if (!failed) failed = spoolJob(&jobList[i],buf);
+			pthread_mutex_lock(&jobLock);
+			jobList[i].status = (failed)?JOB_FAIL:JOB_DONE;
+			pthread_cond_broadcast(&jobCond);
+			pthread_mutex_unlock(&jobLock);
+			}
+		}
+	poolPut(io);
+	return NULL;
+	}
+
+// the writer's side: appends a job's spool as it grows; true on error or cancel
+bool copyJob(backupJob *job, archive *arch) {
+	unsigned char *buf;
+	ioBuf *io;
+	unsigned long pos = 0, spooled, original, expected, total = 0;
+	struct timespec ts;
+	char status;
+	int n;
+	if (addStoredFileToArchive(job->major,job->minor,job->state | compression,arch) != 1) {
+		debug(ABORT,0,"Error adding file to archive; check disk space");
+		return true;
+		}
+	buf = (io = poolGet(true))->data;
+	progressBar(0,PROGRESS_GREEN,PROGRESS_INIT);
+	while (1) {
+		pthread_mutex_lock(&jobLock);
+		if (pos == job->spooled && job->status == JOB_RUN) {
+			clock_gettime(CLOCK_REALTIME,&ts);
+			ts.tv_sec += JOBPOLL / 1000;
+			if ((ts.tv_nsec += (JOBPOLL % 1000) * 1000000L) >= 1000000000L) { ts.tv_sec++; ts.tv_nsec -= 1000000000L; }
+			pthread_cond_timedwait(&jobCond,&jobLock,&ts);
+			}
+		spooled = job->spooled;
+		original = job->originalBytes;
+		expected = job->expected;
+		status = job->status;
+		pthread_mutex_unlock(&jobLock);
+		if (expected != total) progressBar(total = expected,PROGRESS_GREEN,PROGRESS_INIT);
+		if (pos < spooled) {
+			n = pread64(job->fd,buf,(spooled - pos < JOBBUF)?spooled - pos:JOBBUF,pos);
+			if (n <= 0 || writeStored(buf,n,arch) != n) {
+				poolPut(io);
+				debug(ABORT,0,"Error copying %s into the archive; check disk space",job->device);
+				return true;
+				}
+			fallocate(job->fd,FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,pos,n); // hand the space back as we go
+			pos += n;
+			}
+		else if (status == JOB_DONE) break;
+		else if (status == JOB_FAIL) {
+			poolPut(io);
+			if (has_interrupted) { progressBar(0,0,PROGRESS_CANCEL); feedbackComplete("*** CANCELLED ***"); }
+			else debug(ABORT,1,"Unable to image %s",job->device);
+			return true;
+			}
+		if (progressBar(original,arch->fileBytes,PROGRESS_UPDATE)) { // it was cancelled
+			poolPut(io);
+			feedbackComplete("*** CANCELLED ***");
+			return true;
+			}
+		}
+	poolPut(io);
+	arch->originalBytes = original;
+	signFile(arch);
+	progressBar(0, arch->fileBytes, PROGRESS_OK);
+	return false;
+	}
+
+// plans the data passes and starts workers for the disks after the first; false leaves the backup serial
+bool startBackupJobs(archive *arch) {
+	int i, n;
+	unsigned int ops = opCount;
+	if (diskJobs < 2 || arch->stream) return false;
+	createBackupIndex(arch,2 | 4);
+	createBackupIndex(arch,3 | 4);
+	opCount = ops;
+	for (i=0,n=0;i<jobCount;i++) if (jobList[i].d != jobList[0].d && (!i || jobList[i].d != jobList[i-1].d)) n++; // disks the writer doesn't start on
+	if (!n) { endBackupJobs(); return false; }
+	for (i=0;i<jobCount;i++) {
+		if (jobList[i].d == jobList[0].d) continue; // the writer images these itself
+		if ((jobList[i].spoolName = malloc(strlen(arch->archiveName) + 16)) == NULL) debug(EXIT,0,"Unable to allocate backup jobs\n");
+		sprintf(jobList[i].spoolName,"%s.job%i",arch->archiveName,i);
+		if ((jobList[i].fd = open(jobList[i].spoolName,O_RDWR | O_CREAT | O_TRUNC | O_LARGEFILE,S_IRUSR | S_IWUSR)) < 0) {
+			debug(INFO,1,"Unable to create spool %s; backing up one disk at a time\n",jobList[i].spoolName);
+			endBackupJobs();
+			return false;
+			}
+		if (!unlink(jobList[i].spoolName)) { free(jobList[i].spoolName); jobList[i].spoolName = NULL; } // some shares can't unlink an open file; endBackupJobs() retries
+		}
+	for (i=0;i<n && i < diskJobs - 1;i++) {
+		if (pthread_create(&jobTID[jobThreads],NULL,backupWorker,NULL)) break;
+		jobThreads++;
+		}
+	debug(INFO,3,"Backup jobs: %i entries, %i workers\n",jobCount,jobThreads);
+	return true;
+	}
+
+// stops the workers and drops the spools
+void endBackupJobs(void) {
+	int i;
+	pthread_mutex_lock(&jobLock);
+	jobStop = true;
+	pthread_cond_broadcast(&jobCond);
+	pthread_mutex_unlock(&jobLock);
+	for (i=0;i<jobThreads;i++) pthread_join(jobTID[i],NULL);
+	for (i=0;i<jobCount;i++) {
+		if (jobList[i].fd != -1) close(jobList[i].fd);
+		if (jobList[i].spoolName != NULL) { unlink(jobList[i].spoolName); free(jobList[i].spoolName); }
+		}
+	free(jobList);
+	jobList = NULL;
+	jobCount = jobThreads = 0;
+	jobStop = false;
+	}
+
 bool populateEntry(archive *arch, char pass, unsigned char state, unsigned char type, unsigned int major, unsigned int minor, unsigned long length, unsigned long start, char *label, char *device, disk *d) {
 	imageEntry e;
 	if (!major && !(pass & 1)) return false; // floating partition (0:0 won't go through this function here)
@@ -225,6 +616,15 @@ bool populateEntry(archive *arch, char pass, unsigned char state, unsigned char
 			}
 		// printf("Populating %i:%i from %s\n",major,minor,device);
 		}
+	else if (state && (type & TYPE_MASK) && (pass & 4)) { // planning parallel jobs; only engine output is spooled
+		if ((state == ST_CLONE || state == ST_FULL) && !(type & DISK_TABLE)) planJob(state,type,major,minor,length,device,d);
+		}
+	else if (state && (type & TYPE_MASK) && (pass & 8)) { // estimating; tables and swap headers are too small to matter
+		if ((state != ST_CLONE && state != ST_FULL) || (type & DISK_TABLE)) return false;
+		setProgress(PROGRESS_BACKUP,(major)?imageDevice:"prt",device,major,minor,type,label,0,state,NULL);
+		setStatus("Sampling...");
+		return estimateEntry(state,type & TYPE_MASK,device,d->sectorSize * length);
+		}
 	else if (state && (type & TYPE_MASK)) { // write an actual partition to the image, using a particular engine
 
 // 0 sda pclone ext3 /boot MB % elapsed        remaining
@@ -246,6 +646,7 @@ bool populateEntry(archive *arch, char pass, unsigned char state, unsigned char
 		// TODO: interrupt handler
 		return readExtraBlocks(d,state,arch);
 		}
+	if (!liveJob(findJob(device))) return copyJob(findJob(device),arch); // a worker imaged it into a spool
         switch(state) {
                 // case ST_IMG: break;
                 case ST_CLONE: return pcloneEngine(device,major,minor,type & TYPE_MASK,arch); break;
@@ -332,7 +733,11 @@ bool beginArchive(archive *arch) {
 	char *title = currentImage.imageTitle;
 	// struct stat64 s;
 	char *name = (ui_mode)?currentImage.imageName:image1.path;
-        sprintf(globalPath,"%s%s",currentImage.imagePath,name);
+	if (!ui_mode && !strcmp(image1.image,STREAMNAME)) { // target=-, archive goes to stdout
+		strcpy(globalPath,STREAMNAME);
+		if (!*title) strcpy(title,"Stream archive");
+		}
+        else sprintf(globalPath,"%s%s",currentImage.imagePath,name);
         if (!*title) title = name;
         if ((len = strlen(title)) < 255) bzero(&title[len],256-len);
         // if (!stat64(globalPath,&s)) debug(EXIT,1,"File %s already exists.\n",name);
@@ -357,7 +762,9 @@ void createBackup(char pass) {
 	if (!testMode && beginArchive(&arch)) return; // error
 	opCount = 0;
 	for (i=0;i<4;i++) { // 4 passes
+		if (i == 2 && !testMode) startBackupJobs(&arch); // the index is out; data passes may run in parallel
 		if (createBackupIndex(&arch,i)) { // cancelled or error -- don't close archive since that will sign it
+			endBackupJobs();
 			if (!testMode) {
 			        if (arch.currentFD != -1) {
 					if (arch.fileHeaderFD != -1 && arch.fileHeaderFD != arch.currentFD) { close(arch.fileHeaderFD); fsync(arch.fileHeaderFD); }
@@ -370,6 +777,7 @@ void createBackup(char pass) {
 			return;
 			};
 		}
+	endBackupJobs();
 	if (!testMode) closeArchive(&arch);
 	if (ui_mode) progressBar(0, arch.fileBytes, PROGRESS_COMPLETE);
 
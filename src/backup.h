@@ -23,7 +23,15 @@
 /*----------------------------------------------------------------------------
 ** Compiler setup
 */
+#define JOBSMAX 8 // most jobs= allowed
+
 extern int backupPID;
+extern int diskJobs;
+
+/*----------------------------------------------------------------------------
+** Function prototypes
+*/
+extern void estimateBackup(void);
 
 /*----------------------------------------------------------------------------
 ** Global storage
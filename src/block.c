@@ -67,13 +67,9 @@ if (!strcmp(dev,"/dev/sda")) debug(EXIT,0,"TRYING TO WRITE TO /dev/sda!!!\n");
 			}
 		}
 	if (n != 0) { debug(ABORT,1,"Chunk integrity error"); return true; }
-	progressBar(arch->originalBytes,arch->originalBytes,PROGRESS_SYNC);
-	startTimer(2);
-	fsync(fd);  // make sure it's flushed
-	stopTimer();
+	syncLater(fd,dev);  // flushed while the next file is restored
 	progressBar(0,arch->originalBytes,PROGRESS_OK);
 	progressBar(arch->originalBytes,arch->originalBytes,PROGRESS_OK | 1);
-	close(fd);
 	return false;
 	}
 
@@ -156,12 +152,8 @@ bool restoreSwap(char *dev, archive *arch) { // could also just use the dd engin
 	progressBar(arch->expectedOriginalBytes,PROGRESS_RED,PROGRESS_INIT);
 	if (readBlock(fd,arch->expectedOriginalBytes,arch,false)) { debug(ABORT,1,"Swap write issue"); return true; }
 	debug(INFO,2,"Swap to %s, %lu\n",dev,arch->expectedOriginalBytes);
-        progressBar(arch->originalBytes,arch->originalBytes,PROGRESS_SYNC);
-	startTimer(2);
-        fsync(fd);  // make sure it's flushed
-	stopTimer();
+        syncLater(fd,dev);  // flushed while the next file is restored
         progressBar(0,arch->originalBytes,PROGRESS_OK);
 	progressBar(arch->originalBytes,arch->originalBytes,PROGRESS_OK | 1); // update global counter
-	close(fd);
 	return false;
 	}
@@ -38,7 +38,7 @@
   #include <unistd.h>
 
   /* System Restore */
-  #include "backup.h"				// backupPID
+  #include "backup.h"				// backupPID, diskJobs
   #include "cli.h"          // Validate self-compatibility.
   #include "drive.h"				// mapTypes
   #include "fileEngine.h"		// arch_md_len
@@ -50,6 +50,7 @@
   #include "restore.h"  		// performRestore(), renameImage(), locateImage(), globalPath2
   #include "sysres_debug.h"	// SYSRES_DEBUG_level
   #include "sysres_linux.h" // SYSRES_LINUX_SetKernelLogging()
+  #include "sysres_multicast.h" // SYSRES_MULTICAST_Send()
   #include "sysres_signal.h"  // SYSRES_SIGNAL_SIGINT_Handler()
   #include "sysres_xterm.h" // SYSRES_XTERM_CURSOR_ON
   #include "window.h"     	// globalPath, options, mode, currentFocus, setup, modeset, shellset, performVerify, performValidate
@@ -84,11 +85,16 @@
 	char                   force              = 0;
 	int                    segment_size       = 0;
 	char                   compression        = GZIP; // default; change with compression= option
+	int                    pcloneSum          = 1;    // pcsum= blocks per partclone checksum; 0 = none, leaving only the archive's SHA1
 	char                  *cifsUser           = NULL;
 	char                  *cifsPass           = NULL;
 	unsigned int           usbDelay           = 0;
 	bool                   kernelMode         = false;
 	volatile pthread_t     threadTID          = 0;
+	char                  *mcastGroup         = NULL; // group=<address>[:<port>] for multicast
+	int                    mcastClients       = 0;    // clients= receivers to wait for
+	int                    mcastRate          = 0;    // rate= Mbit/s limit
+	int                    libraryReads       = 0;    // reads= library verify reads in flight
   char                  *kernelCmdBuffer;
   char                  *kernelArgv[MAX_ARGS];
 	char                   drive_filter[MAXDISK][MAXDRIVES]; // drives= option to restrict drives included in scan
@@ -119,13 +125,17 @@ void usage(const char *I__programPath)
 		programName = I__programPath;
 
 	fprintf(stderr,"\nUsage: %s [ui] [backup|list|rename|restore|verify] <options>\n\n", programName); // transfer
-	fprintf(stderr,"       backup source=... target=<image> desc=<title> segment=<MB> compression=[none|zlib|lzma]\n");
+	fprintf(stderr,"       backup source=... target=<image> desc=<title> segment=<MB> compression=[none|zlib|lzma] [pcsum=<blocks>] [jobs=<disks>] [--estimate]\n");
 	fprintf(stderr,"       detail | <list [restore...|backup...]>\n");
   fprintf(stderr,"       rename source=<image> desc=<title>\n");
-  fprintf(stderr,"       restore source=<image> target=... [--addimg]\n");
-	fprintf(stderr,"       verify [list|detail] source=<image>\n\n");
-	fprintf(stderr,"       <image>=//label/<path>,/dev/<device>/<path>,<path>\n");
+  fprintf(stderr,"       restore source=<image> target=... [streams=<count>] [jobs=<disks>] [--addimg] [--tee] [--direct]\n");
+	fprintf(stderr,"       verify [list|detail] source=<image> [--deep]\n");
+	fprintf(stderr,"       verify source=<directory|list> [jobs=<archives>] [streams=<count>] [reads=<count>] [rate=<Mbit per share>] [--deep]\n");
+	fprintf(stderr,"       multicast source=<image> group=<address>[:<port>] clients=<count> rate=<Mbit>\n");
+	fprintf(stderr,"                      (receive with restore source=%s<address>[:<port>])\n\n",SYSRES_MULTICAST_PREFIX_D);
+	fprintf(stderr,"       <image>=//label/<path>,/dev/<device>/<path>,<path>,- (stream to stdout/from stdin)\n");
 	fprintf(stderr,"       drives=<device,...>  (limits the disks to scan)\n");
+	fprintf(stderr,"       buffers=<MB>         (memory for data buffers; default %i)\n",POOLBUDGET);
   fprintf(stderr,"       restrict=<complete,incomplete,direct,loop,restore,backup,partial,custom>\n");
   fprintf(stderr,"       source=<drive>:<map><mbr|part|//label> (map: blank=default, -=remove, or:)\n");
 	fprintf(stderr,"              mbr: *=mbr only, #=mbr+32KB, +=mbr+32MB, x=mbr+all free space\n");
@@ -138,6 +148,9 @@ void usage(const char *I__programPath)
 	fprintf(stderr,"       --buffer       copy image to buffer first (restore mode)\n");
   fprintf(stderr,"       --debug        show additional information to debug issues\n");
 	fprintf(stderr,"       --delay        wait %i seconds for USB drives to settle (can use multiple times)\n",STARTDELAY);
+	fprintf(stderr,"       --deep         verify by decompressing every file rather than hashing the stored data\n");
+	fprintf(stderr,"       --direct       restore full images around the page cache (O_DIRECT)\n");
+	fprintf(stderr,"       --estimate     sample the backup and predict its archive size and duration\n");
   fprintf(stderr,"       --force        over-write existing archive\n");
 	fprintf(stderr,"       --halt         same as --poweroff\n");
   fprintf(stderr,"       --help         this usage screen\n");
@@ -146,6 +159,7 @@ void usage(const char *I__programPath)
 	fprintf(stderr,"       --poweroff     power off after successful completion\n");
   fprintf(stderr,"       --ramdisk      mount the ram disk\n");
 	fprintf(stderr,"       --reboot       reboot after successful completion\n");
+  fprintf(stderr,"       --tee          restore each image partition to all its targets from one read\n");
   fprintf(stderr,"       --test         don't perform any backup/restore operations\n");
   fprintf(stderr,"       --version      display the version of this program\n\n");
 
@@ -260,6 +274,9 @@ int mapLocation(navImage *loc, selection *sel, char localize, bool isScript)
 	if(!strncmp(image,"cifs://",7))
 		return 0; // scan after mounting later
 
+	if(isStreamName(image))
+		return 0; // stdout/stdin stream or multicast group; nothing to locate
+
   // check if loc is a directory, a file, or doesn't exist, to determine local mount location
 	if(loc->path != NULL)
 		{
@@ -611,6 +628,8 @@ void readOption(char *param, char *val)
 			show_list |= 4; // verify (list/detail imply only show the sha1sum)
 		else if(!strcmp(param,"rename"))
 			show_list |= 8;
+		else if(!strcmp(param,"multicast"))
+			show_list |= 32; // send an image to multicast receivers
 		else if(!strcmp(param,"--auto"))
 			options |= OPT_AUTO; // select F1, F2 if available
 		else if(!strcmp(param,"--reboot"))
@@ -629,8 +648,16 @@ void readOption(char *param, char *val)
 			makedir = 1;
 		else if(!strcmp(param,"--anypart"))
 			options |= OPT_ANYPART;
+		else if(!strcmp(param,"--direct"))
+			options |= OPT_DIRECT; // full image writes bypass the page cache
+		else if(!strcmp(param,"--tee"))
+			options |= OPT_TEE; // identical targets share one read of each archive file
 		else if(!strcmp(param,"--test"))
 			testMode = 1; // don't do any backup/restore/erase/copy operations
+		else if(!strcmp(param,"--deep"))
+			options |= OPT_DEEP; // verify decompresses every file, not just its stored bytes
+		else if(!strcmp(param,"--estimate"))
+			options |= OPT_ESTIMATE; // predict the backup's archive size and duration instead of writing it
 		else if(!strcmp(param,"--addimg"))
 			add_img = 1; // required to copy image onto RESTORE partition
 		else if(!strcmp(param,"--force"))
@@ -676,6 +703,16 @@ void readOption(char *param, char *val)
 		if(*val < '0' || *val > '9' || ((segment_size = atoicheck(val)) < 1))
 			debug(EXIT, 1,"Segment size must be a positive number\n");
 		}
+	else if(!strcmp(param,"pcsum"))
+		{
+		if(*val < '0' || *val > '9' || ((pcloneSum = atoicheck(val)) < 0))
+			debug(EXIT, 1,"Checksum span must be 0 (none) or a number of blocks\n");
+		}
+	else if(!strcmp(param,"jobs"))
+		{
+		if(*val < '0' || *val > '9' || ((diskJobs = atoicheck(val)) < 1) || diskJobs > JOBSMAX)
+			debug(EXIT, 1,"Jobs must be between 1 and %i\n",JOBSMAX);
+		}
 	else if(!strcmp(param,"compression"))
 		{
 		if(!strcmp(val,"none"))
@@ -691,6 +728,38 @@ void readOption(char *param, char *val)
 		{
 		readValues(val,3);
 		}
+	else if(!strcmp(param,"group"))
+		{
+		if(!*val)
+			debug(EXIT, 1,"Multicast group cannot be blank\n");
+
+		mcastGroup = val;
+		}
+	else if(!strcmp(param,"clients"))
+		{
+		if(*val < '0' || *val > '9' || ((mcastClients = atoicheck(val)) < 1))
+			debug(EXIT, 1,"Client count must be a positive number\n");
+		}
+	else if(!strcmp(param,"streams"))
+		{
+		if(*val < '0' || *val > '9' || ((readStreams = atoicheck(val)) < 1) || readStreams > AHEADMAX)
+			debug(EXIT, 1,"Streams must be between 1 and %i\n",AHEADMAX);
+		}
+	else if(!strcmp(param,"reads"))
+		{
+		if(*val < '0' || *val > '9' || ((libraryReads = atoicheck(val)) < 1))
+			debug(EXIT, 1,"Reads must be a positive number\n");
+		}
+	else if(!strcmp(param,"buffers"))
+		{ // capped to a quarter of memory when the pool is made
+		if(*val < '0' || *val > '9' || ((poolBudget = atoicheck(val)) < IOBUFSIZE / (1024 * 1024)))
+			debug(EXIT, 1,"Buffers must be at least %i MB\n",IOBUFSIZE / (1024 * 1024));
+		}
+	else if(!strcmp(param,"rate"))
+		{
+		if(*val < '0' || *val > '9' || ((mcastRate = atoicheck(val)) < 1))
+			debug(EXIT, 1,"Rate must be a positive number of Mbit/s\n");
+		}
 	else if(!strcmp(param,"desc"))
 		{ // blank=just display filename
 		if(*currentImage.imageTitle)
@@ -1839,6 +1908,9 @@ debug(INFO, 1,"%sPROGRAM START [disk %i/part %i/int %i/ptr %i/width %d] PPID %i
 	if(modeset && ((show_list & (1|4)) == (1|4)))
 		debug(EXIT, 1,"The verify list option is not available in UI mode.\n");
 
+	if((show_list & 32) && (modeset || (mode != -1 && mode != LIST)))
+		debug(EXIT, 1,"Multicast cannot be combined with a mode or UI.\n");
+
 	if(show_list & 16)
 		{
 		show_list &= ~16; version();
@@ -1935,7 +2007,7 @@ debug(INFO, 1,"%sPROGRAM START [disk %i/part %i/int %i/ptr %i/width %d] PPID %i
 
 		if(*image1.image)
 			{
-			if(image1.path == NULL && (options & OPT_AUTO))
+			if(image1.path == NULL && (options & OPT_AUTO) && !isStreamName(image1.image))
 				autoSel(image1.image,0);
 
 			populateImage(NULL,0);
@@ -2031,6 +2103,9 @@ debug(INFO, 1,"%sPROGRAM START [disk %i/part %i/int %i/ptr %i/width %d] PPID %i
 	if((show_list & 8) && (show_list != 8 || (mode != LIST)))
 		debug(EXIT, 1,"Rename option cannot be mixed with other options.\n");
 
+	if((show_list & 32) && (show_list != 32 || mcastGroup == NULL))
+		debug(EXIT, 1,"Multicast needs a source and group, and cannot be mixed with other options.\n");
+
 	switch(mode)
 		{
 		case RESTORE:
@@ -2046,7 +2121,13 @@ debug(INFO, 1,"%sPROGRAM START [disk %i/part %i/int %i/ptr %i/width %d] PPID %i
 				if(show_list == 4)
 					{ // verify the entire archive
 					locateImage();
-					copyImage(NULL,globalPath,NULL,true);
+					if(options & OPT_DEEP)
+						{
+						if(verifyImage(globalPath,1) != 1)
+							validOperation = 0; // decode every file as well
+						}
+					else
+						copyImage(NULL,globalPath,NULL,true);
 					}
 				else if(listDisks(NULL) == 0)
 					debug(EXIT, 1,"Nothing to restore.\n");
@@ -2078,6 +2159,15 @@ debug(INFO, 1,"%sPROGRAM START [disk %i/part %i/int %i/ptr %i/width %d] PPID %i
 				break;
 				}
 
+			if(options & OPT_ESTIMATE)
+				{
+				estimateBackup(); // the target is optional; it's only asked for its free space
+				if(!validOperation)
+					debug(EXIT, 1,"Nothing to archive.\n");
+
+				break;
+				}
+
 			if(!*image1.image)
 				debug(EXIT, 1,"Missing image filename.\n");
 
@@ -2105,14 +2195,41 @@ debug(INFO, 1,"%sPROGRAM START [disk %i/part %i/int %i/ptr %i/width %d] PPID %i
 					break;
 					}
 
+				if(show_list & 32)
+					{
+					locateImage();
+					if(SYSRES_MULTICAST_Send(globalPath,mcastGroup,mcastClients,mcastRate))
+						debug(EXIT, 1,"Multicast of %s failed.\n",globalPath);
+
+					break;
+					}
+
 				if(*image1.image)
 					{
+					if(show_list == 4)
+						{ // a directory or a list of archives is verified as a library
+						locateImage();
+						if((i = verifyLibrary(globalPath,mcastRate,libraryReads)) != -1)
+							{
+							if(!i)
+								exit(1);
+
+							break;
+							}
+						}
+
 					populateImage(NULL,0);
 					validOperation = 1;
 					if(show_list == 4)
 						{
 						locateImage();
-						copyImage(NULL,globalPath,NULL,true);
+						if(options & OPT_DEEP)
+							{
+							if(verifyImage(globalPath,1) != 1)
+								validOperation = 0;
+							}
+						else
+							copyImage(NULL,globalPath,NULL,true);
 						}
 					else
 						listDisks(&iset);
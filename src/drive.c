@@ -47,7 +47,7 @@ extern char pbuf[];
 unsigned char pimage_types[] = PARTIMG;
 unsigned char fsarch_types[] = FSARCH;
 unsigned char pclone_types[] = PCLONE;
-char *types[] = { "empty", "msdos", "vfat", "ntfs", "ext2", "ext3", "ext4", "xfs", "swap", "block" };
+char *types[] = { "empty", "msdos", "vfat", "ntfs", "ext2", "ext3", "ext4", "xfs", "swap", "block", "btrfs", "f2fs", "exfat", "lvm" };
 char *mapTypes[] = { "", "loop", "partial", "complete", "restore", "incomplete", "custom", "direct", "backup" }; // first entry should remain ""
 
 #define MAXPDEF 80
@@ -22,6 +22,7 @@
 #define __USE_LARGEFILE64
 // #define _LARGEFILE_SOURCE
 #define _LARGEFILE64_SOURCE
+#define _GNU_SOURCE	// sync_file_range()
 
 #include <errno.h>
 #include <fcntl.h>
@@ -30,71 +31,149 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/sysmacros.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "fileEngine.h"
 #include "mount.h"				// globalBuf
 #include "partition.h"
 #include "restore.h"			// mbrBuf
 #include "sysres_debug.h"	// SYSRES_DEBUG_Debug(), SYSRES_DEBUG_level
+#include "sysres_multicast.h"	// SYSRES_MULTICAST_Receive()
 
 #define CLR_YB 4        	// mounted parts
 
 extern volatile sig_atomic_t has_interrupted;
 
-unsigned char fileBuf[FBUFSIZE];
+// per thread: parallel restore jobs each read their own files from the archive
+__thread unsigned char fileBuf[FBUFSIZE];
 unsigned char hdr[HDRSIZE];
-unsigned char sha1buf[24];
+__thread unsigned char sha1buf[24];
 
 int arch_md_len = 0;
-unsigned char compressBuf[FBUFSIZE];
+__thread char codecLevel[2] = { GZIPLEVEL, LZMALEVEL }; // where the level controller left each codec; the thread's next stream starts there
+
+int streamFD = -1;	// stdin, or the multicast receiver pipe
+unsigned char *streamReplay = NULL;	// stream bytes kept so a stream archive can be re-opened
+unsigned long streamCaptured = 0;	// bytes held in streamReplay
+unsigned long streamPosition = 0;	// read position within the stream
 
 #ifdef SSL
 #include <openssl/evp.h>
 const EVP_MD *md;
-EVP_MD_CTX mdctx;
-unsigned char md_value[EVP_MAX_MD_SIZE];
+__thread EVP_MD_CTX mdctx;
+__thread unsigned char md_value[EVP_MAX_MD_SIZE];
 void sha1Init(void) { EVP_MD_CTX_init(&mdctx); EVP_DigestInit_ex(&mdctx,md,NULL); }
 void sha1Update(unsigned char *buf, int size) { EVP_DigestUpdate(&mdctx,buf,size); }
-void sha1Finalize(void) { EVP_DigestFinal_ex(&mdctx,md_value,&arch_md_len); EVP_MD_CTX_cleanup(&mdctx); }
+void sha1Finalize(void) { unsigned int len; EVP_DigestFinal_ex(&mdctx,md_value,&len); EVP_MD_CTX_cleanup(&mdctx); }
 #else
 #ifdef GCRYPT
 #include <gcrypt.h>
-gcry_md_hd_t digest = NULL;
-unsigned char *md_value;
-void sha1Init(void) { gcry_md_reset(digest); }
+__thread gcry_md_hd_t digest = NULL;
+__thread unsigned char *md_value;
+void sha1Init(void) { if (digest == NULL) gcry_md_open(&digest,GCRY_MD_SHA1,GCRY_MD_FLAG_SECURE); else gcry_md_reset(digest); } // threads after the first open their own
 void sha1Update(unsigned char *buf, int size) {  gcry_md_write(digest,buf,size); }
 void sha1Finalize(void) { md_value = gcry_md_read(digest,GCRY_MD_SHA1); }
 #else
 #include "sha1.h"
-hash_state md;
-unsigned char md_value[20];
+__thread hash_state md;
+__thread unsigned char md_value[20];
 void sha1Init(void) { sha1_init(&md); }
 void sha1Update(unsigned char *buf, int size) { sha1_process(&md,buf,size); }
-void sha1Finalize(void) { sha1_done(&md,md_value); arch_md_len = 20; }
+void sha1Finalize(void) { sha1_done(&md,md_value); }
 #endif
 #endif
 
 int flushBufferToArchive(unsigned char *buf, unsigned int size,archive *arch);
+int flushFrameToArchive(unsigned char *buf, unsigned int size, archive *arch);
+int addStoredFileToArchive(unsigned int major, unsigned int minor, unsigned char compression, archive *arch);
+int readStreamFrame(archive *arch);
+int verifyImage(char *path, char inflate);
+void closeSegment(archive *arch);
+void endReadAhead(archive *arch);
 
 /****************************
 	COMPRESSION FUNCTIONS
 ****************************/
 
+unsigned long nanoTime(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+	}
+
+// samples the chunk's byte entropy; true when compressing it isn't worth the CPU
+// Renyi (collision) entropy is a lower bound of Shannon's and needs no logs: -log2(sum p^2) >= log2(ENTROPYRATIO) <=> sum(c^2) * ENTROPYRATIO <= n^2
+bool incompressible(unsigned char *buf, int size) {
+	unsigned int count[256];
+	unsigned long sum = 0, n = ENTROPYSLICES * ENTROPYSLICE;
+	int i, j, step = size / ENTROPYSLICES;
+	if (step < ENTROPYSLICE) return false; // too small to judge
+	bzero(count,sizeof(count));
+	for (i = 0; i < ENTROPYSLICES; i++) for (j = 0; j < ENTROPYSLICE; j++) count[buf[i * step + j]]++;
+	for (i = 0; i < 256; i++) sum += (unsigned long)count[i] * count[i];
+	return (sum * ENTROPYRATIO <= n * n);
+	}
+
+// moves the stream's level one step towards balance: the compressor shouldn't take longer per byte than producing its input, nor idle at half of it
+void tuneCompressor(archive *arch) {
+	int codec = (arch->state & GZIP) ? 0 : 1;
+	int max = codec ? LZMAMAX : GZIPMAX;
+	double feed, codecRate;
+	if (arch->codecBytes && arch->feedTime) {
+		feed = (double)arch->feedTime / arch->feedBytes; // ns per byte
+		codecRate = (double)arch->codecTime / arch->codecBytes;
+		if (codecRate > feed * 1.25 && codecLevel[codec] > 1) codecLevel[codec]--;
+		else if (codecRate * 2 < feed && codecLevel[codec] < max) codecLevel[codec]++;
+		debug(INFO, 5,"Compressor at %i: %.2f ns/byte, input %.2f ns/byte\n", codecLevel[codec], codecRate, feed);
+		}
+	arch->feedTime = arch->feedBytes = arch->codecTime = arch->codecBytes = 0;
+	}
+
+// deflate switches level between chunks, flushing what it holds at the old one; level 0 gives stored blocks
+int gzipLevel(archive *arch, int level) {
+	int n, res;
+	unsigned char out[ZBUFSIZE];
+	arch->strm.avail_in = 0;
+	do {
+		arch->strm.avail_out = ZBUFSIZE;
+		arch->strm.next_out = out;
+		if ((res = deflateParams(&arch->strm,level,Z_DEFAULT_STRATEGY)) != Z_OK && res != Z_BUF_ERROR) { deflateEnd(&arch->strm); debug(INFO, 0,"Zlib deflate error.\n"); return -1; }
+		if ((n = ZBUFSIZE - arch->strm.avail_out)) {
+			if (!arch->spool) sha1Update(out,n);
+			arch->fileBytes += n;
+			if (flushFrameToArchive(out,n,arch) != n) { deflateEnd(&arch->strm); debug(INFO, 0,"Stream length mismatch\n"); return -1; }
+			}
+		} while (res == Z_BUF_ERROR && n);
+	if (res == Z_OK) arch->level = level; // otherwise it stays at the old level for now
+	return 1;
+	}
+
 int gzipCompress(archive *arch, unsigned char *buf, int size) {
 	int deflateFlag = (size)?Z_NO_FLUSH:Z_FINISH;
 	int n;
+	unsigned long start;
+	unsigned char out[ZBUFSIZE]; // not compressBuf; spool jobs compress alongside the writer
 	arch->strm.avail_in = size;
 	arch->strm.next_in = buf; // buf, but we should be able to leave it at null if we're done
 	do {
-		arch->strm.avail_out = FBUFSIZE;
-		arch->strm.next_out = compressBuf;
-		if ((n = deflate(&arch->strm,deflateFlag)) < 0) { deflateEnd(&arch->strm); debug(INFO, 0,"Zlib deflate error.\n"); return -1; }
-		if (arch->strm.avail_out != FBUFSIZE) {
-			sha1Update(compressBuf,FBUFSIZE-arch->strm.avail_out);
-			arch->fileBytes += FBUFSIZE - arch->strm.avail_out;
-			n = flushBufferToArchive(compressBuf,FBUFSIZE-arch->strm.avail_out,arch);
-			if (n != (FBUFSIZE-arch->strm.avail_out)) { deflateEnd(&arch->strm); debug(INFO, 0,"Stream length mismatch\n"); return -1; }
+		arch->strm.avail_out = ZBUFSIZE;
+		arch->strm.next_out = out;
+		start = nanoTime();
+		n = deflate(&arch->strm,deflateFlag);
+		if (arch->level) arch->codecTime += nanoTime() - start; // archive writes aren't the compressor's
+		if (n < 0) { deflateEnd(&arch->strm); debug(INFO, 0,"Zlib deflate error.\n"); return -1; }
+		if (arch->strm.avail_out != ZBUFSIZE) {
+			if (!arch->spool) sha1Update(out,ZBUFSIZE-arch->strm.avail_out);
+			arch->fileBytes += ZBUFSIZE - arch->strm.avail_out;
+			n = flushFrameToArchive(out,ZBUFSIZE-arch->strm.avail_out,arch);
+			if (n != (ZBUFSIZE-arch->strm.avail_out)) { deflateEnd(&arch->strm); debug(INFO, 0,"Stream length mismatch\n"); return -1; }
 			}
 		} while(arch->strm.avail_out == 0);
 	if (!size) { deflateEnd(&arch->strm); arch->state &= ~COMPRESSED; }
@@ -106,18 +185,22 @@ int lzmaCompress(archive *arch, unsigned char *buf, int size) {
         int deflateFlag = (size)?LZMA_RUN:LZMA_FINISH;
         int n;
 	int res;
+	unsigned long start;
+	unsigned char out[ZBUFSIZE];
         arch->lstr.avail_in = size;
         arch->lstr.next_in = buf; // buf, but we should be able to leave it at null if we're done
         do {
-                arch->lstr.avail_out = FBUFSIZE;
-                arch->lstr.next_out = compressBuf;
+                arch->lstr.avail_out = ZBUFSIZE;
+                arch->lstr.next_out = out;
+		start = nanoTime();
 		res = lzma_code(&arch->lstr,deflateFlag);
+		arch->codecTime += nanoTime() - start;
 		if (res != LZMA_OK && (!size && res != LZMA_STREAM_END)) { lzma_end(&arch->lstr); debug(INFO, 0,"LZMA deflate error.\n"); return -1; }
-		if (arch->lstr.avail_out != FBUFSIZE) {
-			sha1Update(compressBuf,FBUFSIZE-arch->lstr.avail_out);
-                	arch->fileBytes += FBUFSIZE - arch->lstr.avail_out;
-                	n = flushBufferToArchive(compressBuf,FBUFSIZE-arch->lstr.avail_out,arch);
-                	if (n != (FBUFSIZE-arch->lstr.avail_out)) { lzma_end(&arch->lstr); debug(INFO, 0,"Stream length mismatch\n"); return -1; }
+		if (arch->lstr.avail_out != ZBUFSIZE) {
+			if (!arch->spool) sha1Update(out,ZBUFSIZE-arch->lstr.avail_out);
+                	arch->fileBytes += ZBUFSIZE - arch->lstr.avail_out;
+                	n = flushFrameToArchive(out,ZBUFSIZE-arch->lstr.avail_out,arch);
+                	if (n != (ZBUFSIZE-arch->lstr.avail_out)) { lzma_end(&arch->lstr); debug(INFO, 0,"Stream length mismatch\n"); return -1; }
 			}
                 } while(res != LZMA_STREAM_END && arch->lstr.avail_out == 0);
         if (!size) { lzma_end(&arch->lstr); arch->state &= ~COMPRESSED; }
@@ -131,21 +214,27 @@ int initCompressor(archive *arch, char inflate) {
                 arch->strm.zalloc = Z_NULL;
                 arch->strm.zfree = Z_NULL;
                 arch->strm.opaque = Z_NULL;
-                if (!inflate && (deflateInit2(&arch->strm,Z_DEFAULT_COMPRESSION,Z_DEFLATED,windowBits | GZIP_ENCODING,9,Z_DEFAULT_STRATEGY) < 0)) { debug(INFO, 0,"Zlib init error.\n"); return -1; }
+                if (!inflate && (deflateInit2(&arch->strm,arch->level = codecLevel[0],Z_DEFLATED,windowBits | GZIP_ENCODING,9,Z_DEFAULT_STRATEGY) < 0)) { debug(INFO, 0,"Zlib init error.\n"); return -1; }
 		if (inflate && (inflateInit2(&arch->strm, windowBits | ENABLE_ZLIB_GZIP) < 0)) { debug(INFO, 0,"Zlib init error.\n"); return -1; }
 		}
 #ifdef LIBLZMA
 	else {
 		bzero(&arch->lstr,sizeof(lzma_stream));
 		if (inflate && (lzma_auto_decoder(&arch->lstr,-1,0) != LZMA_OK)) { debug(INFO, 0,"LZMA init error.\n"); return -1; }
-		if (!inflate && (lzma_easy_encoder(&arch->lstr,1,0) != LZMA_OK)) { debug(INFO, 0,"LZMA init error.\n"); return -1; }
+		if (!inflate && (lzma_easy_encoder(&arch->lstr,arch->level = codecLevel[1],0) != LZMA_OK)) { debug(INFO, 0,"LZMA init error.\n"); return -1; }
 		}
 #else
 	else return -1;
 #endif
+	if (inflate && arch->codecIn == NULL) arch->codecIn = poolGet(true);
 	return 1;
 	}
 
+// the decompressor is done with its input; the buffer goes back to the pool
+void endCodecInput(archive *arch) {
+	if (arch->codecIn != NULL) { poolPut(arch->codecIn); arch->codecIn = NULL; }
+	}
+
 int gzipDecompress(unsigned char *buf, int size, archive *arch) {
         int res;
         int n = 0;
@@ -153,12 +242,14 @@ int gzipDecompress(unsigned char *buf, int size, archive *arch) {
                 while(arch->strm.avail_in) {
                         arch->strm.next_out = buf;
                         arch->strm.avail_out = size;
-                        if ((res = inflate(&arch->strm,Z_NO_FLUSH)) < 0) { debug(INFO, 0,"Zlib inflate error.\n"); inflateEnd(&arch->strm); return -1; }
+                        if ((res = inflate(&arch->strm,Z_NO_FLUSH)) < 0) { debug(INFO, 0,"Zlib inflate error.\n"); inflateEnd(&arch->strm); endCodecInput(arch); return -1; }
                         n = size-arch->strm.avail_out;
                         arch->originalBytes += n;
                         if (res == Z_STREAM_END) {
                                 arch->state &= ~COMPRESSED; // no more compression to do
                                 inflateEnd(&arch->strm);
+                                endCodecInput(arch);
+                                if (arch->stream && !arch->frameBytes && readStreamFrame(arch) != 0) return -1; // pick up the size trailer
                                 if (arch->fileBytes != arch->fileSizePosition) return -1;
                                 if (arch->originalBytes != arch->expectedOriginalBytes) return -1;
                                 if (!n) return readSignature(arch,1);
@@ -166,13 +257,14 @@ int gzipDecompress(unsigned char *buf, int size, archive *arch) {
                                 }
                         if (n) return n;
                         }
-                if ((n = readFile(compressBuf,FBUFSIZE,arch,0)) > 0) {
-                        arch->strm.next_in = compressBuf;
+                if ((n = readFile(arch->codecIn->data,IOBUFSIZE,arch,0)) > 0) {
+                        arch->strm.next_in = arch->codecIn->data;
                         arch->strm.avail_in = n;
                         }
                 else {
                         arch->state &= ~COMPRESSED;
                         inflateEnd(&arch->strm);
+                        endCodecInput(arch);
                         if (!n) return readSignature(arch,1);
                         return n;
                         }
@@ -188,12 +280,14 @@ int lzmaDecompress(unsigned char *buf, int size, archive *arch) {
                         arch->lstr.next_out = buf;
                         arch->lstr.avail_out = size;
 			res = lzma_code(&arch->lstr,LZMA_RUN);
-			if ((res != LZMA_OK) && (res != LZMA_STREAM_END)) { debug(INFO, 0,"Zlib inflate error.\n"); lzma_end(&arch->lstr); return -1; }
+			if ((res != LZMA_OK) && (res != LZMA_STREAM_END)) { debug(INFO, 0,"Zlib inflate error.\n"); lzma_end(&arch->lstr); endCodecInput(arch); return -1; }
                         n = size-arch->lstr.avail_out;
                         arch->originalBytes += n;
                         if (res == LZMA_STREAM_END) {
                                 arch->state &= ~COMPRESSED; // no more compression to do
                                 lzma_end(&arch->lstr);
+                                endCodecInput(arch);
+                                if (arch->stream && !arch->frameBytes && readStreamFrame(arch) != 0) return -1; // pick up the size trailer
                                 if (arch->fileBytes != arch->fileSizePosition) return -1;
                                 if (arch->originalBytes != arch->expectedOriginalBytes) return -1;
                                 if (!n) return readSignature(arch,1);
@@ -201,13 +295,14 @@ int lzmaDecompress(unsigned char *buf, int size, archive *arch) {
                                 }
                         if (n) return n;
                         }
-                if ((n = readFile(compressBuf,FBUFSIZE,arch,0)) > 0) {
-                        arch->lstr.next_in = compressBuf;
+                if ((n = readFile(arch->codecIn->data,IOBUFSIZE,arch,0)) > 0) {
+                        arch->lstr.next_in = arch->codecIn->data;
                         arch->lstr.avail_in = n;
                         }
                 else {
                         arch->state &= ~COMPRESSED;
                         lzma_end(&arch->lstr);
+                        endCodecInput(arch);
                         if (!n) return readSignature(arch,1);
                         return n;
                         }
@@ -215,13 +310,26 @@ int lzmaDecompress(unsigned char *buf, int size, archive *arch) {
         }
 #endif
 
+// chunks that sample as incompressible pass through deflate's stored blocks, which any inflate reads;
+// xz can't change its preset mid-stream, so for LZMA the controller's level applies from the thread's next stream
 int compressBuffer(archive *arch, unsigned char *buf, int size) {
-	if (arch->state & GZIP) return gzipCompress(arch,buf,size);
+	int n, level;
+	unsigned long now = nanoTime();
+	if (size && arch->lastCodec) { arch->feedTime += now - arch->lastCodec; arch->feedBytes += size; }
+	if (arch->state & GZIP) {
+		level = (size && incompressible(buf,size)) ? 0 : codecLevel[0];
+		if (size && level != arch->level && gzipLevel(arch,level) == -1) return -1;
+		n = gzipCompress(arch,buf,size);
+		}
 #ifdef LIBLZMA
-	else return lzmaCompress(arch,buf,size);
+	else n = lzmaCompress(arch,buf,size);
 #else
 	else return -1;
 #endif
+	if (size && arch->level) arch->codecBytes += size;
+	if (arch->feedBytes >= TUNEBYTES) tuneCompressor(arch);
+	arch->lastCodec = size ? nanoTime() : 0; // the next stream's first input isn't timed
+	return n;
 	}
 
 int readCompressed(unsigned char *buf, int size, archive *arch) {
@@ -233,6 +341,159 @@ int readCompressed(unsigned char *buf, int size, archive *arch) {
 #endif
 	}
 
+/****************************
+	I/O LAYER
+****************************/
+
+// the engines move whole IOBUFSIZE buffers per call instead of FBUFSIZE at a time
+pthread_key_t ioKey;
+pthread_once_t ioOnce = PTHREAD_ONCE_INIT;
+
+void ioKeyInit(void) { pthread_key_create(&ioKey,free); }
+
+// this thread's aligned IOBUFSIZE buffer; freed when the thread ends
+unsigned char *ioBuffer(void) {
+	unsigned char *buf;
+	pthread_once(&ioOnce,ioKeyInit);
+	if ((buf = pthread_getspecific(ioKey)) == NULL) {
+		if (posix_memalign((void **)&buf,IOALIGN,IOBUFSIZE)) debug(EXIT, 0,"Unable to allocate I/O buffer\n");
+		pthread_setspecific(ioKey,buf);
+		}
+	return buf;
+	}
+
+unsigned long sysValue(char *path) {
+	unsigned long value = 0;
+	FILE *f = fopen(path,"r");
+	if (f == NULL) return 0;
+	if (fscanf(f,"%lu",&value) != 1) value = 0;
+	fclose(f);
+	return value;
+	}
+
+// request size for fd: whole units of what its device takes in one request, up to IOBUFSIZE
+unsigned int ioSize(int fd) {
+	struct stat64 st;
+	char path[64], *queue;
+	unsigned long unit;
+	if (fstat64(fd,&st) || !S_ISBLK(st.st_mode)) return IOBUFSIZE;
+	sprintf(path,"/sys/dev/block/%u:%u/partition",major(st.st_rdev),minor(st.st_rdev));
+	queue = (access(path,F_OK))?"queue":"../queue"; // a partition's queue is its disk's
+	sprintf(path,"/sys/dev/block/%u:%u/%s/optimal_io_size",major(st.st_rdev),minor(st.st_rdev),queue);
+	if (!(unit = sysValue(path))) {
+		sprintf(path,"/sys/dev/block/%u:%u/%s/max_sectors_kb",major(st.st_rdev),minor(st.st_rdev),queue);
+		unit = sysValue(path) * 1024;
+		}
+	if (!unit || unit > IOBUFSIZE) return IOBUFSIZE;
+	return (IOBUFSIZE / unit) * unit;
+	}
+
+// reads until size or the end of fd; returns the bytes read, -1 on error
+int ioRead(int fd, unsigned char *buf, unsigned int size) {
+	int n;
+	unsigned int offset = 0;
+	while (offset < size && (n = read(fd,&buf[offset],size-offset)) > 0) offset += n;
+	if (offset < size && n < 0) return -1;
+	return offset;
+	}
+
+// writes all of buf; returns size, -1 on error
+int ioWrite(int fd, unsigned char *buf, unsigned int size) {
+	int n;
+	unsigned int offset = 0;
+	while (offset < size && (n = write(fd,&buf[offset],size-offset)) > 0) offset += n;
+	return (offset == size)?size:-1;
+	}
+
+// writes every iovec in as few calls as the kernel allows; returns the bytes written, -1 on error
+long ioWritev(int fd, struct iovec *iov, int count) {
+	long n, total = 0;
+	while (count) {
+		if ((n = writev(fd,iov,count)) <= 0) return -1;
+		total += n;
+		while (count && n >= iov->iov_len) { n -= iov->iov_len; iov++; count--; }
+		if (count) { iov->iov_base = (char *)iov->iov_base + n; iov->iov_len -= n; }
+		}
+	return total;
+	}
+
+/****************************
+	BUFFER POOL
+****************************/
+
+// IOBUFSIZE buffers carved from one mapping the kernel may back with huge pages, as many as
+// the budget allows; readers, codecs and writers hand them on by reference instead of copying
+int poolBudget = 0; // buffers= option in MB; 0 = POOLBUDGET, at most a quarter of memory
+
+struct __pool {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	ioBuf *buf;	// NULL until first used
+	ioBuf *free;
+	int count;
+	int available;	// on the free list
+	} pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+// with the lock held
+void poolInit(void) {
+	unsigned long budget = (poolBudget?poolBudget:POOLBUDGET) * 1024UL * 1024UL;
+	unsigned long memory = sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+	unsigned char *base;
+	int i;
+	if (memory && budget > memory / 4) budget = memory / 4;
+	pool.count = (budget < IOBUFSIZE)?1:budget / IOBUFSIZE;
+	base = mmap(NULL,(unsigned long)pool.count * IOBUFSIZE + HUGEPAGE,PROT_READ | PROT_WRITE,MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,-1,0);
+	if (base == MAP_FAILED || (pool.buf = calloc(pool.count,sizeof(ioBuf))) == NULL) debug(EXIT, 0,"Unable to allocate the buffer pool\n");
+	base = (unsigned char *)(((unsigned long)base + HUGEPAGE - 1) & ~(HUGEPAGE - 1)); // buffers start on a huge page
+	madvise(base,(unsigned long)pool.count * IOBUFSIZE,MADV_HUGEPAGE);
+	for (i=pool.count-1;i>=0;i--) {
+		pool.buf[i].data = base + (unsigned long)i * IOBUFSIZE;
+		pool.buf[i].next = pool.free;
+		pool.free = &pool.buf[i];
+		}
+	pool.available = pool.count;
+	debug(INFO,5,"Buffer pool: %i buffers of %iKB\n",pool.count,IOBUFSIZE / 1024);
+	}
+
+// a buffer holding one reference. Without wait it's NULL rather than the last free buffer,
+// which is left for a thread that has to wait: that thread may be holding the others.
+ioBuf *poolGet(bool wait) {
+	ioBuf *buf = NULL;
+	pthread_mutex_lock(&pool.lock);
+	if (pool.buf == NULL) poolInit();
+	while (wait && !pool.available) pthread_cond_wait(&pool.cond,&pool.lock);
+	if (pool.available > (wait?0:1)) {
+		buf = pool.free;
+		pool.free = buf->next;
+		pool.available--;
+		buf->refs = 1;
+		}
+	pthread_mutex_unlock(&pool.lock);
+	return buf;
+	}
+
+// hand the buffer on to refs more holders
+void poolHold(ioBuf *buf, int refs) {
+	pthread_mutex_lock(&pool.lock);
+	buf->refs += refs;
+	pthread_mutex_unlock(&pool.lock);
+	}
+
+// drop a reference; the last one returns the buffer to the pool
+void poolPut(ioBuf *buf) {
+	pthread_mutex_lock(&pool.lock);
+	if (!--buf->refs) { buf->next = pool.free; pool.free = buf; pool.available++; }
+	pthread_cond_broadcast(&pool.cond); // waiting for a buffer, or for one to go idle
+	pthread_mutex_unlock(&pool.lock);
+	}
+
+// wait until the caller holds the only reference
+void poolIdle(ioBuf *buf) {
+	pthread_mutex_lock(&pool.lock);
+	while (buf->refs > 1) pthread_cond_wait(&pool.cond,&pool.lock);
+	pthread_mutex_unlock(&pool.lock);
+	}
+
 /****************************
         WRITE ARCHIVE FUNCTIONS
 ****************************/
@@ -241,13 +502,21 @@ int signFile(archive *arch) {
 	int n;
 	if (arch->fileHeaderFD == -1) { arch->state &= ~COMPRESSED; return 1; } // file wasn't open
 	if ((arch->state & COMPRESSED) && (compressBuffer(arch,NULL,0) == -1)) return -1;
-	lseek64(arch->fileHeaderFD,arch->fileSizePosition,SEEK_SET);
-	n = write(arch->fileHeaderFD,&arch->fileBytes,LSIZE); // write file size here
-	if (n != LSIZE) { debug(INFO, 0,"ERROR WRITING %i BYTES!\n",LSIZE); return -1; }
-	n = write(arch->fileHeaderFD,&arch->originalBytes,LSIZE);
-	if (n != LSIZE) { debug(INFO, 0,"ERROR WRITING %i BYTES!\n",LSIZE); return -1; }
-	if (arch->fileHeaderFD != arch->currentFD) close(arch->fileHeaderFD);
-	else { lseek64(arch->fileHeaderFD,0,SEEK_END); } // could also use the known segmentOffset value instead and do SEEK_SET; will probably do that instead
+	if (arch->stream) { // can't seek back; a zero-length frame ends the data, followed by the sizes
+		n = 0;
+		if (flushBufferToArchive((char *)&n,ISIZE,arch) != ISIZE) return -1;
+		if (flushBufferToArchive((char *)&arch->fileBytes,LSIZE,arch) != LSIZE) return -1;
+		if (flushBufferToArchive((char *)&arch->originalBytes,LSIZE,arch) != LSIZE) return -1;
+		}
+	else {
+		lseek64(arch->fileHeaderFD,arch->fileSizePosition,SEEK_SET);
+		n = write(arch->fileHeaderFD,&arch->fileBytes,LSIZE); // write file size here
+		if (n != LSIZE) { debug(INFO, 0,"ERROR WRITING %i BYTES!\n",LSIZE); return -1; }
+		n = write(arch->fileHeaderFD,&arch->originalBytes,LSIZE);
+		if (n != LSIZE) { debug(INFO, 0,"ERROR WRITING %i BYTES!\n",LSIZE); return -1; }
+		if (arch->fileHeaderFD != arch->currentFD) close(arch->fileHeaderFD);
+		else { lseek64(arch->fileHeaderFD,0,SEEK_END); } // could also use the known segmentOffset value instead and do SEEK_SET; will probably do that instead
+		}
 	arch->fileHeaderFD = -1;
 	sha1Finalize();
 	bzero(sha1buf,24);
@@ -259,11 +528,22 @@ int signFile(archive *arch) {
 	}
 
 void closeArchive(archive *arch) {
+	unsigned long streamEnd = STREAMEND;
 	if (arch->currentFD == -1) return;
+	if (arch->state & ARCH_READ) endCodecInput(arch); // a file left part way
+	if (arch->stream && (arch->state & ARCH_READ)) { arch->currentFD = -1; return; } // leave stdin open so the replay buffer can re-read it
 	if (!(arch->state & ARCH_READ)) {
 		signFile(arch); // ignore errors for now
+		if (arch->stream) flushBufferToArchive((char *)&streamEnd,LSIZE,arch); // reader can tell a complete stream from a truncated one
 		if ((arch->fileHeaderFD != -1) && (arch->fileHeaderFD != arch->currentFD)) { close(arch->fileHeaderFD); fsync(arch->fileHeaderFD); }
 		}
+	else if (arch->readAhead == 2) endReadAhead(arch);
+	closeSegment(arch);
+	// printf("Processed %lu bytes so far.\n",arch->totalOffset);
+	}
+
+// close the file of the current segment only
+void closeSegment(archive *arch) {
 #ifdef NETWORK_ENABLED
 	if (!strncmp(arch->archiveName,"http://",7)) {
 		closeHTTPFile(arch->currentFD);
@@ -277,15 +557,21 @@ void closeArchive(archive *arch) {
 	fsync(arch->currentFD);
 #endif
 	arch->currentFD = -1;
-	// printf("Processed %lu bytes so far.\n",arch->totalOffset);
 	}
 
 int addFileToArchive(unsigned int major, unsigned int minor, unsigned char compression, archive *arch) {
+	if (addStoredFileToArchive(major,minor,compression,arch) != 1) return -1;
+	arch->state |= compression; // add compression setting
+	if (arch->state & COMPRESSED) return initCompressor(arch,0);
+	return 1;
+	}
+
+// the header records the compression, but the data arrives already in its stored form (see writeStored)
+int addStoredFileToArchive(unsigned int major, unsigned int minor, unsigned char compression, archive *arch) {
 	if (signFile(arch) == -1) return -1;
 	int n, offset = 0;
 	arch->fileBytes = 0;
 	arch->originalBytes = 0;
-	arch->state |= compression; // add compression setting
 	sha1Init();
 	// unsigned char fsize = strlen(filename);
 	if (arch->splitSize && ((arch->splitSize - arch->segmentOffset) < L2SIZE)) {
@@ -303,10 +589,36 @@ int addFileToArchive(unsigned int major, unsigned int minor, unsigned char compr
 	if (flushBufferToArchive((char *)&minor,sizeof(unsigned int),arch) != sizeof(unsigned int)) return -1;
 	arch->major = major;
 	arch->minor = minor;
+	return 1;
+	}
+
+// appends data a backup job already compressed into its spool; the caller sets originalBytes
+int writeStored(unsigned char *buf, int size, archive *arch) {
+	if (!size) return 0;
+	sha1Update(buf,size);
+	if (flushFrameToArchive(buf,size,arch) != size) return -1;
+	arch->fileBytes += size;
+	return size;
+	}
+
+// a job's private archive: one headerless, unsigned file compressed into fd
+int createSpool(int fd, unsigned char compression, archive *arch) {
+	bzero(arch,sizeof(archive));
+	arch->archiveName = "spool";
+	arch->currentFD = fd;
+	arch->fileHeaderFD = -1;
+	arch->spool = 1;
+	arch->state = ARCH_WRITE | compression;
 	if (arch->state & COMPRESSED) return initCompressor(arch,0);
 	return 1;
 	}
 
+// flush what the compressor still holds
+int endSpool(archive *arch) {
+	if ((arch->state & COMPRESSED) && (compressBuffer(arch,NULL,0) == -1)) return -1;
+	return 1;
+	}
+
 int writeFile(char *buf,int size,archive *arch) {
 	int n;
 	if (!size) return 0; // nothing to write
@@ -315,8 +627,8 @@ int writeFile(char *buf,int size,archive *arch) {
 		if (compressBuffer(arch,buf,size) == -1) return -1;
 		}
 	else {
-		sha1Update(buf,size);
-        	if (flushBufferToArchive(buf,size,arch) != size) return -1;
+		if (!arch->spool) sha1Update(buf,size);
+        	if (flushFrameToArchive(buf,size,arch) != size) return -1;
         	arch->fileBytes += size;
 		}
 	return size;
@@ -325,11 +637,13 @@ int writeFile(char *buf,int size,archive *arch) {
 // reads from fd and writes to the archive
 int writeBlock(int fd, unsigned long size, archive *arch, bool progress) {
 	int n;
-	unsigned long bytes = 0;
-	while (bytes < size && (n = read(fd,fileBuf,((size-bytes) < FBUFSIZE)?(size-bytes):FBUFSIZE)) > 0) {
+	unsigned char *buf = ioBuffer();
+	unsigned int chunk = ioSize(fd);
+	unsigned long bytes = 0, position = lseek64(fd,0,SEEK_CUR);
+	while (bytes < size && (n = ioRead(fd,buf,((size-bytes) < chunk)?(size-bytes):chunk)) > 0) {
+		pageBehind(fd,position+bytes,n,false); // the source's pages aren't read again
 		bytes += n;
-		// if (writeFile(fileBuf,n,arch) != n) return -1;  // should do error checking on operations
-		if (writeFile(fileBuf,n,arch) == -1) return -1;
+		if (writeFile(buf,n,arch) == -1) return -1;
 		if (progress) { if (progressBar(arch->originalBytes,arch->fileBytes,PROGRESS_UPDATE)) { feedbackComplete("*** CANCELLED ***"); return -2; } }
 		}
 	if (bytes != size) return -1;
@@ -359,22 +673,38 @@ int flushBufferToArchive(unsigned char *buf, unsigned int size,archive *arch) {
 	return offset;
         }
 
+// stream archives don't know their sizes up front, so file data goes out in self-delimiting frames
+int flushFrameToArchive(unsigned char *buf, unsigned int size, archive *arch) {
+	struct iovec iov[2] = { { &size, ISIZE }, { buf, size } };
+	if (!arch->stream) return flushBufferToArchive(buf,size,arch);
+	if (ioWritev(arch->currentFD,iov,2) != ISIZE + size) return -1; // length and data in one call; streams aren't split
+	arch->totalOffset += ISIZE + size;
+	arch->segmentOffset += ISIZE + size;
+	return size;
+	}
+
 int writeArchiveHeader(archive *arch) {
         int bufSize = VSIZE+ISIZE+LSIZE;
 	int nameOffset = 0;
-        sprintf(hdr,VERSTRING); // image and version of this image
+        sprintf(hdr,(arch->stream)?STREAMSTRING:VERSTRING); // image and version of this image
 	memcpy(&hdr[VSIZE],&arch->currentSplit,ISIZE);
         memcpy(&hdr[VSIZE+ISIZE],&arch->timestamp,LSIZE);
-        if (arch->currentSplit) {
-		nameOffset = strlen(arch->archiveName);
-                sprintf(&arch->archiveName[nameOffset],".%i",arch->currentSplit);
-                }
-	unlink(arch->archiveName); // just in case
-        if ((arch->currentFD = open(arch->archiveName,O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
+	if (arch->stream && arch->currentFD == -1) { // archive owns stdout; console output moves to stderr
+		fflush(stdout);
+		if ((arch->currentFD = dup(STDOUT_FILENO)) < 0 || dup2(STDERR_FILENO,STDOUT_FILENO) < 0) { debug(INFO, 0,"Unable to open output stream\n"); return -1; }
+		}
+	else if (!arch->stream) {
+        	if (arch->currentSplit) {
+			nameOffset = strlen(arch->archiveName);
+                	sprintf(&arch->archiveName[nameOffset],".%i",arch->currentSplit);
+                	}
+		unlink(arch->archiveName); // just in case
+        	if ((arch->currentFD = open(arch->archiveName,O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
+			if (nameOffset) arch->archiveName[nameOffset] = 0;
+			debug(INFO, 0,"Unable to create archive %s\n",arch->archiveName); return -1;
+			}
 		if (nameOffset) arch->archiveName[nameOffset] = 0;
-		debug(INFO, 0,"Unable to create archive %s\n",arch->archiveName); return -1;
 		}
-	if (nameOffset) arch->archiveName[nameOffset] = 0;
         arch->segmentOffset = 0;
         arch->currentSplit++;
         if (flushBufferToArchive(hdr,bufSize, arch) != bufSize) return -1;
@@ -387,7 +717,9 @@ int createImageArchive(char *filename, unsigned int segmentSize, archive *arch)
         arch->currentSplit = arch->totalOffset = 0;
         arch->fileHeaderFD = -1;
         arch->timestamp = time(NULL);
-        arch->splitSize = (unsigned long) segmentSize * 1024 * 1024; // segment size is megabytes
+        arch->spool = 0;
+        arch->stream = isStreamName(filename);
+        arch->splitSize = (arch->stream)?0:(unsigned long) segmentSize * 1024 * 1024; // segment size is megabytes; streams are never split
 // printf("Split: %lu\n",arch->splitSize);
         arch->state = ARCH_WRITE;
         return writeArchiveHeader(arch);
@@ -397,13 +729,85 @@ int createImageArchive(char *filename, unsigned int segmentSize, archive *arch)
 	READ ARCHIVE SECTION
 ********************************************/
 
+// stdin can't be rewound, so the first STREAMREPLAY bytes are kept for re-reading the index/MBR
+int readStream(unsigned char *buf, unsigned int size) {
+	int n;
+	if (streamPosition < streamCaptured) { // replay what was already read
+		n = ((streamCaptured - streamPosition) < size)?(streamCaptured - streamPosition):size;
+		memcpy(buf,&streamReplay[streamPosition],n);
+		streamPosition += n;
+		return n;
+		}
+	if ((n = read(streamFD,buf,size)) <= 0) return n;
+	if (streamReplay != NULL) {
+		if ((streamCaptured + n) <= STREAMREPLAY) { memcpy(&streamReplay[streamCaptured],buf,n); streamCaptured += n; }
+		else { free(streamReplay); streamReplay = NULL; } // past the replay window; forward reads only from here
+		}
+	streamPosition += n;
+	return n;
+	}
+
+int rewindStream(char *name) {
+	if (streamFD == -1) { // first open
+		if (!strncmp(name,SYSRES_MULTICAST_PREFIX_D,strlen(SYSRES_MULTICAST_PREFIX_D))) {
+			if (SYSRES_MULTICAST_Receive(&name[strlen(SYSRES_MULTICAST_PREFIX_D)],&streamFD)) return -1;
+			}
+		else streamFD = STDIN_FILENO;
+		streamReplay = malloc(STREAMREPLAY);
+		return 0;
+		}
+	if (streamReplay == NULL) return -1;
+	streamPosition = 0;
+	return 0;
+	}
+
+// 1 = frame of arch->frameBytes follows, 0 = size trailer read (end of file data), -1 = damaged
+int readStreamFrame(archive *arch) {
+	unsigned int size;
+	if (arch->fileSizePosition != STREAMEND) return 0; // trailer already read
+	if (readBufferFromArchive((char *)&size,ISIZE,arch) != ISIZE) return -1;
+	if (size) { arch->frameBytes = size; return 1; }
+	if (readBufferFromArchive((char *)&arch->fileSizePosition,LSIZE,arch) != LSIZE) return -1;
+	if (readBufferFromArchive((char *)&arch->expectedOriginalBytes,LSIZE,arch) != LSIZE) return -1;
+	if (arch->fileSizePosition != arch->fileBytes) { debug(INFO, 0,"Stream length mismatch\n"); return -1; }
+	return 0;
+	}
+
+// 0 = no more, 1 = ok, -1 = not ok (a stream is a single segment read from stdin)
+int readStreamHeader(archive *arch) {
+	unsigned char hdr[HDRSIZE];
+	unsigned int segment;
+	if (arch->currentSplit) return 0; // streams are never split
+	if (rewindStream(arch->archiveName) == -1) { debug(INFO, 0,"Stream can't be re-read past the first %i bytes.\n",STREAMREPLAY); return -1; }
+	arch->currentFD = streamFD;
+	arch->splitSize = arch->segmentOffset = 0;
+	arch->currentSplit++;
+	if (readBufferFromArchive(hdr,HDRSIZE,arch) != HDRSIZE) { closeArchive(arch); return -1; }
+	if (memcmp(STREAMSTRING,hdr,VSIZE)) { closeArchive(arch); debug(INFO, 0,"Stream header mismatch.\n"); return -1; }
+	memcpy(&arch->timestamp,&hdr[VSIZE+ISIZE],LSIZE);
+	memcpy(&segment,&hdr[VSIZE],ISIZE);
+	if (segment) { closeArchive(arch); debug(INFO, 0,"Incorrect stream segment number [%i].\n",segment); return -1; }
+	return 1;
+	}
+
 int readSignature(archive *arch, char checkSum) {
 	int n;
 	unsigned char sha1display[41];
 	unsigned long remaining = arch->fileSizePosition - arch->fileBytes;
 	bzero(sha1buf,24);
 	if (arch->fileHeaderFD == -1) return 0; // end of file
-	if (remaining) { // skip to end of file
+	if (arch->stream) { // no seeking; read through the remaining frames up to the size trailer
+		n = 0;
+		while (arch->frameBytes || (n = readStreamFrame(arch)) == 1) {
+			if (checkSum) return -1; // can't skip file and get valid checksum
+			remaining = (arch->frameBytes < FBUFSIZE)?arch->frameBytes:FBUFSIZE;
+			if (readBufferFromArchive(fileBuf,remaining,arch) != remaining) return -1;
+			arch->frameBytes -= remaining;
+			arch->fileBytes += remaining;
+			}
+		if (n == -1) return -1;
+		}
+	else if (remaining) { // skip to end of file
 		if (checkSum) return -1; // can't skip file and get valid checksum
 		while(1) {
 			remaining = arch->fileSizePosition - arch->fileBytes;
@@ -435,7 +839,7 @@ int readSignature(archive *arch, char checkSum) {
 // printf("RBUF: "); for(n = 0;n<20;n++) printf("%02X",md_value[n]); printf("\n");
 			if (md_value != NULL && arch_md_len) memcpy(&sha1buf[4],md_value,20);
 			for (n=4;n<24;n++) sprintf(&sha1display[(n-4) << 1],"%02X",sha1buf[n]);
-			sha1display[41] = 0;
+			sha1display[40] = 0;
 			debug(INFO, 1,"SHA1: %s\n",sha1display);
                         if (memcmp(fileBuf,sha1buf,24)) {
                                 debug(INFO, 0,"SHA1SUM mismatch!\n");
@@ -463,28 +867,103 @@ int readFile(unsigned char *buf, int size, archive *arch, int inflate) {
 		}
 	if (inflate && (arch->state & COMPRESSED)) return readCompressed(buf, size, arch);
 	unsigned long remaining = arch->fileSizePosition - arch->fileBytes;
+	if (arch->stream) {
+		if (!arch->frameBytes && (n = readStreamFrame(arch)) != 1) return (n)?-1:readSignature(arch,1);
+		remaining = arch->frameBytes;
+		}
 	if (remaining < size) size = remaining;
 	if (!remaining) return readSignature(arch,1); //  1 == validate SHA1SUM
 	if ((n = readBufferFromArchive(buf,size,arch)) > 0) {
 		sha1Update(buf,n);
 		arch->fileBytes += n;
+		if (arch->stream) arch->frameBytes -= n;
 		if (inflate) arch->originalBytes += n;
 		}
 	else return -1; // read error
 	return n;
 	}
 
+// restored targets are fsynced and closed in the background while the next file is restored
+struct __flushing {
+	pthread_mutex_t lock;
+	pthread_t tid[SYNCMAX];
+	int fd[SYNCMAX];
+	int error[SYNCMAX];
+	char *name[SYNCMAX];
+	int count;
+	int failed;	// since the last syncTargets()
+	} flushing = { PTHREAD_MUTEX_INITIALIZER };
+
+void *syncThread(void *arg) {
+	int i = (int)(long)arg;
+	if (fsync(flushing.fd[i])) flushing.error[i] = errno;
+	if (close(flushing.fd[i]) && !flushing.error[i]) flushing.error[i] = errno;
+	return NULL;
+	}
+
+// with the lock held: wait for every target handed over so far
+void joinTargets(void) {
+	int i;
+	for (i=0;i<flushing.count;i++) {
+		if (flushing.tid[i]) pthread_join(flushing.tid[i],NULL);
+		if (flushing.error[i]) { debug(INFO,1,"Write error on %s [%i]\n",flushing.name[i],flushing.error[i]); flushing.failed++; }
+		free(flushing.name[i]);
+		}
+	flushing.count = 0;
+	}
+
+// hand a restored target over to be flushed and closed; the fd belongs to us from here
+void syncLater(int fd, char *name) {
+	int i;
+	pthread_mutex_lock(&flushing.lock);
+	if (flushing.count == SYNCMAX) joinTargets();
+	i = flushing.count;
+	flushing.fd[i] = fd;
+	flushing.error[i] = 0;
+	flushing.name[i] = strdup(name);
+	if (pthread_create(&flushing.tid[i],NULL,syncThread,(void *)(long)i)) { syncThread((void *)(long)i); flushing.tid[i] = 0; } // no thread; flush it here
+	flushing.count++;
+	pthread_mutex_unlock(&flushing.lock);
+	}
+
+// the barrier: waits for the targets still flushing, returns how many failed
+int syncTargets(void) {
+	int failed;
+	pthread_mutex_lock(&flushing.lock);
+	joinTargets();
+	failed = flushing.failed;
+	flushing.failed = 0;
+	pthread_mutex_unlock(&flushing.lock);
+	return failed;
+	}
+
+// writeback governor: once a pass over fd moves into a new window, the window before the
+// last is written out (when written) and dropped from the page cache, so restores and image
+// reads keep at most two windows of it and the progress shown is what reached the disk
+void pageBehind(int fd, unsigned long offset, unsigned long length, bool written) {
+	unsigned long end = offset + length, window;
+	if (end / PAGEWINDOW == offset / PAGEWINDOW || end < 2 * PAGEWINDOW) return; // still in the same window
+	window = (end / PAGEWINDOW - 2) * PAGEWINDOW;
+	if (written) sync_file_range(fd,window,PAGEWINDOW,SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+	posix_fadvise(fd,window,PAGEWINDOW,POSIX_FADV_DONTNEED);
+	}
+
 // reads from archive and writes to fd
 int readBlock(int fd, unsigned long size, archive *arch, bool progress) {
-        int n, i, offset;
-        unsigned long bytes = 0;
+        int n;
+        unsigned char *buf = ioBuffer();
+        unsigned int chunk = ioSize(fd);
+        unsigned long bytes = 0, unsynced = 0, position;
 
-        while (bytes < size && (n = readFile(fileBuf,((size-bytes) < FBUFSIZE)?(size-bytes):FBUFSIZE,arch,1)) > 0) {
+        while (bytes < size && (n = readFile(buf,((size-bytes) < chunk)?(size-bytes):chunk,arch,1)) > 0) {
                 bytes += n;
-                // if (writeFile(fileBuf,n,arch) != n) return -1;  // should do error checking on operations
-		offset = 0;
-		while (n > 0 && ((i = write(fd,&fileBuf[offset],n)) > 0)) { offset += i; n -= i; }
-		if (n != 0) return -1; // should have written all
+		if (ioWrite(fd,buf,n) != n) return -1; // should have written all
+		if ((unsynced += n) >= SYNCCHUNK) { // start the writeback
+			position = lseek64(fd,0,SEEK_CUR) - unsynced;
+			sync_file_range(fd,position,unsynced,SYNC_FILE_RANGE_WRITE);
+			pageBehind(fd,position,unsynced,true);
+			unsynced = 0;
+			}
 		if (progress) {
 			if (progressBar(arch->originalBytes,arch->originalBytes,PROGRESS_UPDATE)) { feedbackComplete("*** CANCELLED ***"); return -2; }
 			progressBar(arch->originalBytes,arch->originalBytes,PROGRESS_UPDATE | 1); // global counter
@@ -501,14 +980,16 @@ int readNextFile(archive *arch, char decompress) {
 	if (arch->currentFD == -1) return -1;
 	if (arch->fileHeaderFD != -1 && (readSignature(arch,0) != 0)) return -1;
 	remaining = arch->splitSize - arch->segmentOffset;
-	if (remaining < L2SIZE) {
+	if (!arch->stream && remaining < L2SIZE) {
 		arch->totalOffset += remaining; // skip these bytes
 		n = readArchiveHeader(arch);
 		if (n != 1) return n; // could be 0, implying no more files
 		}
 	if (readBufferFromArchive((char *)&arch->fileSizePosition,LSIZE,arch) != LSIZE) return -1; // expected size of file
+	if (arch->stream && arch->fileSizePosition == STREAMEND) { closeArchive(arch); return 0; } // end of stream
 	if (readBufferFromArchive((char *)&arch->expectedOriginalBytes,LSIZE,arch) != LSIZE) return -1; // uncompressed file size
 	if (readBufferFromArchive((char *)&arch->state,1,arch) != 1) return -1;
+	arch->fileState = arch->state;
 	arch->state |= ARCH_READ;
 	if (!decompress) arch->state &= ~COMPRESSED; // don't decompress
 
@@ -522,6 +1003,11 @@ int readNextFile(archive *arch, char decompress) {
 	// printf("Current file: %i:%i, length: %lu, uncompressed %lu, compression %s\n",arch->major,arch->minor,arch->fileSizePosition,arch->expectedOriginalBytes,(arch->state & GZIP)?"gzip":(arch->state & LZMA)?"lzma":"none");
 	arch->fileBytes = 0;
 	arch->originalBytes = 0;
+	if (arch->stream) { // sizes arrive in the trailer; expectedOriginalBytes stays unknown until then
+		arch->fileSizePosition = STREAMEND;
+		arch->expectedOriginalBytes = 0;
+		arch->frameBytes = 0;
+		}
 	arch->fileHeaderFD = 1; // so we know we're reading a file
 	sha1Init();
 	if (arch->state & COMPRESSED) return initCompressor(arch,1);
@@ -554,23 +1040,223 @@ int readSpecificFile(archive *arch, int major, int minor, char decompress) {
 		}
 	}
 
+/* Segment read-ahead: on network shares a single reader waits out the latency
+   of every request, so several threads read the chunks ahead of the reader,
+   each on its own descriptor, and the reader takes them back in order. Each
+   archive has a ring of its own, so restore and verify workers can all read
+   ahead at once. */
+typedef struct __aheadChunk aheadChunk;
+
+struct __aheadChunk {
+	unsigned int segment;
+	unsigned long offset;
+	int length;		// bytes read, -1 on error
+	char state;		// AHEAD_FREE, AHEAD_WANTED, AHEAD_READING, AHEAD_FILLED
+	bool busy;		// a stream is still reading into buf
+	unsigned char *buf;
+	ioBuf *io;
+	};
+
+#define AHEAD_FREE    0
+#define AHEAD_WANTED  1
+#define AHEAD_READING 2
+#define AHEAD_FILLED  3
+
+struct __readAhead {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t tid[AHEADMAX];
+	int streams;		// threads running
+	int count;		// chunks in the ring
+	int head;		// chunk holding the reader's position
+	aheadChunk chunk[AHEADMAX*AHEADDEPTH];
+	char name[MAX_PATH];
+	unsigned int segments;
+	unsigned long segSize[AHEADSEGS];
+	unsigned int nextSegment;	// next position to hand out
+	unsigned long nextOffset;
+	bool stop;
+	};
+
+int readStreams = 0; // streams= option; 0 = pick by filesystem
+
+// hand the next archive position to a chunk, or leave it free at the end
+void assignAheadChunk(readAhead *ahead, aheadChunk *c) {
+	c->state = AHEAD_FREE;
+	if (ahead->nextSegment >= ahead->segments) return;
+	c->segment = ahead->nextSegment;
+	c->offset = ahead->nextOffset;
+	c->state = AHEAD_WANTED;
+	if ((ahead->nextOffset += AHEADCHUNK) >= ahead->segSize[ahead->nextSegment]) { ahead->nextSegment++; ahead->nextOffset = 0; }
+	}
+
+void *readAheadThread(void *arg) {
+	readAhead *ahead = arg;
+	aheadChunk *c;
+	unsigned int segment = 0;
+	unsigned long size;
+	int fd = -1, i, n, len;
+	char name[MAX_PATH+16];
+	sigset_t set; sigemptyset(&set); sigaddset(&set,SIGINT);
+	pthread_sigmask(SIG_BLOCK,&set,NULL); // ctrl-c belongs to the reader
+	pthread_mutex_lock(&ahead->lock);
+	while (!ahead->stop) {
+		for (i=0;i<ahead->count;i++) { // nearest wanted chunk first
+			c = &ahead->chunk[(ahead->head+i) % ahead->count];
+			if (c->state == AHEAD_WANTED && !c->busy) break;
+			}
+		if (i == ahead->count) { pthread_cond_wait(&ahead->cond,&ahead->lock); continue; }
+		c->state = AHEAD_READING;
+		c->busy = true;
+		size = ahead->segSize[c->segment] - c->offset;
+		if (size > AHEADCHUNK) size = AHEADCHUNK;
+		pthread_mutex_unlock(&ahead->lock);
+		if (fd == -1 || segment != c->segment) { // each stream keeps its own descriptor
+			if (fd != -1) close(fd);
+			if (c->segment) sprintf(name,"%s.%i",ahead->name,c->segment); else strcpy(name,ahead->name);
+			fd = open(name,O_RDONLY | O_LARGEFILE);
+			segment = c->segment;
+			}
+		for (len=0;fd != -1 && len < size;len += n) {
+			if ((n = pread64(fd,&c->buf[len],size-len,c->offset+len)) <= 0) break;
+			}
+		if (len > 0) posix_fadvise(fd,c->offset,len,POSIX_FADV_DONTNEED); // it's in the chunk now
+		pthread_mutex_lock(&ahead->lock);
+		c->busy = false;
+		if (c->state == AHEAD_READING) { // not repositioned while we were reading
+			c->length = (len == size)?len:-1;
+			c->state = AHEAD_FILLED;
+			}
+		pthread_cond_broadcast(&ahead->cond); // the reader, or a stream waiting for this buffer
+		}
+	pthread_mutex_unlock(&ahead->lock);
+	if (fd != -1) close(fd);
+	return NULL;
+	}
+
+// stop arch's streams and give its chunks back to the pool
+void endReadAhead(archive *arch) {
+	readAhead *ahead = arch->ahead;
+	long status;
+	int i;
+	if (ahead == NULL) return;
+	pthread_mutex_lock(&ahead->lock);
+	ahead->stop = true;
+	pthread_cond_broadcast(&ahead->cond);
+	pthread_mutex_unlock(&ahead->lock);
+	for (i=0;i<ahead->streams;i++) pthread_join(ahead->tid[i],(void **)&status);
+	for (i=0;i<ahead->count;i++) poolPut(ahead->chunk[i].io);
+	pthread_mutex_destroy(&ahead->lock);
+	pthread_cond_destroy(&ahead->cond);
+	free(ahead);
+	arch->ahead = NULL;
+	}
+
+// start reading arch ahead of its current position if it lives on a share worth it
+bool startReadAhead(archive *arch) {
+	char *filename = arch->archiveName;
+	readAhead *ahead;
+	struct statfs64 fs;
+	struct stat64 stats;
+	char name[MAX_PATH+16];
+	int streams = readStreams;
+	int i;
+	if (!streams) {
+		if (statfs64(filename,&fs)) return false;
+		if (fs.f_type == CIFS_MAGIC || fs.f_type == SMB2_MAGIC || fs.f_type == NFS_MAGIC) streams = AHEADAUTO;
+		}
+	if (streams < 2) return false; // one stream is the plain reader
+	if (streams > AHEADMAX) streams = AHEADMAX;
+	if (strlen(filename) >= MAX_PATH || (ahead = calloc(1,sizeof(readAhead))) == NULL) return false;
+	strcpy(ahead->name,filename);
+	for (ahead->segments=0;ahead->segments<AHEADSEGS;ahead->segments++) {
+		if (ahead->segments) sprintf(name,"%s.%i",filename,ahead->segments); else strcpy(name,filename);
+		if (stat64(name,&stats)) break;
+		ahead->segSize[ahead->segments] = stats.st_size;
+		}
+	if (ahead->segments == AHEADSEGS || arch->currentSplit > ahead->segments) { free(ahead); return false; } // not what we can track; read it plainly
+	for (ahead->count=0;ahead->count<streams*AHEADDEPTH;ahead->count++) { // as many as the pool spares
+		if ((ahead->chunk[ahead->count].io = poolGet(false)) == NULL) break;
+		ahead->chunk[ahead->count].buf = ahead->chunk[ahead->count].io->data;
+		}
+	pthread_mutex_init(&ahead->lock,NULL);
+	pthread_cond_init(&ahead->cond,NULL);
+	arch->ahead = ahead;
+	if (ahead->count < 2) { endReadAhead(arch); return false; }
+	ahead->nextSegment = arch->currentSplit - 1;
+	ahead->nextOffset = arch->segmentOffset;
+	for (i=0;i<ahead->count;i++) assignAheadChunk(ahead,&ahead->chunk[i]);
+	for (ahead->streams=0;ahead->streams<streams;ahead->streams++) {
+		if (pthread_create(&ahead->tid[ahead->streams],NULL,readAheadThread,ahead)) break;
+		}
+	if (!ahead->streams) { endReadAhead(arch); return false; }
+	debug(INFO,5,"Reading %s with %i streams\n",filename,ahead->streams);
+	return true;
+	}
+
+// pread() replacement for an archive being read ahead; 0 at the end of a segment
+int readAheadArchive(archive *arch, unsigned char *buf, int limit, unsigned long offset) {
+	readAhead *ahead = arch->ahead;
+	unsigned int segment = arch->currentSplit - 1;
+	aheadChunk *c;
+	int i, n;
+	pthread_mutex_lock(&ahead->lock);
+	for (i=0;i<ahead->count;i++) { // skip forward within the ring
+		c = &ahead->chunk[(ahead->head+i) % ahead->count];
+		if (c->state != AHEAD_FREE && c->segment == segment && offset >= c->offset && offset < c->offset + AHEADCHUNK) break;
+		}
+	if (i == ahead->count) { // somewhere else entirely; start over from here
+		if (segment >= ahead->segments || offset >= ahead->segSize[segment]) { pthread_mutex_unlock(&ahead->lock); return 0; }
+		ahead->nextSegment = segment;
+		ahead->nextOffset = offset;
+		ahead->head = 0;
+		for (i=0;i<ahead->count;i++) assignAheadChunk(ahead,&ahead->chunk[i]);
+		i = 0;
+		}
+	while (i--) { // release what was skipped over
+		assignAheadChunk(ahead,&ahead->chunk[ahead->head]);
+		ahead->head = (ahead->head+1) % ahead->count;
+		}
+	pthread_cond_broadcast(&ahead->cond);
+	c = &ahead->chunk[ahead->head];
+	while (c->state != AHEAD_FILLED) pthread_cond_wait(&ahead->cond,&ahead->lock);
+	if (c->length < 0) { pthread_mutex_unlock(&ahead->lock); errno = EIO; return -1; }
+	n = c->offset + c->length - offset;
+	if (n > limit) n = limit;
+	memcpy(buf,&c->buf[offset - c->offset],n);
+	if (offset + n == c->offset + c->length) { // used up; read further ahead with it
+		assignAheadChunk(ahead,c);
+		ahead->head = (ahead->head+1) % ahead->count;
+		pthread_cond_broadcast(&ahead->cond);
+		}
+	pthread_mutex_unlock(&ahead->lock);
+	return n;
+	}
+
 int readBufferFromArchive(unsigned char *buf, unsigned int limit, archive *arch) {
 	int n;
 	unsigned int offset = 0;
 	if (arch->currentFD == -1) return -1;
+	if (!arch->readAhead && arch->totalOffset >= AHEADCHUNK) { // past the index; this is a restore/verify pass
+		arch->readAhead = (!arch->stream && strncmp(arch->archiveName,"http://",7) && startReadAhead(arch))?2:1;
+		}
 	while(limit && (n =
 #ifdef NETWORK_ENABLED
 		(!strncmp(arch->archiveName,"http://",7))?readHTTPFile(arch->currentFD,&buf[offset],limit):
 #endif
+		(arch->stream)?readStream(&buf[offset],limit):
+		(arch->readAhead == 2)?readAheadArchive(arch,&buf[offset],limit,arch->segmentOffset+offset):
 		read(arch->currentFD,&buf[offset],limit)) > 0) {
 		offset += n;
 		limit -= n;
 		}
 #ifdef NETWORK_ENABLED
 	if (has_interrupted) return -1;
+	else if (n < 0 && !strncmp(arch->archiveName,"http://",7)) return -1; // gave up retrying; the next segment would skip data
 	else
 #endif
 	if (n < 0) perror("File error");
+	if (arch->readAhead == 1 && !arch->stream && offset) pageBehind(arch->currentFD,arch->segmentOffset,offset,false);
 	arch->totalOffset += offset;
 	arch->segmentOffset += offset;
 	if (limit) { // Assume EOF. See if there's another file
@@ -590,7 +1276,8 @@ int readArchiveHeader(archive *arch) {
 	time_t timestamp;
 	unsigned int segment, offset = 0;
 	struct stat64 stats;
-	if (arch->currentFD != -1) closeArchive(arch); // { close(arch->currentFD); arch->currentFD = -1; }
+	if (arch->stream) { if (arch->currentFD != -1) closeArchive(arch); return readStreamHeader(arch); }
+	if (arch->currentFD != -1) closeSegment(arch); // keeps any read-ahead going into the next segment
 	if (arch->currentSplit) {
 		offset = strlen(arch->archiveName);
 		sprintf(&arch->archiveName[offset],".%i",arch->currentSplit);
@@ -633,9 +1320,13 @@ int readArchiveHeader(archive *arch) {
 int readImageArchive(char *filename, archive *arch) {
 	arch->currentFD = -1;
 	arch->archiveName = filename;
+	arch->stream = isStreamName(filename);
 	arch->currentSplit = arch->totalOffset = arch->archiveSize = 0;
 	arch->fileHeaderFD = -1;
 	arch->state = ARCH_READ;
+	arch->readAhead = 0;
+	arch->ahead = NULL;
+	arch->codecIn = NULL;
 	return readArchiveHeader(arch);
 	}
 
@@ -659,18 +1350,15 @@ int archiveSegments(char *path, unsigned long *archSize) {
 int copySingleFile(char *source, char *target) { // includes verification
 	int fd1, fd2;
 	sha1Init();
-	int n, n2, offset;
+	int n;
+	unsigned char *buf = ioBuffer();
 	if ((fd1 = open(source,O_RDONLY | O_LARGEFILE)) < 0) return 0; // file doesn't exist
 	if (target != NULL) { // copy it here
 		if ((fd2 = open(target,O_WRONLY | O_TRUNC | O_CREAT | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) { debug(INFO, 1,"Unable to create file %s.\n",target); return -1; }
 		}
-	while((n = read(fd1,fileBuf,FBUFSIZE)) > 0) {
-		sha1Update(fileBuf,n);
-		if (target != NULL) {
-			offset = 0;
-			while(n > 0 && ((n2 = write(fd2,&fileBuf[offset],n))> 0)) { offset += n2; n-=n2; }
-			if (n) { close(fd1); close(fd2); debug(INFO, 1,"Unable to copy to file %s.\n",target); return -1; }
-			}
+	while((n = ioRead(fd1,buf,IOBUFSIZE)) > 0) {
+		sha1Update(buf,n);
+		if (target != NULL && ioWrite(fd2,buf,n) != n) { close(fd1); close(fd2); debug(INFO, 1,"Unable to copy to file %s.\n",target); return -1; }
 		}
 	sha1Finalize();
 	close(fd1);
@@ -716,8 +1404,13 @@ int copyImage(char *dev, char *source, char *target, bool verify) {
         unsigned long imageSize = 0;
         unsigned long totalWrite = 0;
         int splitCount;
-        int i, n, n2, srclen, trglen, offset;
+        int i, n, srclen, trglen;
         int fd1, fd2;
+        unsigned char *buf = ioBuffer();
+        if (isStreamName(source)) { // no segments to copy; a stream can only be verified file by file
+		if (target == NULL && dev == NULL) return verifyImage(source,0);
+		debug(ABORT, 1,"Unable to copy a stream archive"); return -1;
+		}
         if (!(splitCount = archiveSegments(source,&imageSize))) return 0;
         srclen=strlen(source);
 	// pre-calculate max width
@@ -743,23 +1436,18 @@ int copyImage(char *dev, char *source, char *target, bool verify) {
 			}
                 while((n =
 #ifdef NETWORK_ENABLED
-			(!strncmp(source,"http://",7))?readHTTPFile(fd1,fileBuf,FBUFSIZE):
+			(!strncmp(source,"http://",7))?readHTTPFile(fd1,buf,IOBUFSIZE):
 #endif
-			read(fd1,fileBuf,FBUFSIZE)
+			ioRead(fd1,buf,IOBUFSIZE)
 			) > 0) {
-			if (verify) sha1Update(fileBuf,n);
-			if (target != NULL) {
-                        	offset = 0;
-                        	while(n > 0 && ((n2 = write(fd2,&fileBuf[offset],n)) > 0)) { offset += n2; n-= n2; }
-                        	if (n != 0) {
+			if (verify) sha1Update(buf,n);
+			if (target != NULL && ioWrite(fd2,buf,n) != n) {
 #ifdef NETWORK_ENABLED
-					if (!strncmp(source,"http://",7)) closeHTTPFile(fd1); else
+				if (!strncmp(source,"http://",7)) closeHTTPFile(fd1); else
 #endif
-					close(fd1);
-					close(fd2); debug(ABORT, 1,"Unable to completely write archive file"); return -1; }
-				}
-			else offset = n;
-                        totalWrite += offset;
+				close(fd1);
+				close(fd2); debug(ABORT, 1,"Unable to completely write archive file"); return -1; }
+                        totalWrite += n;
                         if (progressBar(totalWrite, totalWrite, PROGRESS_UPDATE)) {
 				if (target != NULL) close(fd2);
 #ifdef NETWORK_ENABLED
@@ -788,6 +1476,7 @@ int copyImage(char *dev, char *source, char *target, bool verify) {
 				feedbackComplete("*** CANCELLED ***");
 				return -2;
 				}
+			if (n < 0) { debug(ABORT, 1,"Unable to read archive file %s",source); return -1; } // the server stopped answering
 			} else
 #endif
                 close(fd1);
@@ -836,7 +1525,7 @@ unsigned long getImageTitle(char *filename, char *buf, archive *arch) {
                 }
         else { closeArchive(arch); return 0; }
         if (closeOnEnd) closeArchive(arch);
-	return archSize;
+	return (archSize)?archSize:1; // stream archives don't know their size
         }
 
 char getType(char *path) {
@@ -857,7 +1546,7 @@ void reSignIndex(char *path) {
         if (readImageArchive(path, &arch) != 1) debug(EXIT, 1,"Unable to open archive\n");
         if (readSpecificFile(&arch,0,0,0) != 1) debug(EXIT, 1,"Unable to find index\n");
         bzero(sha1buf,24);
-        while ((n = readFile(fileBuf,FBUFSIZE,&arch,0)) > 0) { ; } // calculate sha1sum
+        while ((n = readFile(ioBuffer(),IOBUFSIZE,&arch,0)) > 0) { ; } // calculate sha1sum
         if (strncmp(sha1buf,"SHA1",4)) debug(EXIT, 1,"Signature issue; archive damaged.\n");
         if (arch.currentSplit > 1) debug(EXIT, 1,"Can only re-sign primary segment.\n");
         offset = arch.segmentOffset - 24;
@@ -872,7 +1561,8 @@ void reSignIndex(char *path) {
 		}
         }
 
-int verifyImage(char *path) {
+// inflate == 0 only hashes the stored bytes, which is what the SHA1 covers; inflate == 1 also decodes every file
+int verifyImage(char *path, char inflate) {
 	archive arch;
 	int n;
 	unsigned long imageSize = 0; // total image size
@@ -881,17 +1571,17 @@ int verifyImage(char *path) {
        	if (readImageArchive(path,&arch) != 1) return -1;
 	setProgress(PROGRESS_VALIDATE,NULL,path,0,0,0,NULL,imageSize,0,&arch);
 	progressBar(imageSize,PROGRESS_BLUE,PROGRESS_INIT | 1);
-        while((n = readNextFile(&arch,1)) == 1) {
+        while((n = readNextFile(&arch,inflate)) == 1) {
 		setProgress(PROGRESS_VALIDATE,NULL,path,arch.major,arch.minor,0,NULL,imageSize,0,&arch);
 		startSegment = arch.currentSplit;
-		progressBar(arch.expectedOriginalBytes,PROGRESS_BLUE,PROGRESS_INIT);
-		while((n = readFile(fileBuf,FBUFSIZE,&arch,1)) > 0) {
-			if (progressBar(arch.originalBytes,arch.fileBytes,PROGRESS_UPDATE)) { closeArchive(&arch); feedbackComplete("*** CANCELLED ***"); return -2; }
+		progressBar((inflate || arch.stream)?arch.expectedOriginalBytes:arch.fileSizePosition,PROGRESS_BLUE,PROGRESS_INIT);
+		while((n = readFile(ioBuffer(),IOBUFSIZE,&arch,inflate)) > 0) {
+			if (progressBar((inflate)?arch.originalBytes:arch.fileBytes,arch.fileBytes,PROGRESS_UPDATE)) { closeArchive(&arch); feedbackComplete("*** CANCELLED ***"); return -2; }
 			progressBar(arch.totalOffset,arch.totalOffset,PROGRESS_UPDATE | 1);
 			}
 #ifdef NETWORK_ENABLED
                 if (has_interrupted) {
-			progressBar(arch.originalBytes,arch.fileBytes,PROGRESS_UPDATE);
+			progressBar((inflate)?arch.originalBytes:arch.fileBytes,arch.fileBytes,PROGRESS_UPDATE);
 			closeArchive(&arch);
                         feedbackComplete("*** CANCELLED ***");
                         return -2;
@@ -906,15 +1596,63 @@ int verifyImage(char *path) {
 	return 1;
 	}
 
+bool isStreamName(char *name) {
+	return (!strcmp(name,STREAMNAME) || !strncmp(name,SYSRES_MULTICAST_PREFIX_D,strlen(SYSRES_MULTICAST_PREFIX_D)));
+	}
+
+// writes an archive to fd in the stream layout; file data is copied as stored and verified on the way through
+int streamImage(char *source, int fd) {
+	archive in, out;
+	int n;
+	unsigned char *buf = ioBuffer();
+	unsigned int frameEnd = 0;
+	unsigned long streamEnd = STREAMEND;
+	if (readImageArchive(source,&in) != 1) { debug(INFO, 0,"Unable to read archive %s\n",source); return -1; }
+	bzero(&out,sizeof(archive));
+	out.archiveName = STREAMNAME;
+	out.currentFD = fd;
+	out.fileHeaderFD = -1;
+	out.stream = 1;
+	out.state = ARCH_WRITE;
+	out.timestamp = in.timestamp;
+	if (writeArchiveHeader(&out) == -1) { closeArchive(&in); return -1; }
+	while ((n = readNextFile(&in,0)) == 1) {
+		out.fileBytes = out.originalBytes = 0; // placeholders, same as addFileToArchive()
+		if (flushBufferToArchive((char *)&out.fileBytes,LSIZE,&out) != LSIZE) break;
+		if (flushBufferToArchive((char *)&out.originalBytes,LSIZE,&out) != LSIZE) break;
+		if (flushBufferToArchive(&in.fileState,1,&out) != 1) break;
+		if (flushBufferToArchive((char *)&in.major,sizeof(unsigned int),&out) != sizeof(unsigned int)) break;
+		if (flushBufferToArchive((char *)&in.minor,sizeof(unsigned int),&out) != sizeof(unsigned int)) break;
+		while ((n = readFile(buf,IOBUFSIZE,&in,0)) > 0) {
+			if (flushFrameToArchive(buf,n,&out) != n) { n = -1; break; }
+			out.fileBytes += n;
+			}
+		if (n) { debug(INFO, 0,"Archive file %i:%i damaged\n",in.major,in.minor); break; } // readSignature() failed
+		n = -1;
+		if (flushBufferToArchive((char *)&frameEnd,ISIZE,&out) != ISIZE) break;
+		if (flushBufferToArchive((char *)&in.fileSizePosition,LSIZE,&out) != LSIZE) break;
+		if (flushBufferToArchive((char *)&in.expectedOriginalBytes,LSIZE,&out) != LSIZE) break;
+		if (flushBufferToArchive(sha1buf,24,&out) != 24) break; // verified signature
+		n = 1;
+		}
+	closeArchive(&in);
+	if (n) return -1;
+	if (flushBufferToArchive((char *)&streamEnd,LSIZE,&out) != LSIZE) return -1;
+	return 1;
+	}
+
 void initHashEngine(void) {
 #ifdef SSL
         OpenSSL_add_all_digests();
         md = EVP_get_digestbyname("sha1");
+        arch_md_len = EVP_MD_size(md); // set once; threads hash concurrently
 #else
 #ifdef GCRYPT
         gcry_control(GCRYCTL_DISABLE_SECMEM,0);
         if (gcry_md_open(&digest,GCRY_MD_SHA1,GCRY_MD_FLAG_SECURE)) debug(EXIT, 1,"Can't create SHA1SUM digest.\n");
         if ((arch_md_len = gcry_md_get_algo_dlen(GCRY_MD_SHA1)) != 20) arch_md_len = 0;
+#else
+        arch_md_len = 20;
 #endif
 #endif
 	}
@@ -23,6 +23,7 @@
 /*----------------------------------------------------------------------------
 ** Compiler setup.
 */
+#include <stdbool.h>	// bool
 #include <time.h>		// time_t
 #include <lzma.h>   // lzma_stream
 #include <zlib.h>		// z_stream
@@ -31,6 +32,11 @@
 ** Macro definitions
 */
 #define FBUFSIZE 4096
+#define ZBUFSIZE (256 * 1024)	// compressed bytes moved per call
+#define IOBUFSIZE (4 * 1024 * 1024)	// largest request of the I/O layer
+#define IOALIGN 4096	// its buffers also suit O_DIRECT
+#define POOLBUDGET 256	// MB the buffer pool uses when buffers= isn't given
+#define HUGEPAGE (2 * 1024 * 1024)
 #define MAX_FILE 256
 
 #define ISIZE 4
@@ -40,6 +46,30 @@
 #define HDRSIZE 20
 // #define VERSTRING "HPRI0000"
 
+#define STREAMNAME "-"		// target=-/source=- (stdout/stdin)
+#define STREAMEND 0xFFFFFFFFFFFFFFFFUL	// file size marking the end of a stream archive
+#define STREAMREPLAY (4 * 1024 * 1024)	// stream prefix kept so the index/MBR can be re-read
+
+#define AHEADCHUNK IOBUFSIZE	// unit of segment read-ahead, a pool buffer
+#define AHEADDEPTH 2	// chunks in flight per stream
+#define AHEADMAX 16	// most streams= allowed
+#define AHEADAUTO 4	// streams used on a network share when streams= isn't given
+#define AHEADSEGS 32768	// most segments tracked
+#define SYNCMAX 32	// restored targets flushing in the background at once
+#define SYNCCHUNK (4 * 1024 * 1024)	// bytes written before their writeback is started
+#define PAGEWINDOW (64 * 1024 * 1024)	// page cache a sequential pass leaves behind it, in windows of this size
+#define GZIPLEVEL 6	// deflate level a thread's first stream starts at (zlib's default)
+#define GZIPMAX 9
+#define LZMALEVEL 1	// xz preset a thread's first stream starts at
+#define LZMAMAX 6
+#define TUNEBYTES (64 * 1024 * 1024)	// input between two decisions of the level controller
+#define ENTROPYSLICES 32	// a chunk's entropy is sampled from this many slices
+#define ENTROPYSLICE 256	// of this many bytes each
+#define ENTROPYRATIO 200	// 2^7.64; a sample with more bits per byte than that is stored, not compressed
+#define CIFS_MAGIC 0xFF534D42
+#define SMB2_MAGIC 0xFE534D42
+#define NFS_MAGIC 0x6969
+
 #define ARCH_WRITE 0
 #define ARCH_READ 1
 
@@ -76,27 +106,69 @@ typedef struct imageArch
 	unsigned long totalOffset;	// total bytes written in entire archive
 	unsigned long archiveSize;
 	time_t timestamp; // useful if the segments get renamed
+	char stream;	// sequential layout: data in length-prefixed frames, sizes in a trailer
+	unsigned char fileState;	// state byte of the current file as stored in the archive
+	unsigned long frameBytes;	// bytes left in the current frame (stream layout only)
+	char readAhead;	// 0 = not decided yet, 1 = plain reads, 2 = segment read-ahead
+	struct __readAhead *ahead;	// the streams reading this archive ahead, when readAhead is 2
+	char spool;	// a backup job's private output; hashed by the writer when it's copied into the archive
+	char level;	// level the compressor runs at; 0 while deflate stores an incompressible chunk
+	unsigned long feedTime, feedBytes;	// ns spent producing the compressor's input, and the input, since the last level decision
+	unsigned long codecTime, codecBytes;	// ns the compressor spent on the chunks it compressed, and their bytes
+	unsigned long lastCodec;	// when the compressor last returned
+	struct __ioBuf *codecIn;	// pool buffer the decompressor reads compressed bytes into
 	z_stream strm;
 #ifdef LIBLZMA
 	lzma_stream lstr;
 #endif
 	} archive;
 
+typedef struct __readAhead readAhead;
+
+typedef struct __ioBuf
+	{
+	unsigned char *data;	// IOBUFSIZE bytes from the buffer pool
+	int refs;
+	struct __ioBuf *next;	// free list
+	} ioBuf;
+
 /*----------------------------------------------------------------------------
 ** Global Storage.
 */
-extern unsigned char fileBuf[];
+extern __thread unsigned char fileBuf[];
 extern int arch_md_len;
+extern int readStreams;
+extern int poolBudget;
 
 /*----------------------------------------------------------------------------
 ** Function prototypes
 */
 extern int readSpecificFile(archive *arch, int major, int minor, char decompress);
+extern int readNextFile(archive *arch, char decompress);
+extern unsigned long nanoTime(void);
+extern int verifyImage(char *path, char inflate);
 extern int createImageArchive(char *filename, unsigned int segmentSize, archive *arch);
 extern int addFileToArchive(unsigned int major, unsigned int minor, unsigned char compression, archive *arch);
 extern int signFile(archive *arch);
+extern int createSpool(int fd, unsigned char compression, archive *arch);
+extern int endSpool(archive *arch);
+extern int addStoredFileToArchive(unsigned int major, unsigned int minor, unsigned char compression, archive *arch);
+extern int writeStored(unsigned char *buf, int size, archive *arch);
 extern int readImageArchive(char *filename, archive *arch);
 extern void closeArchive(archive *arch);
 extern int readSignature(archive *arch, char checkSum);
+extern bool isStreamName(char *name);
+extern int streamImage(char *source, int fd);
+extern void syncLater(int fd, char *name);
+extern int syncTargets(void);
+extern void pageBehind(int fd, unsigned long offset, unsigned long length, bool written);
+extern unsigned char *ioBuffer(void);
+extern unsigned int ioSize(int fd);
+extern int ioRead(int fd, unsigned char *buf, unsigned int size);
+extern int ioWrite(int fd, unsigned char *buf, unsigned int size);
+extern ioBuf *poolGet(bool wait);
+extern void poolHold(ioBuf *buf, int refs);
+extern void poolPut(ioBuf *buf);
+extern void poolIdle(ioBuf *buf);
 
 #endif /* _FILEENGINE_H_ */
@@ -32,6 +32,9 @@
 
 #include <ncurses.h>
 #include <dirent.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
 
 #include "cli.h"
 #include "mount.h"			// globalBuf, currentLine
@@ -60,6 +63,31 @@ extern char pbuf[];
 char *getStringPtr(poolset *sel, char *str);
 
 unsigned long getImageTitle(char *filename, char *buf, archive *arch);
+void manageWindow(selection *sel, int action);
+void showFunctionMenu(int action);
+#ifdef NETWORK_ENABLED
+bool prefetchHTTPImage(char *url);
+void endHTTPPrefetch(bool abandon);
+#endif
+
+/* archives on a cifs mount are read ahead by a worker thread so the page
+   cache already holds the index (and the first data) when it is parsed */
+#define PREFETCHSIZE 4194304
+#define PREFETCHREAD 1048576
+#define CIFSMOUNTDIR "/mnt/cifs/"
+
+struct __filePrefetch {
+	pthread_t tid;
+	char state; // 0 = idle, 1 = reading, 2 = done
+	bool cancel;
+	char path[MAX_PATH];
+	} filePrefetch;
+
+// state and cancel cross threads
+#define FILEPREFETCH_GET(f)   __atomic_load_n(&filePrefetch.f,__ATOMIC_ACQUIRE)
+#define FILEPREFETCH_SET(f,v) __atomic_store_n(&filePrefetch.f,v,__ATOMIC_RELEASE)
+
+selection *prefetchSel = NULL; // image panel waiting on a prefetch, if any
 
 int partitionCompare(const void *a, const void *b) {
         const partition *ia = (const partition *)a;
@@ -331,12 +359,46 @@ void processImageArchive(char *filename) {
 	closeArchive(&arch);
 	}
 
+void *prefetchFileThread(void *arg) {
+	unsigned char *buf;
+	unsigned long total = 0;
+	int fd, n;
+	sigset_t set; sigemptyset(&set); sigaddset(&set,SIGINT);
+	pthread_sigmask(SIG_BLOCK,&set,NULL); // ctrl-c belongs to the foreground
+	if ((buf = malloc(PREFETCHREAD)) != NULL) {
+		if ((fd = open(filePrefetch.path,O_RDONLY)) >= 0) {
+			while(!FILEPREFETCH_GET(cancel) && total < PREFETCHSIZE && (n = read(fd,buf,PREFETCHREAD)) > 0) total += n;
+			close(fd);
+			}
+		free(buf);
+		}
+	FILEPREFETCH_SET(state,2);
+	return NULL;
+	}
+
+// start reading path ahead; true once it is cached
+bool prefetchFile(char *path) {
+	long status;
+	if (!strcmp(filePrefetch.path,path)) return (FILEPREFETCH_GET(state) != 1);
+	if (FILEPREFETCH_GET(state)) {
+		FILEPREFETCH_SET(cancel,true); // at most one PREFETCHREAD away
+		pthread_join(filePrefetch.tid,(void **)&status);
+		}
+	if (strlen(path) >= sizeof(filePrefetch.path)) { FILEPREFETCH_SET(state,0); *filePrefetch.path = 0; return true; }
+	strcpy(filePrefetch.path,path);
+	FILEPREFETCH_SET(cancel,false);
+	FILEPREFETCH_SET(state,1);
+	if (pthread_create(&filePrefetch.tid,NULL,prefetchFileThread,NULL)) { FILEPREFETCH_SET(state,0); *filePrefetch.path = 0; return true; }
+	return false;
+	}
+
 void populateImage(selection *sourceSel, char clearPanel) { // inserts information into image selector
 	struct stat64 stats;
 	selection *sel = NULL;
 	item *curpos = NULL;
 	selectedType = 0; // unknown
 
+	prefetchSel = NULL;
 	if (clearPanel) return;
 	if (sourceSel != NULL) {
 		sel = sourceSel->attached;
@@ -353,19 +415,26 @@ void populateImage(selection *sourceSel, char clearPanel) { // inserts informati
 		}
 	if (!selectedType) { // determine full image path
 		if (curpos != NULL) sprintf(globalPath,"%s%s",sourceSel->currentPath,curpos->location);
+		else if (isStreamName(image1.image)) strcpy(globalPath,image1.image); // source=- or multicast
 		else if (image1.image[strlen(image1.image)-1] == '/') sprintf(globalPath,"%s%s",image1.image,(image1.path != NULL)?image1.path:"");
 		else sprintf(globalPath,"%s/%s",image1.image,(image1.path!= NULL)?image1.path:"");
 		imagePath(NULL);
+#ifdef NETWORK_ENABLED
+		if (strncmp(globalPath,"http://",7) || (curpos != NULL && curpos->state != CLR_GB)) endHTTPPrefetch(true); // the cursor moved off it
+#endif
 		if (!strncmp(globalPath,"http://",7)) {
 			if (curpos != NULL && curpos->state != CLR_GB) return;
 #ifdef NETWORK_ENABLED
 			*imageDevice = 0;
 			if (globalPath[strlen(globalPath)-1] == '/') globalPath[strlen(globalPath)-1] = 0; // clear leading '/'
+			if (curpos != NULL && ui_mode && !prefetchHTTPImage(globalPath)) { prefetchSel = sourceSel; return; } // keep browsing; pollImagePrefetch() comes back
 			iset.dcount = 0; resetPool(&iset.pool,0); loopDrive = -1;
 			selectedType = getHTTPInfo(1);
 			if ((selectedType == 2) && (setup && sel != NULL)) { populateImageSelector(sel); return; }
 #endif
 			}
+		else if (isStreamName(globalPath)) selectedType = 2; // stream archive
+		else if (curpos != NULL && ui_mode && !strncmp(globalPath,CIFSMOUNTDIR,strlen(CIFSMOUNTDIR)) && !prefetchFile(globalPath)) { prefetchSel = sourceSel; return; }
 		else if (!stat64(globalPath,&stats)) {
 			if (stats.st_mode & S_IFDIR) selectedType = 3;
 			else if (stats.st_mode & S_IFREG && (getType(globalPath) == 1)) {
@@ -393,3 +462,14 @@ void populateImage(selection *sourceSel, char clearPanel) { // inserts informati
 		}
 	return; // empty for now
 	}
+
+// called while the navigator is idle; fill in the image panel once its prefetch lands
+bool pollImagePrefetch(void) {
+	selection *sel = prefetchSel;
+	if (sel == NULL) return false;
+	populateImage(sel,0); // prefetchSel is set again while it's still reading
+	if (prefetchSel != NULL) return false;
+	manageWindow(sel->attached,CLEAR); manageWindow(sel,CLEAR);
+	showFunctionMenu(0);
+	return true;
+	}
@@ -23,6 +23,7 @@
 /*----------------------------------------------------------------------------
 ** Compiler setup
 */
+#include <stdbool.h>
 #include "partition.h" // diskset
 
 /*----------------------------------------------------------------------------
@@ -32,4 +33,9 @@ extern diskset iset;
 extern int loopDrive;
 extern unsigned long imageSize;
 
+/*----------------------------------------------------------------------------
+** Function prototypes.
+*/
+extern bool pollImagePrefetch(void);
+
 #endif /* _IMAGE_H_ */
@@ -34,12 +34,13 @@
 #include "partutil.h"		// readable
 #include "sha1.h"
 #include "window.h"     // globalPath, options
+#include "sysres_signal.h"	// SYSRES_SIGNAL_hasInterrupted
 
 extern bool remoteEntry;
 extern char localmount;
 
-extern unsigned char md_value[];
-extern unsigned char sha1buf[];
+extern __thread unsigned char md_value[];
+extern __thread unsigned char sha1buf[];
 
 extern char imageSizeString[];
 extern unsigned long httpImageSize;
@@ -55,19 +56,25 @@ char *url[MAXURLS];
 #define HTTP_TEMPREDIR	3	// 307
 #define HTTP_INTERRUPT  4	// Ctrl-C
 #define HTTP_RANGE_OK   5	// 206
+#define HTTP_FAILED     6	// retries ran out
 
 int httpResult;
 
+/* range reads that fail part way are resumed at the failed byte offset */
+#define HTTP_RETRY_FIRST  1	// seconds before the first retry; doubles each time
+#define HTTP_RETRY_MAX    30	// longest wait between two retries
+#define HTTP_RETRY_TOTAL  300	// give up after this many seconds without progress
+#define HTTP_STALL_TIME   30	// a transfer slower than 1 byte/s for this long has dropped
+
 /* HTTP file variables for reading HTTP files like a buffered file */
 #define MAXHTTPFILES 1
-#define HTTPBUFSIZE 10485760 // 10 MB per read operation
-// #define HTTPBUFSIZE 131072
+#define HTTPBUFSIZE IOBUFSIZE // per read operation; one buffer from the pool
 
 typedef struct __httpBuffer httpBuffer;
 
 struct __httpBuffer {
 	char *currentURL;	// set to NULL when no longer being used
-	unsigned char *httpBuffer; // allocate on first-use
+	ioBuf *buf; // from the pool while the file is open
 	unsigned long currentHTTPOffset;
 	unsigned int currentHTTPBufIndex;
 	unsigned int currentHTTPBufLimit; // up to HTTPBUFSIZE
@@ -89,6 +96,7 @@ bool recentSeek = true;
 int bufIndex;
 selection *httpSel;
 CURL *curl = NULL;
+CURLcode curlResult; // outcome of the last transfer, to tell a dropped connection from EOF
 int totalRead;
 unsigned long totalWrite;
 
@@ -339,6 +347,7 @@ readBuf part;
 #define ISIZE 4
 #define LSIZE 8
 #define VSIZE 8
+#define ARCHHEAD 45 // 20-byte header + 25-byte file descriptor, ahead of the title
 
 // size_t readHTTPContents
 
@@ -556,10 +565,202 @@ size_t headerFunc(char *ptr, size_t size, size_t nmemb, void *userdata) {
         return totalSize;
         }
 
+/* Index prefetch: while the cursor rests on an archive, a worker thread with
+   its own curl handle records the responses getHTTPInfo() is about to ask for,
+   plus the first data ranges of the primary segment. The foreground replays
+   them through the usual callbacks, so parsing stays in one place. */
+#define PREFETCHSIZE 4194304	// primary segment bytes fetched ahead
+#define PREFETCHSEGS 64		// segment probes recorded ahead
+#define PREFETCHPEEK 512	// body bytes a segment probe needs (mime + fspec + title)
+#define PREFETCHHDR  2048	// header lines kept per response
+
+#define PREFETCH_IDLE    0
+#define PREFETCH_RUNNING 1
+#define PREFETCH_DONE    2
+
+// state and cancel cross threads; DONE is released after the records are written
+#define PREFETCH_GET(f)   __atomic_load_n(&prefetch.f,__ATOMIC_ACQUIRE)
+#define PREFETCH_SET(f,v) __atomic_store_n(&prefetch.f,v,__ATOMIC_RELEASE)
+
+typedef struct __httpRecord httpRecord;
+
+struct __httpRecord {
+	char header[PREFETCHHDR]; // NUL-separated header lines, as curl delivered them
+	int headerBytes;
+	unsigned char *body;
+	unsigned int bodyBytes;
+	unsigned int bodyLimit;
+	bool complete;		// holds everything readHTTPType() will look at
+	bool ok;		// a 200 response, so the body is archive data
+	};
+
+struct __httpPrefetch {
+	pthread_t tid;
+	char state;
+	bool cancel;
+	char url[MAX_PATH];
+	int count;
+	httpRecord rec[PREFETCHSEGS];
+	unsigned char peek[PREFETCHSEGS][PREFETCHPEEK];
+	} prefetch;
+
+size_t recordHTTPHeader(char *ptr, size_t size, size_t nmemb, void *userdata) {
+	httpRecord *r = userdata;
+	size_t len = size * nmemb;
+	if (PREFETCH_GET(cancel)) return 0;
+	if (r->headerBytes + len + 1 > PREFETCHHDR) return len; // drop overlong headers; Content-Length comes early
+	memcpy(&r->header[r->headerBytes],ptr,len);
+	r->headerBytes += len;
+	r->header[r->headerBytes++] = 0;
+	return len;
+	}
+
+size_t recordHTTPBody(char *ptr, size_t size, size_t nmemb, void *userdata) {
+	httpRecord *r = userdata;
+	size_t len = size * nmemb;
+	if (PREFETCH_GET(cancel)) return 0;
+	if (len > r->bodyLimit - r->bodyBytes) len = r->bodyLimit - r->bodyBytes;
+	memcpy(&r->body[r->bodyBytes],ptr,len);
+	r->bodyBytes += len;
+	return (r->bodyBytes == r->bodyLimit)?0:size * nmemb; // stop once we have enough
+	}
+
+int cancelHTTPPrefetch(void *p, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow) {
+	return PREFETCH_GET(cancel); // also fires while waiting on a slow server
+	}
+
+void *prefetchHTTPThread(void *arg) {
+	char segURL[MAX_PATH+16];
+	long responseCode;
+	curl_off_t length;
+	unsigned long indexBytes;
+	httpRecord *r;
+	CURL *handle;
+	CURLcode res;
+	int i;
+	sigset_t set; sigemptyset(&set); sigaddset(&set,SIGINT);
+	pthread_sigmask(SIG_BLOCK,&set,NULL); // ctrl-c belongs to the foreground
+	if ((handle = curl_easy_init()) != NULL) {
+		for (i=0;i<PREFETCHSEGS && !PREFETCH_GET(cancel);i++) {
+			r = &prefetch.rec[i];
+			if (i) sprintf(segURL,"%s.%i",prefetch.url,i); else strcpy(segURL,prefetch.url);
+			curl_easy_reset(handle);
+			curl_easy_setopt(handle,CURLOPT_URL,segURL);
+			curl_easy_setopt(handle,CURLOPT_NOSIGNAL,1L);
+			curl_easy_setopt(handle,CURLOPT_CONNECTTIMEOUT,(long)HTTP_STALL_TIME);
+			curl_easy_setopt(handle,CURLOPT_NOPROGRESS,0L);
+			curl_easy_setopt(handle,CURLOPT_XFERINFOFUNCTION,cancelHTTPPrefetch);
+			curl_easy_setopt(handle,CURLOPT_HEADERFUNCTION,recordHTTPHeader);
+			curl_easy_setopt(handle,CURLOPT_HEADERDATA,r);
+			curl_easy_setopt(handle,CURLOPT_WRITEFUNCTION,recordHTTPBody);
+			curl_easy_setopt(handle,CURLOPT_WRITEDATA,r);
+			r->headerBytes = r->bodyBytes = 0;
+			r->complete = r->ok = false;
+			if (i) { r->body = prefetch.peek[i]; r->bodyLimit = PREFETCHPEEK; }
+			else if ((r->body = malloc(PREFETCHSIZE)) == NULL) break;
+			else r->bodyLimit = PREFETCHSIZE;
+			res = curl_easy_perform(handle);
+			if (PREFETCH_GET(cancel) || (res != CURLE_OK && res != CURLE_WRITE_ERROR)) break; // leave it to the foreground
+			prefetch.count = i+1;
+			responseCode = 0; length = 0;
+			curl_easy_getinfo(handle,CURLINFO_RESPONSE_CODE,&responseCode);
+			curl_easy_getinfo(handle,CURLINFO_CONTENT_LENGTH_DOWNLOAD_T,&length);
+			r->ok = (responseCode == 200);
+			if (r->bodyBytes < r->bodyLimit) r->complete = true; // got the whole response
+			else if (i) r->complete = true; // a probe never looks past the title
+			else { // the primary segment must hold the whole index
+				memcpy(&indexBytes,&r->body[20],LSIZE);
+				r->complete = (ARCHHEAD + indexBytes <= r->bodyBytes);
+				}
+			if (responseCode != 200 || length <= 0) break; // getHTTPInfo() stops here too
+			}
+		curl_easy_cleanup(handle);
+		}
+	PREFETCH_SET(state,PREFETCH_DONE);
+	return NULL;
+	}
+
+// wait for (or abandon) the current prefetch and release it
+void endHTTPPrefetch(bool abandon) {
+	long status;
+	if (PREFETCH_GET(state) != PREFETCH_IDLE) {
+		if (abandon) PREFETCH_SET(cancel,true);
+		pthread_join(prefetch.tid,(void **)&status);
+		PREFETCH_SET(state,PREFETCH_IDLE);
+		}
+	if (abandon) {
+		if (prefetch.rec[0].body != NULL) free(prefetch.rec[0].body);
+		prefetch.rec[0].body = NULL;
+		prefetch.count = 0;
+		*prefetch.url = 0;
+		}
+	}
+
+// start fetching url in the background; true once everything is at hand
+bool prefetchHTTPImage(char *url) {
+	static bool initialized = false;
+	if (!strcmp(prefetch.url,url)) return (PREFETCH_GET(state) != PREFETCH_RUNNING);
+	endHTTPPrefetch(true);
+	if (!initialized) { curl_global_init(CURL_GLOBAL_ALL); initialized = true; } // not thread-safe; do it here
+	if (strlen(url) >= sizeof(prefetch.url)) return true; // too long to keep; fetch in the foreground
+	strcpy(prefetch.url,url);
+	PREFETCH_SET(cancel,false);
+	prefetch.count = 0;
+	PREFETCH_SET(state,PREFETCH_RUNNING);
+	if (pthread_create(&prefetch.tid,NULL,prefetchHTTPThread,NULL)) { PREFETCH_SET(state,PREFETCH_IDLE); *prefetch.url = 0; return true; } // no thread; fetch in the foreground
+	return false;
+	}
+
+// the prefetched response for url, if it was recorded
+httpRecord *findHTTPRecord(char *url) {
+	int len = strlen(prefetch.url);
+	int i = 0;
+	if (!*prefetch.url || strncmp(url,prefetch.url,len)) return NULL;
+	if (url[len] == '.') i = atoi(&url[len+1]);
+	else if (url[len]) return NULL;
+	if (i <= 0 && url[len]) return NULL;
+	if (PREFETCH_GET(state) == PREFETCH_RUNNING) endHTTPPrefetch(false); // it's fetching what we want anyway
+	return (i < prefetch.count)?&prefetch.rec[i]:NULL;
+	}
+
+// feed a prefetched response through readHTTPType() the way curl would have
+bool replayHTTPRecord(char *url, char curlFunc) {
+	char line[PREFETCHHDR];
+	httpRecord *r;
+	unsigned int offset, len;
+	int i;
+	if ((r = findHTTPRecord(url)) == NULL || !r->complete) return false;
+	hasHeader = (curlFunc == 3)?1:-1;
+	totalRead = 0;
+	httpResult = 0;
+	curlResult = CURLE_OK;
+	for (i=0;i<r->headerBytes;i+=len+1) {
+		len = strlen(&r->header[i]);
+		strcpy(line,&r->header[i]); // readContentLength() edits the line in place
+		if (readHTTPType(line,1,len,NULL) != len) return true;
+		}
+	for (offset=0;offset<r->bodyBytes;offset+=len) {
+		len = r->bodyBytes - offset;
+		if (len > CURL_MAX_WRITE_SIZE) len = CURL_MAX_WRITE_SIZE;
+		if (readHTTPType((char *)&r->body[offset],1,len,NULL) != len) break;
+		}
+	return true;
+	}
+
+// copy what the prefetch already holds of a primary segment range
+unsigned int prefetchedHTTPRange(char *url, unsigned long start, unsigned int length, unsigned char *buf) {
+	httpRecord *r;
+	if ((r = findHTTPRecord(url)) == NULL || !r->ok || start >= r->bodyBytes) return 0;
+	if (length > r->bodyBytes - start) length = r->bodyBytes - start;
+	memcpy(buf,&r->body[start],length);
+	return length;
+	}
+
 void *performCurl(void *ptr) {
 	CURLcode res;
 	long responseCode;
 	res = curl_easy_perform(curl);
+	curlResult = res;
 	if (res != CURLE_OK && (ptr != NULL)) { debug(INFO,5,"CURL error: %s\n",curl_easy_strerror(res)); httpResult = 0; }
 	if (res == CURLE_OK) {
 		curl_easy_getinfo(curl,CURLINFO_RESPONSE_CODE,&responseCode);
@@ -570,6 +771,7 @@ void *performCurl(void *ptr) {
 void getHeaderResponse(char *url, char curlFunc) {
 	int pid;
 	sigset_t set; sigemptyset(&set); sigaddset(&set,SIGINT);
+	if ((curlFunc == 3 || curlFunc == 4) && replayHTTPRecord(url,curlFunc)) return; // already fetched in the background
 	if (curl == NULL) curl = curl_easy_init();
         if (!curl) return;
         curl_easy_reset(curl);
@@ -601,6 +803,10 @@ void getHeaderResponse(char *url, char curlFunc) {
 		slist = curl_slist_append(slist,tmpBuf);
 		curl_easy_setopt(curl,CURLOPT_HTTPHEADER,slist);
 		curl_easy_setopt(curl,CURLOPT_WRITEFUNCTION,(void *)readHTTPRange);
+		curl_easy_setopt(curl,CURLOPT_FAILONERROR,1); // don't take an error page as data
+		curl_easy_setopt(curl,CURLOPT_CONNECTTIMEOUT,(long)HTTP_STALL_TIME);
+		curl_easy_setopt(curl,CURLOPT_LOW_SPEED_LIMIT,1L);
+		curl_easy_setopt(curl,CURLOPT_LOW_SPEED_TIME,(long)HTTP_STALL_TIME);
 		}
 /*
 	else if (curlFunc == 6) { // UNUSED -- F10 Verify Image
@@ -610,6 +816,7 @@ void getHeaderResponse(char *url, char curlFunc) {
 		}
 */
         httpResult = 0;
+	curlResult = CURLE_OK;
         startTimer(3);
 
         pthread_t tid;
@@ -643,10 +850,10 @@ int openHTTPFile(char *url) { // don't need to determine if file exists since a
 		}
 	if (i == allocatedHTTPBuffers) { // create some more
 		if (i == MAXHTTPFILES) return -1;
-		if ((httpBuf[i].httpBuffer = malloc(sizeof(char)*HTTPBUFSIZE)) == NULL) return -1;
 		if ((httpBuf[i].currentURL = malloc(sizeof(char)*MAX_PATH)) == NULL) return -1;
 		allocatedHTTPBuffers++;
 		}
+	httpBuf[i].buf = poolGet(true);
 	strcpy(httpBuf[i].currentURL,url);
 	httpBuf[i].currentHTTPOffset = 0;
 	httpBuf[i].currentHTTPBufIndex = 0;
@@ -662,14 +869,66 @@ void seekHTTPFile(int fd, unsigned int start) {
 	recentSeek = true;
 	}
 
+// true if the last range transfer broke off in a way that is worth retrying
+bool transientHTTPError(void) {
+	long responseCode = 0;
+	switch (curlResult) {
+		case CURLE_COULDNT_RESOLVE_HOST:
+		case CURLE_COULDNT_CONNECT:
+		case CURLE_PARTIAL_FILE:
+		case CURLE_OPERATION_TIMEDOUT:
+		case CURLE_GOT_NOTHING:
+		case CURLE_SEND_ERROR:
+		case CURLE_RECV_ERROR: return true;
+		case CURLE_HTTP_RETURNED_ERROR: // 5xx is the server's trouble; 416 etc. is a real EOF
+			if (curl != NULL) curl_easy_getinfo(curl,CURLINFO_RESPONSE_CODE,&responseCode);
+			return (responseCode >= 500);
+		default: return false;
+		}
+	}
+
+// wait out a retry delay, in small steps so ctrl-c is still honoured
+bool waitHTTPRetry(int seconds) {
+	int i;
+	for (i=0;i<seconds*10;i++) {
+		if (SYSRES_SIGNAL_hasInterrupted || has_interrupted) return true;
+		usleep(100000);
+		}
+	return false;
+	}
+
 int continueHTTPRange(int fd, unsigned int start, unsigned int length) {
-	currentDownloadBuffer = httpBuf[fd].httpBuffer;
-	startRange = start;
-	maxCharsAllowed = length;
-	totalCharsRead = 0;
-	getHeaderResponse(httpBuf[fd].currentURL,6);
-	httpBytesRead += totalCharsRead;
-	return (httpResult)?totalCharsRead:0; // should be HTTP_RANGE_OK; otherwise indicates EOF
+	unsigned int done = 0;
+	int delay = HTTP_RETRY_FIRST;
+	int waited = 0;
+	long responseCode = 0;
+	if ((done = prefetchedHTTPRange(httpBuf[fd].currentURL,start,length,httpBuf[fd].buf->data)) == length) {
+		httpResult = HTTP_RANGE_OK;
+		return done;
+		}
+	while (1) {
+		currentDownloadBuffer = &httpBuf[fd].buf->data[done]; // keep what the dropped transfer already delivered
+		startRange = start + done;
+		maxCharsAllowed = length - done;
+		totalCharsRead = 0;
+		getHeaderResponse(httpBuf[fd].currentURL,6);
+		httpBytesRead += totalCharsRead;
+		done += totalCharsRead;
+		if (httpResult == HTTP_INTERRUPT || SYSRES_SIGNAL_hasInterrupted) { httpResult = HTTP_INTERRUPT; return done; }
+		if (done == length || !transientHTTPError()) break;
+		if (totalCharsRead) { delay = HTTP_RETRY_FIRST; waited = 0; } // it was making progress; start backing off again
+		if (waited >= HTTP_RETRY_TOTAL) { debug(INFO,1,"Giving up on %s at offset %lu: %s\n",httpBuf[fd].currentURL,startRange+totalCharsRead,curl_easy_strerror(curlResult)); httpResult = HTTP_FAILED; return 0; }
+		debug(INFO,1,"%s at offset %lu; resuming in %is\n",curl_easy_strerror(curlResult),(unsigned long)start+done,delay);
+		if (waitHTTPRetry(delay)) { httpResult = HTTP_INTERRUPT; return done; }
+		waited += delay;
+		if ((delay <<= 1) > HTTP_RETRY_MAX) delay = HTTP_RETRY_MAX;
+		}
+	if (curlResult == CURLE_HTTP_RETURNED_ERROR && done && curl != NULL) { // a resume that starts exactly at EOF
+		curl_easy_getinfo(curl,CURLINFO_RESPONSE_CODE,&responseCode);
+		if (responseCode == 416) return done;
+		}
+	if (curlResult != CURLE_OK && done != length) return 0; // e.g. 416: nothing left to read
+	return (httpResult)?done:0; // should be HTTP_RANGE_OK; otherwise indicates EOF
 	}
 
 // read from an 'open' HTTP file, at a particular location
@@ -677,7 +936,7 @@ int readHTTPFile(int fd, unsigned char *buf, int size) {
 	unsigned int available = httpBuf[fd].currentHTTPBufLimit - httpBuf[fd].currentHTTPBufIndex;
 	int remaining = size;
 	int totalBuffered = 0;
-	unsigned char *downloadBuffer = httpBuf[fd].httpBuffer;
+	unsigned char *downloadBuffer = httpBuf[fd].buf->data;
 	unsigned int lastRange;
 	while (remaining > available) { // return what's left, then read another buffer
 		if (available) { // flush the buffer
@@ -691,6 +950,7 @@ int readHTTPFile(int fd, unsigned char *buf, int size) {
 		recentSeek = false;
 		httpBuf[fd].currentHTTPBufLimit = continueHTTPRange(fd,httpBuf[fd].currentHTTPOffset,lastRange);
 		if (httpResult == HTTP_INTERRUPT) { has_interrupted = 1; return -1; }
+		if (httpResult == HTTP_FAILED) return -1; // not EOF: the rest of the file never arrived
 		httpBuf[fd].currentHTTPOffset += httpBuf[fd].currentHTTPBufLimit; // what we've read from the HTTP file
 		if (!httpBuf[fd].currentHTTPBufLimit) return totalBuffered; // EOF; return what we have left
 		if (httpBuf[fd].currentHTTPBufLimit < lastRange) break; // nothing left to read
@@ -707,6 +967,8 @@ int readHTTPFile(int fd, unsigned char *buf, int size) {
 
 void closeHTTPFile(int fd) {
 	*httpBuf[fd].currentURL = 0;
+	poolPut(httpBuf[fd].buf);
+	httpBuf[fd].buf = NULL;
 	}
 
 char *scanDirs(char *inUrl) {
@@ -66,6 +66,8 @@ extern unsigned int globalOps; // total number of backup operations
 
 extern volatile sig_atomic_t has_interrupted;
 
+char *readableTime(unsigned int elapsed, char bufLoc);
+
 unsigned long *archPointer;
 unsigned long *filePointer;
 
@@ -430,6 +432,10 @@ int getTermWidth(void) {
 #define PROG_OPERATION  "     Operation: "
 #define PROG_COMPRESS   "   Compression: "
 #define PROG_SHA1SUM    "SHA1 Signature: Calculating"
+#define PROG_DATA       "    Image data: "
+#define PROG_ESTIMATE   "  Archive size: "
+#define PROG_DURATION   "      Duration: "
+#define PROG_FREE       "   Target free: "
 
 void setProgress(char progressType, unsigned char *src, unsigned char *trg, unsigned int major, unsigned int minor, unsigned char type, unsigned char *label, unsigned long size, unsigned int state, archive *arch) {
 	lastProgress = progressType;
@@ -522,6 +528,33 @@ void setStatus(char *status) {
 	}
 
 
+// the totals of estimateBackup(); avail is 0 when the target's free space isn't known
+void showEstimate(unsigned long data, unsigned long archived, unsigned long seconds, unsigned long avail) {
+	char *comp = (compression == GZIP)?"zlib":(compression)?"lzma":"no";
+	bool fits = (!avail || archived < avail);
+	if (!ui_mode) {
+		readableSize(data); printf("Image data:   %s\n",readable);
+		readableSize(archived); printf("Archive size: %s (%s compression)\n",readable,comp);
+		printf("Duration:     %s\n",readableTime(seconds,0));
+		if (avail) { readableSize(avail); printf("Target free:  %s%s\n",readable,fits?"":" -- not enough space for the archive"); }
+		return;
+		}
+	WINDOW *win = wins[WIN_PROGRESS];
+	const int hpos = 4;
+	int posCount = 3;
+	wmove(win,2,0);
+	wclrtobot(win);
+	box(win,0,0);
+	readableSize(data); mvwprintw(win,posCount++,hpos,"%s%s",PROG_DATA,readable);
+	readableSize(archived); mvwprintw(win,posCount++,hpos,"%s%s (%s compression)",PROG_ESTIMATE,readable,comp);
+	mvwprintw(win,posCount++,hpos,"%s%s",PROG_DURATION,readableTime(seconds,0));
+	if (avail) { readableSize(avail); mvwprintw(win,posCount++,hpos,"%s%s",PROG_FREE,readable); }
+	progressLoc = posCount++;
+	mvwprintw(win,progressLoc,hpos,PROG_STATUS);
+	archPointer = NULL;
+	feedbackComplete(fits?"":"*** NOT ENOUGH SPACE ON TARGET ***");
+	}
+
 /*
 
           Source: /dev/sda [3.4TB]
@@ -54,6 +54,7 @@
 #define MAXPSTR 256
 
 #define VERSTRING "HPRI0000"
+#define STREAMSTRING "HPRS0000" // stream layout; no segments, no back-seeking
 #define SYSLABEL "RESTORE"
 #define LOCALFS "Local Filesystem"
 #define CIFSMOUNT "CIFS Network Mount"
@@ -71,6 +72,10 @@
 #define PART_XFS	7
 #define PART_SWAP	8
 #define PART_RAW	9
+#define PART_BTRFS	10
+#define PART_F2FS	11
+#define PART_EXFAT	12
+#define PART_LVM	13 // LVM2 physical volume
 
 #define PART_CONTAINER      31 // container for loop device
 // could make this 3 bits if we reduce the number of available format types
@@ -87,7 +92,7 @@
 
 #define PARTIMG { 0 } // PART_MSDOS, PART_EXT2, PART_EXT3, PART_EXT4, PART_VFAT, PART_NTFS, PART_XFS, 0 } /* btrfs? */
 #define FSARCH { 0 } // PART_EXT2, PART_EXT3, PART_EXT4, PART_NTFS, PART_XFS, 0 }
-#define PCLONE { PART_EXT2, PART_EXT3, PART_EXT4, PART_XFS, PART_MSDOS, PART_VFAT, PART_NTFS, 0 }
+#define PCLONE { PART_EXT2, PART_EXT3, PART_EXT4, PART_XFS, PART_MSDOS, PART_VFAT, PART_NTFS, PART_BTRFS, PART_F2FS, PART_EXFAT, PART_LVM, 0 }
 
 #define IMG_INDEX ".imageindex"
 #define IMG_SHA1 ".image.sha1"
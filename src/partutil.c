@@ -66,7 +66,7 @@ char readable[10];
 
 extern char show_list;
 
-extern unsigned char sha1buf[];
+extern __thread unsigned char sha1buf[];
 
 #include <signal.h>
 volatile sig_atomic_t has_interrupted;
@@ -147,6 +147,34 @@ typedef struct xfs_super_block {
     u_char    volname[12];
 } xfs;
 
+#define F2FS_SUPER_MAGIC 0xF2F52010
+#define F2FSLSIZE 512
+typedef struct f2fs_super_block {
+    u_char    nop1[1024];
+    u_char    magic[4];
+    u_char    nop2[120];
+    u_char    volname[F2FSLSIZE*2]; // UTF-16LE
+} f2fs;
+
+#define BTRFSLSIZE 256
+#define BTRFS_SUPER_OFFSET 65536
+#define BTRFS_SUPER_MAGIC "_BHRfS_M"
+typedef struct btrfs_super_block {
+    u_char    nop1[64];
+    u_char    magic[8];
+    u_char    nop2[227];
+    u_char    volname[BTRFSLSIZE]; // 0x12B
+} btrfs;
+
+#define LVM_LABEL_MAGIC "LABELONE"
+#define LVM_TYPE_MAGIC "LVM2 001"
+#define LVM_LABEL_SECTORS 4 // the label may be in any of the first four sectors
+typedef struct lvm_label_header {
+    u_char    magic[8];
+    u_char    nop1[16];
+    u_char    type[8];
+} lvm;
+
 #define VFATLSIZE 11
 #define VFAT_SUPER_MAGIC "MSDOS5.0"
 typedef struct vfat_super_block {
@@ -202,6 +230,17 @@ int partitionStartCompare(const void *a, const void *b) {
 	else return (ia->start > ib->start);
 	}
 
+// the btrfs superblock is well past the page findLabel() reads
+bool btrfsLabel(char *devName, char *tmp) {
+	btrfs b;
+	int fd = open(devName,O_RDONLY | O_LARGEFILE);
+	if (fd < 0) return false;
+	if (pread64(fd,&b,sizeof(btrfs),BTRFS_SUPER_OFFSET) != sizeof(btrfs) || strncmp((char *)b.magic,BTRFS_SUPER_MAGIC,8)) { close(fd); return false; }
+	close(fd);
+	strncpy(tmp,(char *)b.volname,VOLNAMSZ-1);
+	return true;
+	}
+
 unsigned char findLabel(char *devName, char **label) {
 	char tmp[VOLNAMSZ];
 	int n = getpagesize(); // typically 4096
@@ -213,16 +252,27 @@ unsigned char findLabel(char *devName, char **label) {
 	ext2 *e = (ext2 *)&labelBuf[1024];
 	xfs *x = (xfs *)labelBuf;
 	vfat *vf = (vfat *)labelBuf;
+	f2fs *f = (f2fs *)labelBuf;
+	lvm *lv = NULL;
+	int i;
 	int fd = open(devName,O_RDONLY | O_LARGEFILE);
 	if (fd < 0) return type;
 	if (read(fd,(char *)labelBuf,n) != n) { close(fd); debug(INFO,1,"No label read for %s (ext'd?).\n",devName); return type; }
 	close(fd);
+	for (i = 0; i < LVM_LABEL_SECTORS && lv == NULL; i++) {
+		lv = (lvm *)&labelBuf[i*512];
+		if (strncmp((char *)lv->magic,LVM_LABEL_MAGIC,8) || strncmp((char *)lv->type,LVM_TYPE_MAGIC,8)) lv = NULL;
+		}
 	if (!strncmp(vf->type,"FAT32   ",8) && vf->term[0] == 0x55 && vf->term[1] == 0xAA) {  // vf->magic == MSDOS5.0, mkdosfs
 		strncpy(tmp,vf->volname,VFATLSIZE);
 		tmp[VFATLSIZE] = 0;
 		// if (!strcmp("NO NAME    ",tmp)) *tmp = 0;
 		type = PART_VFAT;
 		}
+	else if (!strncmp((char *)vf->magic,"EXFAT   ",8)) {
+		tmp[0] = 0; // label is a root directory entry
+		type = PART_EXFAT;
+		}
 	else if (!strncmp(vf->magic,"NTFS    ",8)) {
 		tmp[0] = 0; // skip label for now; actual $Volume is further out
 		type = PART_NTFS;
@@ -237,6 +287,12 @@ unsigned char findLabel(char *devName, char **label) {
 		}
 	else if (!strncmp(labelBuf+n-10,SWAP_SUPER_MAGIC,10) && s->version == 1) { strncpy(tmp,s->volname,VOLNAMSZ-1); type = PART_SWAP; } // swap
 	else if (!strncmp(x->magic,XFS_SUPER_MAGIC,4)) { strncpy(tmp,x->volname,XFSLSIZE); type = PART_XFS; tmp[XFSLSIZE] = 0; } // xfs
+	else if (f->magic[0] + 256*f->magic[1] + 65536*f->magic[2] + 16777216U*f->magic[3] == F2FS_SUPER_MAGIC) { // f2fs
+		for (i = 0; i < VOLNAMSZ-1; i++) tmp[i] = (f->volname[2*i+1])?'_':f->volname[2*i]; // keep it to ascii
+		type = PART_F2FS;
+		}
+	else if (lv != NULL) { tmp[0] = 0; type = PART_LVM; } // LVM2 PV; the VG name is in the metadata area
+	else if (btrfsLabel(devName,tmp)) type = PART_BTRFS;
 	else return type;
 // /dev/disk/by-label => does not appear to be present in RHEL 6.2, so we can't use that in addition to the block approach
 	tmp[VOLNAMSZ-1] = 0;
@@ -430,10 +486,10 @@ bool readPercentages(archive *arch, char *format, int major, int minor, int imag
 	float percentage = 0.0;
 	char r2[10];
 	int i, n;
-	if (readSpecificFile(arch, major, minor, 1) == 1) {
+	char inflate = (!(show_list & 4) || (options & OPT_DEEP))?1:0; // the sha1sum is over the stored bytes; only --deep decodes them
+	if (readSpecificFile(arch, major, minor, inflate) == 1) {
 		if (show_list & 4) { // verify the file sha1sum
-			// progressBar(arch->fileSizePosition,PROGRESS_LIGHT,PROGRESS_INIT);
-			progressBar(arch->expectedOriginalBytes,PROGRESS_LIGHT,PROGRESS_INIT);
+			progressBar((inflate)?arch->expectedOriginalBytes:arch->fileSizePosition,PROGRESS_LIGHT,PROGRESS_INIT);
 			if (show_list & 1) { // only show expected sums (verify list)
 				n = readSignature(arch,0);
 				for (i=0;i<20;i++) sprintf(&globalBuf[i << 1],"%02X",fileBuf[i+4]);
@@ -441,16 +497,15 @@ bool readPercentages(archive *arch, char *format, int major, int minor, int imag
 			else {
 				bzero(sha1buf,24);
 				globalBuf[40] = 0;
-                		while((n = readFile(fileBuf,FBUFSIZE,arch,1)) > 0) {
-					// progressBar(arch->fileBytes,arch->originalBytes,PROGRESS_UPDATE);
-					if (progressBar(arch->originalBytes,arch->originalBytes,PROGRESS_UPDATE)) return true;
+                		while((n = readFile(ioBuffer(),IOBUFSIZE,arch,inflate)) > 0) {
+					if (progressBar((inflate)?arch->originalBytes:arch->fileBytes,arch->fileBytes,PROGRESS_UPDATE)) return true;
 					}
 				printf("\r\033[?25h\033[K");
 				for (i=0;i<20;i++) sprintf(&globalBuf[i << 1],"%02X",sha1buf[i+4]);
 				}
 #ifdef NETWORK_ENABLED
 	if (has_interrupted) {
-		progressBar(arch->originalBytes,arch->originalBytes,PROGRESS_UPDATE);
+		progressBar((inflate)?arch->originalBytes:arch->fileBytes,arch->fileBytes,PROGRESS_UPDATE);
 		return true;
 		}
 #endif
@@ -22,6 +22,8 @@
 
 extern char readable[];
 
+extern void readableSize(unsigned long val);
+
 
 
 #endif /* _PARTUTIL_H_ */
@@ -23,19 +23,24 @@
 ** Compiler setup.
 */
 #define _LARGEFILE64_SOURCE
+#define _GNU_SOURCE           // O_DIRECT
 #include <errno.h>
+#include <dirent.h>
 #include <fcntl.h>
 #include <ncurses.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <linux/fs.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #ifdef PARTCLONE
   #include <libpartclone.h>
 #endif
+#include "backup.h"				// diskJobs
 #include "cli.h"					// add_img, testMode, validOperation
 #include "drive.h"				// types, mapTypes
 #include "fileEngine.h" 	// readSpecificFile(), fileBuf
@@ -45,6 +50,8 @@
 #include "partutil.h"			// readable
 #include "window.h"     	// globalPath, options
 #include "sysres_debug.h"	// SYSRES_DEBUG_Debug(), SYSRES_DEBUG_level
+#include "sysres_blockmap.h"	// SYSRES_BLOCKMAP_Next()
+#include "sysres_pclone.h"	// SYSRES_PCLONE_Start()
 
 #define MAX_MBRBUF 512000000
 
@@ -58,190 +65,1513 @@
 	/* Local storage */
 	bool           imageBuffered = false;
 
+extern volatile sig_atomic_t has_interrupted;
+
+char *readableTime(unsigned int elapsed, char bufLoc);
+
 /*----------------------------------------------------------------------------
+** Restore plan. restoreDisk() queues the tables and partitions of every
+** selected disk instead of restoring them in disk order, then the queue is
+** restored in archive order: the calling thread walks the archive once and
+** restores each file as it comes by, so no file is read twice and stream
+** archives can be restored whatever the disk order. Sizes come from the
+** archive's catalog of file headers rather than from reading ahead.
 **
+** Parallel restore (jobs=). The walk only does the tables and swap; then
+** one thread per target disk restores its partitions. Files are contiguous
+** in the archive, so each thread reads just its own files, in archive
+** order, through a reader of its own and the archive is still read once
+** overall. The calling thread follows the queue for the display.
+**
+** With --tee, a partition queued for several disks from the same archive
+** file is read and decompressed once, by the job queued first; the others
+** follow it and each target gets writers of its own, so a target that fails
+** is dropped without stopping the rest.
 */
-static bool ddRestore(
-		char          *device,
-		int            major,
-		int            minor,
-		unsigned char  type,
-		archive       *arch
+#define RESTORE_JOB_WAIT  0
+#define RESTORE_JOB_RUN   1
+#define RESTORE_JOB_DONE  2
+#define RESTORE_JOB_FAIL  3
+#define RESTORE_JOB_POLL  250              // ms between display updates while waiting on a job
+#define RESTORE_TEE       8                // most targets written from one read
+
+typedef struct
+	{
+	char          *source;
+	char          *label;
+	char          *target;
+	int            major;
+	int            minor;
+	int            state;
+	int            type;
+	disk          *d;
+	int            order;                  // position in the archive
+	unsigned long  expected;
+	unsigned long  originalBytes;          // restored so far
+	char           status;
+	int            tee;                    // next job written from the same read; 0 = none
+	bool           follower;               // written by the job that leads its tee
+	bool           failed;                 // its target failed while the others went on
+	} restoreJob;
+
+static struct
+	{
+	restoreJob     *job;
+	int             count;
+	bool            planning;              // restore() queues files instead of restoring them
+	bool            workers;               // threads restore the partitions
+	disk           *d;                     // disk restoreDisk() is on
+	bool            stop;
+	pthread_mutex_t lock;
+	pthread_cond_t  cond;
+	} restoreJobs = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+typedef struct
+	{
+	int            major;
+	int            minor;
+	unsigned long  originalBytes;
+	} restoreEntry;
+
+static struct
+	{
+	restoreEntry   *entry;                 // archive order
+	int             count;
+	} restoreCatalog;
+
+/*----------------------------------------------------------------------------
+** Progress for an engine; a job only reports to the thread showing it,
+** for itself and whatever follows it. Returns true when cancelled.
+*/
+static bool restoreProgress(
+		archive    *arch,
+		restoreJob *job
 		)
 	{
-	int fd = -1;
-	int n;
+	bool stop;
 
-	if(readSpecificFile(arch,major,minor,1) != 1)
+	if(job == NULL)
 		{
-		debug(ABORT, 0,"Damaged archive");
-		return true;
+		if(progressBar(arch->originalBytes,arch->originalBytes,PROGRESS_UPDATE))
+			{
+			feedbackComplete("*** CANCELLED ***");
+			return(true);
+			}
+
+		progressBar(arch->originalBytes,arch->originalBytes,PROGRESS_UPDATE | 1); // update global count
+		return(false);
 		}
 
-  fd = open(device,O_WRONLY | O_LARGEFILE);
-	if(fd < 0)
+	pthread_mutex_lock(&restoreJobs.lock);
+	for(; job != NULL; job = job->tee ? &restoreJobs.job[job->tee] : NULL)
+		job->originalBytes = arch->originalBytes;
+
+	stop = restoreJobs.stop;
+	pthread_mutex_unlock(&restoreJobs.lock);
+
+	return(stop || has_interrupted);
+	}
+
+/*----------------------------------------------------------------------------
+** Restore output. The reader fills slots in order and each target's writers
+** put every slot at its offset on that target. A slot is a pool buffer the
+** reader hands to every target by reference; it's free again once all the
+** targets have dropped theirs. A target that fails keeps taking slots
+** without writing them, so it doesn't hold up the others.
+*/
+#define RESTORE_WRITERS   4                // per restore, shared out among its targets
+#define RESTORE_SLOTS     (2*RESTORE_WRITERS)
+#define RESTORE_EXTENT    IOBUFSIZE        // most bytes handed to one pwrite
+#define RESTORE_ALIGN     IOALIGN
+
+typedef struct
+	{
+	ioBuf         *io;
+	unsigned char *buf;                    // io's data
+	off64_t        offset;
+	size_t         length;
+	} restoreSlot;
+
+typedef struct
+	{
+	int             targets;
+	char           *target[RESTORE_TEE];
+	restoreJob     *job[RESTORE_TEE];      // NULL when restoring in turn
+	int             fd[RESTORE_TEE];
+	int             error[RESTORE_TEE];    // set once the target failed
+	unsigned long   taken[RESTORE_TEE];    // slots the target's writers have taken
+	int             live;                  // targets that haven't failed
+	restoreSlot     slot[RESTORE_SLOTS];
+	int             slots;                 // as many as the pool spares
+	unsigned long   queued;                // slots the reader has filled
+	pthread_t       tid[RESTORE_WRITERS + RESTORE_TEE];
+	int             writers;
+	int             started;               // writers take a target each in turn
+	bool            done;
+	pthread_mutex_t lock;
+	pthread_cond_t  cond;
+	} restoreOutput;                       // one per restore; parallel restore jobs each have their own
+
+/*----------------------------------------------------------------------------
+** The targets of a restore: the device, then any jobs teed to its job.
+*/
+static int restoreTargets(
+		char        *device,
+		restoreJob  *job,
+		char       **O_target,
+		restoreJob **O_job
+		)
+	{
+	int count;
+
+	O_target[0] = device;
+	O_job[0] = job;
+	for(count = 1; job != NULL && job->tee; count++)
 		{
-		debug(ABORT, 0,"Direct write error to %s",device);
-		return true;
+		job = &restoreJobs.job[job->tee];
+		O_target[count] = job->target;
+		O_job[count] = job;
 		}
 
-	progressBar(arch->expectedOriginalBytes,PROGRESS_RED,PROGRESS_INIT);
-  n = readBlock(fd,arch->expectedOriginalBytes,arch,true);
-	if(n)
+	return(count);
+	}
+
+/*----------------------------------------------------------------------------
+**
+*/
+static void *restoreWriter(void *I__arg)
+	{
+	restoreOutput *out = I__arg;
+	restoreSlot   *slot;
+	size_t         done;
+	ssize_t        n = 0;
+	int            t, fd;
+
+	pthread_mutex_lock(&out->lock);
+	t = out->started++ % out->targets;
+	while(1)
 		{
-		close(fd);
-		if(n != -2)
-			debug(ABORT, 1,"Direct write issue"); // not cancelled
+		while(!out->done && out->taken[t] == out->queued)
+			pthread_cond_wait(&out->cond, &out->lock);
 
-		return true;
+		if(out->taken[t] == out->queued)
+			break; // done and drained
+
+		slot = &out->slot[out->taken[t]++ % out->slots];
+		fd = out->error[t] ? -1 : out->fd[t];
+		pthread_mutex_unlock(&out->lock);
+
+		for(done = 0; fd != -1 && done < slot->length; done += n)
+			{
+			if((n = pwrite64(fd, slot->buf + done, slot->length - done, slot->offset + done)) <= 0)
+				break;
+			}
+
+		if(fd != -1 && done == slot->length)
+			{
+			sync_file_range(fd, slot->offset, slot->length, SYNC_FILE_RANGE_WRITE); // start its writeback now
+			pageBehind(fd, slot->offset, slot->length, true);
+			}
+
+		pthread_mutex_lock(&out->lock);
+		if(fd != -1 && done != slot->length && !out->error[t])
+			{
+			out->error[t] = (n < 0) ? errno : EIO;
+			out->live--;
+			}
+
+		poolPut(slot->io);
 		}
 
-	progressBar(arch->originalBytes,arch->originalBytes,PROGRESS_SYNC);
-	startTimer(2);
-	fsync(fd);
-	stopTimer();
-  close(fd);
-	progressBar(0,arch->originalBytes,PROGRESS_OK);
+	pthread_mutex_unlock(&out->lock);
 
-	return false;
-  }
+	return(NULL);
+	}
 
 /*----------------------------------------------------------------------------
-**
+** Open the targets and start their writers; a target smaller than I__size
+** is refused. Returns the number of targets opened.
 */
-static bool pcloneRestore(
-		char          *device,
-		int            major,
-		int            minor,
-		unsigned char  type,
-		archive       *arch
+static int outputStart(
+		restoreOutput      *out,
+		char               *device,
+		restoreJob         *job,
+		int                 I__flags,
+		unsigned long long  I__size
 		)
 	{
-	bool					rCode = false;
-  unsigned char buf[4096];
-  int           n,i, offset;
-  int           mypipe[2];
-  pid_t         pid;
-	int           status;
+	unsigned long long size;
+	int                i, t;
 
-	int   argc = 6;
-  char *argv[6] =
+	memset(out, 0, sizeof(restoreOutput));
+	out->targets = restoreTargets(device, job, out->target, out->job);
+	for(t = 0; t < out->targets; t++)
 		{
-		"pclone", 			// argv[0] Program {path +} name.
-		"-r", 					// -r or --restore "Restore partition from the special image format."
-		"-s", 					// -s or --source "Source FILE. The FILE could be a image file(made by partclone) or device depend on your action. Normanly, backup source is device, restore source is image file."
-		"-",            // "Receving data from pipe line is supported ONLY for restoring, just ignore -s option or use '-' means receive data from stdin."
-		"-o",           // -o or --output "Output FILE. The FILE could be a image file(partclone will generate) or device depend on your action. Normanly, backup output to image file and restore output to device."
-		device          // See argv[5] assignment below. "Sending data to pipe line is also supported ONLY for back-up, just ignore -o option or use '-' means send data to stdout."
-		};
-  argv[5] = device;
+		if((out->fd[t] = open(out->target[t], O_WRONLY | O_LARGEFILE | I__flags)) == -1)
+			{
+			out->error[t] = errno;
+			debug(job ? INFO : ABORT, 0,"Unable to open %s for restore", out->target[t]);
+			}
+		else if(I__size && !ioctl(out->fd[t], BLKGETSIZE64, &size) && size < I__size)
+			{
+			out->error[t] = ENOSPC;
+			close(out->fd[t]);
+			out->fd[t] = -1;
+			debug(job ? INFO : ABORT, 0,"Target is smaller than the image's %s", out->target[t]);
+			}
+		else
+			out->live++;
+		}
 
-	if(readSpecificFile(arch,major,minor,1) != 1)
+	if(!out->live)
+		return(0);
+
+	for(out->slots = 0; out->slots < RESTORE_SLOTS; out->slots++)
+		{ // waits for the first; the others only if the pool has them to spare
+		if(NULL == (out->slot[out->slots].io = poolGet(!out->slots)))
+			break;
+
+		out->slot[out->slots].buf = out->slot[out->slots].io->data;
+		}
+
+	pthread_mutex_init(&out->lock, NULL);
+	pthread_cond_init(&out->cond, NULL);
+	for(i = 0; i < ((out->targets < RESTORE_WRITERS) ? RESTORE_WRITERS / out->targets : 1) * out->targets; i++)
 		{
-		debug(ABORT, 0,"Damaged archive");
-		rCode=true;
-		goto CLEANUP;
+		if(!pthread_create(&out->tid[out->writers], NULL, restoreWriter, out))
+			out->writers++;
 		}
 
-	if(pipe(mypipe))
-		debug(EXIT, 0,"Unable to create pipe\n");
+	if(out->writers < out->targets)
+		debug(EXIT, 0,"Unable to start restore writers\n");
+
+	return(out->live);
+	}
+
+/*----------------------------------------------------------------------------
+** The slot the reader fills next, once every target is past it.
+*/
+static restoreSlot *outputSlot(restoreOutput *out)
+	{
+	restoreSlot *slot = &out->slot[out->queued % out->slots];
+
+	poolIdle(slot->io);
+
+	return(slot);
+	}
+
+/*----------------------------------------------------------------------------
+** Hand the filled slot to the writers. Returns the targets still written.
+*/
+static int outputQueue(restoreOutput *out)
+	{
+	int live;
+
+	poolHold(out->slot[out->queued % out->slots].io, out->targets);
+	pthread_mutex_lock(&out->lock);
+	out->queued++;
+	live = out->live;
+	pthread_cond_broadcast(&out->cond);
+	pthread_mutex_unlock(&out->lock);
+
+	return(live);
+	}
 
-	errno = EXIT_SUCCESS;
-  pid = fork();
-	if((-1) == pid)
-		debug(EXIT, 0,"Unable to fork. [%d:%s]\n", errno, strerror(errno));
+/*----------------------------------------------------------------------------
+** Drain the writers and close the targets; when the restore completed they
+** are handed over to be synced in the background instead. Jobs whose target
+** failed are marked; returns the number of targets written.
+*/
+static int outputFinish(
+		restoreOutput *out,
+		bool           I__sync
+		)
+	{
+	int i, t, written = 0;
 
-	// child process
-	if(!pid)
+	if(out->writers)
 		{
-    close(mypipe[1]);
-    LIBPARTCLONE_MainEntry(0,mypipe[0],argc,argv); // type = 0 doesn't matter for restore
-    close(mypipe[0]);
-    _exit(0);
-    }
+		pthread_mutex_lock(&out->lock);
+		out->done = true;
+		pthread_cond_broadcast(&out->cond);
+		pthread_mutex_unlock(&out->lock);
+		for(i = 0; i < out->writers; i++)
+			pthread_join(out->tid[i], NULL);
+
+		pthread_mutex_destroy(&out->lock);
+		pthread_cond_destroy(&out->cond);
+		}
 
-  // parent process.
-	close(mypipe[0]);
-	progressBar(arch->expectedOriginalBytes,PROGRESS_RED,PROGRESS_INIT);
-	while((n = readFile(buf,4096,arch,1)) > 0)
+	for(t = 0; t < out->targets; t++)
 		{
-		offset = 0;
-		if(progressBar(arch->originalBytes,arch->originalBytes,PROGRESS_UPDATE))
-			{  // display bytes out
-			kill(pid,SIGKILL);
-			startTimer(1);
-			close(mypipe[1]);
-			wait(pid);
-			stopTimer();
-			feedbackComplete("*** CANCELLED ***");
-			rCode=true;
-			goto CLEANUP;
+		if(out->fd[t] != -1)
+			{
+			if(I__sync && !out->error[t])
+				syncLater(out->fd[t], out->target[t]);
+			else
+				close(out->fd[t]);
+
+			if(out->error[t])
+				debug(out->job[t] ? INFO : ABORT, 1,"Write error on %s [%i]", out->target[t], out->error[t]);
 			}
 
-		progressBar(arch->originalBytes,arch->originalBytes,PROGRESS_UPDATE | 1); // update global count
-		while(offset < n && ((i = write(mypipe[1],&buf[offset],n-offset)) >= 0))
+		if(!out->error[t])
+			written++;
+		else if(out->job[t])
+			out->job[t]->failed = true;
+		}
+
+	for(i = 0; i < out->slots; i++)
+		{
+		poolPut(out->slot[i].io);
+		out->slot[i].io = NULL;
+		out->slot[i].buf = NULL;
+		}
+
+	out->slots = 0;
+
+	return(written);
+	}
+
+/*----------------------------------------------------------------------------
+**
+*/
+static bool ddRestore(
+		char          *device,
+		int            major,
+		int            minor,
+		unsigned char  type,
+		archive       *arch,
+		restoreJob    *job
+		)
+	{
+	bool           rCode = true;
+	restoreOutput  out;
+	restoreSlot   *slot;
+	off64_t        offset = 0;
+	int            n;
+
+	if(readSpecificFile(arch,major,minor,1) != 1)
+		{
+		debug(job ? INFO : ABORT, 0,"Damaged archive");
+		return(true);
+		}
+
+	// --direct bypasses the page cache when every extent, down to the last, is whole pages
+	if(!outputStart(&out, device, job, ((options & OPT_DIRECT) && !(arch->expectedOriginalBytes % RESTORE_ALIGN)) ? O_DIRECT : 0, 0))
+		goto CLEANUP;
+
+	if(!job)
+		progressBar(arch->expectedOriginalBytes,PROGRESS_RED,PROGRESS_INIT);
+
+	do
+		{
+		slot = outputSlot(&out);
+		for(slot->length = 0; slot->length < RESTORE_EXTENT; slot->length += n)
 			{
-			offset += i;
+			if((n = readFile(&slot->buf[slot->length],(RESTORE_EXTENT - slot->length > SYSRES_PCLONE_BATCH_D) ? SYSRES_PCLONE_BATCH_D : RESTORE_EXTENT - slot->length,arch,1)) <= 0)
+				break;
 			}
 
-		if(offset != n)
+		if(slot->length)
 			{
-			debug(ABORT, 1,"Stream error.\n");
+			slot->offset = offset;
+			offset += slot->length;
+			if(!outputQueue(&out))
+				break; // every target failed
 			}
+
+		if(restoreProgress(arch,job))
+			goto CLEANUP; // cancelled
 		}
+	while(n > 0);
 
-	progressBar(arch->originalBytes, arch->originalBytes, PROGRESS_SYNC);
-	startTimer(2);
-	close(mypipe[1]);
-// wait(pid);
-	waitpid(pid,&status,0);
-	stopTimer();
-	if(status)
+	if(n || arch->originalBytes != arch->expectedOriginalBytes)
 		{
-		debug(ABORT, 1,"Non-zero exit code from pclone engine");
-		rCode=true;
+		debug(job ? INFO : ABORT, 1,"Direct write issue");
 		goto CLEANUP;
 		}
 
-	progressBar(0,arch->originalBytes,PROGRESS_OK);
-	progressBar(arch->originalBytes,arch->originalBytes,PROGRESS_OK | 1); // update global count
+	rCode = !outputFinish(&out, true);
+	if(!job && !rCode)
+		progressBar(0,arch->originalBytes,PROGRESS_OK);
+
+	return(rCode);
 
 CLEANUP:
 
+	outputFinish(&out, false);
+
 	return(rCode);
   }
 
+/*----------------------------------------------------------------------------
+** Parallel restore of partclone images. sysres parses the stream itself:
+** descriptor, bitmap, then the used blocks in order, which several writers
+** put at their offsets on the target instead of one partclone thread writing
+** them in turn. The bitmap is kept as a block map (sysres_blockmap.c), so a
+** large volume's is never held flat. Block checksums between the spans of
+** blocks are taken out of the stream: CRC32C ones (sysres backups) are
+** checked, partclone's own CRC32 ones are skipped, since the archive's SHA1
+** already covers them and CRC32 in software would hold the reader to a few
+** hundred MB/s. The layout is only trusted when the archive's size for the
+** file agrees with the descriptor; anything else (other image versions or
+** checksum modes, stream archives whose size isn't known up front) is handed
+** to partclone along with the descriptor. A bitmap whose population then
+** disagrees with the descriptor is a damaged archive.
+*/
+#define PCLONE_DESC_SIZE  110              // image_desc_v2: head, fs_info, options, crc
+
+typedef struct
+	{
+	unsigned long long span;               // block bytes per checksum, 0 without
+	unsigned long long spanBytes;
+	unsigned int       crc;
+	bool               verify;             // CRC32C
+	bool               reseed;
+	} pcloneSums;
+
 /*----------------------------------------------------------------------------
 **
 */
-static int validateNewTable(disk *d)
+static int pcloneReadFull(
+		unsigned char *buf,
+		unsigned long  size,
+		archive       *arch
+		)
 	{
-	char path[256];
-	sprintf(path,"/sys/block/%s",&d->deviceName[5]);
-	// d->deviceLength, d->deviceName, d->diskname, d->sectorSize
-	// d->map, d->auxParts => leave alone
-	d->partCount = 0;
-	d->state = 0;
-	d->diskLabel = "";
-	d->diskType = DISK_MSDOS;
+	unsigned long done = 0;
+	int           n;
+
+	while(done < size)
+		{
+		n = readFile(&buf[done], (size - done > SYSRES_PCLONE_BATCH_D) ? SYSRES_PCLONE_BATCH_D : size - done, arch, 1);
+		if(n <= 0)
+			return(-1);
+
+		done += n;
+		}
+
+	return(0);
+	}
+
+/*----------------------------------------------------------------------------
+** The checksum that ends a span; -1 when it can't be read or doesn't match.
+*/
+static int pcloneSumCheck(
+		pcloneSums *sums,
+		archive    *arch
+		)
+	{
+	unsigned int sum;
+
+	if(pcloneReadFull((unsigned char *)&sum, SYSRES_PCLONE_CRC_D, arch) || (sums->verify && sum != sums->crc))
+		return(-1);
+
+	sums->spanBytes = 0;
+	if(sums->reseed)
+		sums->crc = 0xFFFFFFFF;
+
+	return(0);
+	}
+
+/*----------------------------------------------------------------------------
+** The next size bytes of blocks, checksums taken out.
+*/
+static int pcloneReadBlocks(
+		unsigned char *buf,
+		unsigned long  size,
+		archive       *arch,
+		pcloneSums    *sums
+		)
+	{
+	unsigned long done, n;
+
+	for(done = 0; done < size; done += n)
+		{
+		n = size - done;
+		if(sums->span && n > sums->span - sums->spanBytes)
+			n = sums->span - sums->spanBytes;
+
+		if(pcloneReadFull(&buf[done], n, arch))
+			return(-1);
+
+		if(sums->verify)
+			sums->crc = SYSRES_PCLONE_Crc32c(sums->crc, &buf[done], n);
+
+		if(sums->span && (sums->spanBytes += n) == sums->span && pcloneSumCheck(sums, arch))
+			return(-1);
+		}
+
+	return(0);
+	}
+
+/*----------------------------------------------------------------------------
+** Returns 0 when restored, 1 on failure or cancel, 2 when partclone has to do
+** it; *O_prefix then holds the bytes already taken from the archive.
+*/
+static int pcloneParallelRestore(
+		char           *device,
+		archive        *arch,
+		unsigned char **O_prefix,
+		unsigned long  *O_prefixLen,
+		restoreJob     *job
+		)
+	{
+	int                rCode = 2, n;
+	unsigned char      head[PCLONE_DESC_SIZE];
+	unsigned char      bits[SYSRES_BLOCKMAP_BYTES_D];
+	unsigned long long totalBlocks, usedBlocks, deviceSize, block, end, size;
+	unsigned long      bitmapBytes, tailBytes, chunk;
+	unsigned int       blockSize, spanBlocks, crc;
+	unsigned short     magic, mode, sumSize;
+	restoreSlot       *slot;
+	restoreOutput      out;
+	pcloneSums         sums = { 0 };
+	SYSRES_BLOCKMAP_T  map = { 0 };
+
+	out.targets = out.writers = 0;
+	if(pcloneReadFull(head, PCLONE_DESC_SIZE, arch))
+		{
+		rCode = 1;
+		debug(job ? INFO : ABORT, 0,"Damaged archive");
+		goto CLEANUP;
+		}
+
+	*O_prefixLen = PCLONE_DESC_SIZE;
+	*O_prefix = malloc(PCLONE_DESC_SIZE);
+	memcpy(*O_prefix, head, PCLONE_DESC_SIZE);
+	memcpy(&magic, &head[34], 2);
+	memcpy(&crc, &head[106], 4);
+	if(memcmp(head, "partclone-image", 15) || memcmp(&head[30], "0002", 4) || magic != 0xC0DE || arch->stream || !arch->expectedOriginalBytes
+		|| crc != SYSRES_PCLONE_Crc32(0xFFFFFFFF, head, 106))
+		goto CLEANUP;
+
+	memcpy(&deviceSize, &head[52], 8);
+	memcpy(&totalBlocks, &head[60], 8);
+	memcpy(&usedBlocks, &head[68], 8);
+	memcpy(&blockSize, &head[84], 4);
+	memcpy(&mode, &head[96], 2);
+	memcpy(&sumSize, &head[98], 2);
+	memcpy(&spanBlocks, &head[100], 4);
+	bitmapBytes = (totalBlocks + 7) / 8;
+	if(!blockSize || blockSize % 512 || usedBlocks > totalBlocks || head[105] != SYSRES_PCLONE_BM_BIT_D)
+		goto CLEANUP;
+
+	size = PCLONE_DESC_SIZE + bitmapBytes + usedBlocks * blockSize;
+	if(mode == SYSRES_PCLONE_CSM_NONE_D)
+		{ // whatever follows the bitmap before the first block: its crc, if any
+		tailBytes = arch->expectedOriginalBytes - size;
+		if(arch->expectedOriginalBytes < size || (tailBytes != 0 && tailBytes != SYSRES_PCLONE_CRC_D))
+			goto CLEANUP;
+		}
+	else if((mode == SYSRES_PCLONE_CSM_CRC32_D || mode == SYSRES_PCLONE_CSM_CRC32C_D) && sumSize == SYSRES_PCLONE_CRC_D && spanBlocks)
+		{
+		tailBytes = SYSRES_PCLONE_CRC_D;
+		if(arch->expectedOriginalBytes != size + tailBytes + (usedBlocks + spanBlocks - 1) / spanBlocks * SYSRES_PCLONE_CRC_D)
+			goto CLEANUP;
+
+		sums.span   = (unsigned long long)spanBlocks * blockSize;
+		sums.crc    = 0xFFFFFFFF;
+		sums.verify = (mode == SYSRES_PCLONE_CSM_CRC32C_D);
+		sums.reseed = head[104];
+		}
+	else
+		goto CLEANUP; // a checksum mode we don't know
+
+	// from here on the stream is ours; the bitmap goes into a block map a container at a time
+	rCode = 1;
+	if(SYSRES_BLOCKMAP_Init(&map, totalBlocks))
+		debug(EXIT, 0,"Unable to allocate partclone bitmap\n");
+
+	for(chunk = 0; chunk < map.chunks; chunk++)
+		{
+		if(pcloneReadFull(bits, (chunk + 1 < map.chunks) ? SYSRES_BLOCKMAP_BYTES_D : bitmapBytes - chunk * SYSRES_BLOCKMAP_BYTES_D, arch))
+			{
+			debug(job ? INFO : ABORT, 0,"Damaged archive");
+			goto CLEANUP;
+			}
+
+		if(SYSRES_BLOCKMAP_Load(&map, chunk, bits))
+			debug(EXIT, 0,"Unable to allocate partclone bitmap\n");
+		}
+
+	if((tailBytes && pcloneReadFull(bits, tailBytes, arch)) || map.used != usedBlocks)
+		{
+		debug(job ? INFO : ABORT, 0,"Damaged archive");
+		goto CLEANUP;
+		}
+
+	if(!outputStart(&out, device, job, ((options & OPT_DIRECT) && !(blockSize % RESTORE_ALIGN)) ? O_DIRECT : 0, deviceSize))
+		goto CLEANUP;
+
+	debug(INFO, 2,"Parallel restore: %llu of %llu blocks, %i targets, %i writers\n", usedBlocks, totalBlocks, out.targets, out.writers);
+	for(block = 0; SYSRES_BLOCKMAP_Next(&map, &block, &end); block = end)
+		{
+		if((end - block) * blockSize > RESTORE_EXTENT)
+			end = block + RESTORE_EXTENT / blockSize;
+
+		slot = outputSlot(&out);
+		slot->offset = block * blockSize;
+		slot->length = (end - block) * blockSize;
+		if(pcloneReadBlocks(slot->buf, slot->length, arch, &sums))
+			{
+			debug(job ? INFO : ABORT, 0,"Damaged archive");
+			goto STOP;
+			}
+
+		if(!outputQueue(&out))
+			goto STOP; // every target failed
+
+		if(restoreProgress(arch, job))
+			goto STOP; // cancelled
+		}
+
+	if(sums.spanBytes && pcloneSumCheck(&sums, arch))
+		{ // the last blocks' checksum, when they didn't fill a span
+		debug(job ? INFO : ABORT, 0,"Damaged archive");
+		goto STOP;
+		}
+
+	while((n = readFile(head, sizeof(head), arch, 1)) > 0)
+		; // take the archive to the end of this file
+
+	if(n)
+		{
+		debug(job ? INFO : ABORT, 0,"Damaged archive"); // the file's sha1sum didn't match
+		goto STOP;
+		}
+
+	rCode = 0;
+
+STOP:
+
+	if(rCode)
+		outputFinish(&out, false);
+	else
+		{
+		if(!outputFinish(&out, true))
+			rCode = 1;
+
+		if(!job && !rCode)
+			{
+			progressBar(0,arch->originalBytes,PROGRESS_OK);
+			progressBar(arch->originalBytes,arch->originalBytes,PROGRESS_OK | 1); // update global count
+			}
+		}
+
+CLEANUP:
+
+	if(out.targets && !out.writers)
+		outputFinish(&out, false); // none of the targets opened
+
+	SYSRES_BLOCKMAP_Free(&map);
+
+	return(rCode);
+	}
+
+/*----------------------------------------------------------------------------
+** Write the same bytes to each partclone engine still running. With --tee,
+** an engine that stops taking them is dropped and the others go on.
+** Returns the engines left.
+*/
+static int pcloneFeed(
+		unsigned char          *I__buf,
+		int                     I__len,
+		int                    *fd,
+		SYSRES_PCLONE_ENGINE_T *engine,
+		restoreJob            **member,
+		int                     targets
+		)
+	{
+	int t, i, offset, live = 0;
+
+	for(t = 0; t < targets; t++)
+		{
+		if(fd[t] == -1)
+			continue;
+
+		offset = 0;
+		while(offset < I__len && ((i = write(fd[t],&I__buf[offset],I__len-offset)) >= 0))
+			{
+			offset += i;
+			}
+
+		if(offset != I__len)
+			{
+			debug(member[0] ? INFO : ABORT, 1,"Stream error.\n");
+			if(targets > 1)
+				{
+				close(fd[t]);
+				SYSRES_PCLONE_Finish(&engine[t], true);
+				fd[t] = -1;
+				member[t]->failed = true;
+				continue;
+				}
+			}
+
+		live++;
+		}
+
+	return(live);
+	}
+
+/*----------------------------------------------------------------------------
+** Partclone restores what the parallel restore can't; with --tee, one engine
+** per target is fed the same stream.
+*/
+static bool pcloneRestore(
+		char          *device,
+		int            major,
+		int            minor,
+		unsigned char  type,
+		archive       *arch,
+		restoreJob    *job
+		)
+	{
+	bool					rCode = false;
+  unsigned char *buf;
+  ioBuf         *io = NULL;
+  unsigned char *prefix = NULL;
+  unsigned long  prefixLen = 0;
+  int           n = 0, t;
+	int           fd[RESTORE_TEE];
+	int           targets, live;
+	char         *target[RESTORE_TEE];
+	restoreJob   *member[RESTORE_TEE];
+	SYSRES_PCLONE_ENGINE_T engine[RESTORE_TEE];
+	SYSRES_PCLONE_STRIP_T  strip;
+	bool                   stripping = false;
+
+	int   argc = 6;
+  char *argv[6] =
+		{
+		"pclone", 			// argv[0] Program {path +} name.
+		"-r", 					// -r or --restore "Restore partition from the special image format."
+		"-s", 					// -s or --source "Source FILE. The FILE could be a image file(made by partclone) or device depend on your action. Normanly, backup source is device, restore source is image file."
+		"-",            // "Receving data from pipe line is supported ONLY for restoring, just ignore -s option or use '-' means receive data from stdin."
+		"-o",           // -o or --output "Output FILE. The FILE could be a image file(partclone will generate) or device depend on your action. Normanly, backup output to image file and restore output to device."
+		device          // See argv[5] assignment below. "Sending data to pipe line is also supported ONLY for back-up, just ignore -o option or use '-' means send data to stdout."
+		};
+
+	if(readSpecificFile(arch,major,minor,1) != 1)
+		{
+		debug(job ? INFO : ABORT, 0,"Damaged archive");
+		rCode=true;
+		goto CLEANUP;
+		}
+
+	if(!job)
+		progressBar(arch->expectedOriginalBytes,PROGRESS_RED,PROGRESS_INIT);
+
+	switch(pcloneParallelRestore(device, arch, &prefix, &prefixLen, job))
+		{
+		case 0:
+			goto CLEANUP;
+
+		case 1:
+			rCode=true;
+			goto CLEANUP;
+		}
+
+	buf = (io = poolGet(true))->data;
+
+	// CRC32C block checksums are checked here, partclone gets the blocks without them
+	if(prefixLen >= SYSRES_PCLONE_DESC_D)
+		stripping = SYSRES_PCLONE_StripStart(prefix, &strip);
+
+	// type = 0 doesn't matter for restore; a job can't share the in-process engine
+	live = targets = restoreTargets(device, job, target, member);
+	for(t = 0; t < targets; t++)
+		{
+		argv[5] = target[t];
+		if((errno = job ? SYSRES_PCLONE_Spawn(argc, argv, &engine[t], &fd[t]) : SYSRES_PCLONE_Start(argc, argv, &engine[t], &fd[t])))
+			debug(EXIT, 0,"Unable to start pclone engine. [%d:%s]\n", errno, strerror(errno));
+		}
+
+	// partclone gets the head of the image that was read to qualify it
+	live = pcloneFeed(prefix, prefixLen, fd, engine, member, targets);
+	while(live && (n = readFile(buf,SYSRES_PCLONE_BATCH_D,arch,1)) > 0)
+		{
+		if(restoreProgress(arch, job))
+			{  // display bytes out
+			if(!job)
+				startTimer(1);
+
+			for(t = 0; t < targets; t++)
+				{
+				if(fd[t] != -1)
+					{
+					close(fd[t]);
+					SYSRES_PCLONE_Finish(&engine[t], true);
+					}
+				}
+
+			if(!job)
+				stopTimer();
+
+			rCode=true;
+			goto CLEANUP;
+			}
+
+		if(stripping && (n = SYSRES_PCLONE_Strip(&strip, buf, n)) < 0)
+			break;
+
+		live = pcloneFeed(buf, n, fd, engine, member, targets);
+		}
+
+	if(live && n < 0)
+		{ // the file's sha1sum or a block checksum didn't match, or it couldn't be read
+		debug(job ? INFO : ABORT, 0,"Damaged archive");
+		for(t = 0; t < targets; t++)
+			{
+			if(fd[t] != -1)
+				{
+				close(fd[t]);
+				SYSRES_PCLONE_Finish(&engine[t], true);
+				}
+			}
+
+		rCode=true;
+		goto CLEANUP;
+		}
+
+	if(!job)
+		{
+		progressBar(arch->originalBytes, arch->originalBytes, PROGRESS_SYNC);
+		startTimer(2);
+		}
+
+	for(t = 0; t < targets; t++)
+		{
+		if(fd[t] == -1)
+			continue;
+
+		close(fd[t]);
+		if(SYSRES_PCLONE_Finish(&engine[t], false))
+			{
+			debug(job ? INFO : ABORT, 1,"Non-zero exit code from pclone engine");
+			if(member[t])
+				member[t]->failed = true;
+
+			live--;
+			}
+		}
+
+	if(!job)
+		stopTimer();
+
+	if(!live)
+		{
+		rCode=true;
+		goto CLEANUP;
+		}
+
+	if(!job)
+		{
+		progressBar(0,arch->originalBytes,PROGRESS_OK);
+		progressBar(arch->originalBytes,arch->originalBytes,PROGRESS_OK | 1); // update global count
+		}
+
+CLEANUP:
+
+	if(io)
+		poolPut(io);
+
+	if(prefix)
+		free(prefix);
+
+	return(rCode);
+  }
+
+/*----------------------------------------------------------------------------
+**
+*/
+static int validateNewTable(disk *d)
+	{
+	char path[256];
+	sprintf(path,"/sys/block/%s",&d->deviceName[5]);
+	// d->deviceLength, d->deviceName, d->diskname, d->sectorSize
+	// d->map, d->auxParts => leave alone
+	d->partCount = 0;
+	d->state = 0;
+	d->diskLabel = "";
+	d->diskType = DISK_MSDOS;
+
+	if(scanSingleDrive(path,&d->deviceName[5],d))
+		return 1;
+
+	if(!readFromDisk(d,0,0,NULL,0))
+		checkIfLoop(d);
+
+	if(syncTable(d))
+		return 1;
+
+	if(hasMountMismatch(NULL,d))
+		return 1;
+
+	return 0;
+	}
+
+/*----------------------------------------------------------------------------
+** Forget the catalog.
+*/
+static void catalogDrop(void)
+	{
+	free(restoreCatalog.entry);
+	restoreCatalog.entry = NULL;
+	restoreCatalog.count = 0;
+	}
+
+/*----------------------------------------------------------------------------
+** Catalog the archive: one walk over its file headers, seeking past the
+** data. Streams can't be walked ahead of the restore and have no catalog.
+*/
+static void catalogRead(archive *arch)
+	{
+	archive  cat;
+	char    *name;
+	int      n;
+
+	catalogDrop();
+	if(arch->stream || NULL == (name = malloc(strlen(globalPath) + 16)))
+		return;
+
+	strcpy(name, globalPath); // segment names are built in place
+	if(readImageArchive(name, &cat) == 1)
+		{
+		while((n = readNextFile(&cat, 0)) == 1)
+			{
+			if(NULL == (restoreCatalog.entry = realloc(restoreCatalog.entry, (restoreCatalog.count + 1) * sizeof(restoreEntry))))
+				debug(EXIT, 0,"Unable to allocate archive catalog\n");
+
+			restoreCatalog.entry[restoreCatalog.count].major = cat.major;
+			restoreCatalog.entry[restoreCatalog.count].minor = cat.minor;
+			restoreCatalog.entry[restoreCatalog.count++].originalBytes = cat.expectedOriginalBytes;
+			}
+
+		if(n == -1)
+			catalogDrop(); // damaged; the restore will say so
+
+		if(cat.currentFD != -1)
+			closeArchive(&cat);
+		}
+
+	free(name);
+	debug(INFO, 2,"Archive catalog: %i files\n", restoreCatalog.count);
+	}
+
+/*----------------------------------------------------------------------------
+** Position of a file in the catalog, -1 when it isn't there.
+*/
+static int catalogFind(
+		int major,
+		int minor
+		)
+	{
+	int i;
+
+	for(i = 0; i < restoreCatalog.count; i++)
+		{
+		if(restoreCatalog.entry[i].major == major && restoreCatalog.entry[i].minor == minor)
+			return(i);
+		}
+
+	return(-1);
+	}
+
+/*----------------------------------------------------------------------------
+** Wait for the restored targets still being synced in the background; the
+** table can't be reloaded, nor the restore finished, before they're on disk.
+** Returns true when one of them failed.
+*/
+static bool restoreFlush(void)
+	{
+	int failed;
+
+	debug(INFO, 3,"Waiting for restored targets to sync\n");
+	startTimer(2);
+	failed = syncTargets();
+	stopTimer();
+	if(failed)
+		debug(ABORT, 1,"Unable to sync %i restored target%s", failed, (failed > 1) ? "s" : "");
+
+	return(failed != 0);
+	}
+
+/*----------------------------------------------------------------------------
+** Restore one file of the archive now.
+*/
+static bool restoreNow(
+		char *device,
+		char *label,
+		int major,
+		int minor,
+		char *target,
+		int state,
+		int type,
+		archive *arch
+		)
+	{
+	if(major == loopDrive + 1)
+		major = 0;
+
+	setProgress(PROGRESS_RESTORE,device,target,major,minor,type,label,0,state,arch);
+// sprintf(&globalBuf[30],"%-4s => %-4s %6s %-5s %-16s",device,&target[5],getEngine(type & TYPE_MASK,state),(type & DISK_MASK)?"disk":types[type & TYPE_MASK],(label != NULL && *label)?label:"");
+	if(testMode)
+		{
+		if(!ui_mode)
+			printf("%s\n",&globalBuf[40]);
+
+		return false;
+		}
+
+	if(type & DISK_TABLE)
+		{ // gpt or msdos
+		if((state & BUFFERED) == BUFFERED)
+			{
+			arch->state |= BUFFERED;
+			arch->fileBytes = 0;
+			}
+    else if(readSpecificFile(arch, major, minor,1) != 1)
+			{
+			// debug(EXIT, 0,"Damaged archive");  // test for fatal error
+			debug(ABORT, 0,"Damaged archive");
+			return true;
+			}
+
+    if(!readFromDisk(target,0,0,arch,0))
+			{
+			debug(ABORT, 0,"Restore write error");
+			return true;
+			}
+
+		if(((state & BUFFERED) != BUFFERED) && writeExtraBlocks(target,arch))
+			return true;
+
+		return false;
+		}
+  switch(state & ST_BLOCK)
+		{
+		// case ST_IMG: printf("Engine is Image.\n"); break;
+
+		case ST_CLONE:
+			return pcloneRestore(target, major, minor, type & TYPE_MASK, arch, NULL);
+			break;
+
+		case ST_FULL:
+			return ddRestore(target, major, minor, type & TYPE_MASK, arch, NULL);
+			break;
+
+		// case ST_FILE: printf("Engine is fsarchiver.\n"); break;
+
+		case ST_SWAP:
+			if(readSpecificFile(arch,major,minor,1) != 1)
+				{
+				debug(ABORT, 0,"Damaged archive");
+				return true;
+				}
+
+			return restoreSwap(target,arch);
+			break;
+
+		default:
+			if(!ui_mode)
+			printf("No known engine.\n");
+			break;
+    }
+
+	// type determine the engine, as well
+	return false;
+	}
+
+/*----------------------------------------------------------------------------
+** Forget the queue and go back to restoring in turn.
+*/
+static void restoreDrop(void)
+	{
+	free(restoreJobs.job);
+	restoreJobs.job = NULL;
+	restoreJobs.count = 0;
+	restoreJobs.planning = false;
+	}
+
+/*----------------------------------------------------------------------------
+** Whether the calling thread restores a job as it walks the archive; with
+** workers it only does the tables and swap, which are small and come first.
+*/
+static bool restoreSerial(restoreJob *job)
+	{
+	return(!restoreJobs.workers || (job->type & DISK_TABLE) || (job->state & ST_BLOCK) == ST_SWAP);
+	}
+
+/*----------------------------------------------------------------------------
+** Queue a file for the disk restoreDisk() is on. With --tee a partition
+** follows the first job restoring the same archive file to another disk.
+*/
+static bool restoreQueue(
+		char *device,
+		char *label,
+		int   major,
+		int   minor,
+		char *target,
+		int   state,
+		int   type
+		)
+	{
+	restoreJob *job;
+	int         i, lead = -1, count;
+
+	for(i = 0; (options & OPT_TEE) && restoreJobs.workers && !(type & DISK_TABLE) && lead == -1 && i < restoreJobs.count; i++)
+		{
+		job = &restoreJobs.job[i];
+		if(job->follower || restoreSerial(job) || job->major != major || job->minor != minor || job->state != state)
+			continue;
+
+		for(count = 1; job->d != restoreJobs.d && job->tee; count++)
+			job = &restoreJobs.job[job->tee];
+
+		if(job->d != restoreJobs.d && count < RESTORE_TEE)
+			lead = i;
+		}
+
+	if(NULL == (restoreJobs.job = realloc(restoreJobs.job, (restoreJobs.count + 1) * sizeof(restoreJob))))
+		debug(EXIT, 0,"Unable to allocate restore jobs\n");
+
+	job = &restoreJobs.job[restoreJobs.count++];
+	memset(job, 0, sizeof(restoreJob));
+	job->source = device;
+	job->label  = label;
+	job->target = target;
+	job->major  = major;
+	job->minor  = minor;
+	job->state  = state;
+	job->type   = type;
+	job->d      = restoreJobs.d;
+	if((job->order = catalogFind(major, minor)) == -1)
+		job->order = restoreCatalog.count + restoreJobs.count; // not catalogued: queue order, after the rest
+
+	if(lead != -1)
+		{
+		for(i = lead; restoreJobs.job[i].tee; i = restoreJobs.job[i].tee)
+			;
+
+		restoreJobs.job[i].tee = restoreJobs.count - 1;
+		job->follower = true;
+		}
+
+	debug(INFO, 5,"Queued %i:%i for %s%s\n", major, minor, target, job->follower ? " (tee)" : "");
+
+	return(false);
+	}
+
+/*----------------------------------------------------------------------------
+** A disk's partitions wait for its table.
+*/
+static bool restoreReady(restoreJob *job)
+	{
+	int i;
+
+	for(i = 0; i < restoreJobs.count && &restoreJobs.job[i] != job; i++)
+		{
+		if(restoreJobs.job[i].d == job->d && (restoreJobs.job[i].type & DISK_TABLE) && restoreJobs.job[i].status == RESTORE_JOB_WAIT)
+			return(false);
+		}
+
+	return(true);
+	}
+
+/*----------------------------------------------------------------------------
+** Walk the archive once from where the reader is and restore the calling
+** thread's jobs as their files come by. Whatever the walk can't take (one
+** file for several targets, a partition ahead of its table) is restored
+** afterwards, looking its file up again. Returns true on failure or cancel.
+*/
+static bool restoreOrdered(archive *arch)
+	{
+	int         i, n, pending = 0;
+	restoreJob *job;
+
+	for(i = 0; i < restoreJobs.count; i++)
+		{
+		if(restoreSerial(&restoreJobs.job[i]))
+			pending++;
+		}
+
+	if(pending && arch->currentFD == -1 && readImageArchive(arch->archiveName, arch) != 1)
+		{
+		debug(ABORT, 0,"Invalid archive");
+		return(true);
+		}
+
+	while(pending && (n = readNextFile(arch,1)) == 1)
+		{
+		for(i = 0, job = NULL; i < restoreJobs.count && job == NULL; i++)
+			{
+			job = &restoreJobs.job[i];
+			if(job->status != RESTORE_JOB_WAIT || !restoreSerial(job) || job->major != arch->major || job->minor != arch->minor || !restoreReady(job))
+				job = NULL;
+			}
+
+		if(job == NULL)
+			continue; // not restored; the next header is read past it
+
+		pending--;
+		job->status = RESTORE_JOB_RUN;
+		if(restoreNow(job->source,job->label,job->major,job->minor,job->target,job->state,job->type,arch))
+			return(true);
+
+		job->status = RESTORE_JOB_DONE;
+		}
+
+	for(i = 0; pending && i < restoreJobs.count; i++)
+		{
+		job = &restoreJobs.job[i];
+		if(job->status != RESTORE_JOB_WAIT || !restoreSerial(job))
+			continue;
+
+		pending--;
+		debug(INFO, 2,"Restoring %i:%i out of archive order\n", job->major, job->minor);
+		if(restoreNow(job->source,job->label,job->major,job->minor,job->target,job->state,job->type,arch))
+			return(true);
+
+		job->status = RESTORE_JOB_DONE;
+		}
+
+	return(false);
+	}
+
+/*----------------------------------------------------------------------------
+** Restores the partitions of the next disk nobody has taken, in archive
+** order, through its own reader of the archive, along with the jobs
+** following them.
+*/
+static void *restoreWorker(void *I__arg)
+	{
+	archive     arch;
+	char       *name;
+	disk       *d;
+	restoreJob *job, *tee;
+	int         i;
+	bool        failed;
+
+	if(NULL == (name = malloc(strlen(globalPath) + 16)))
+		return(NULL);
+
+	strcpy(name, globalPath); // segment names are built in place
+	while(1)
+		{
+		pthread_mutex_lock(&restoreJobs.lock);
+		for(i = 0, d = NULL; i < restoreJobs.count && !restoreJobs.stop; i++)
+			{
+			if(restoreJobs.job[i].status == RESTORE_JOB_WAIT)
+				{
+				d = restoreJobs.job[i].d;
+				break;
+				}
+			}
+
+		for(i = 0; d != NULL && i < restoreJobs.count; i++)
+			{
+			if(restoreJobs.job[i].d != d || restoreJobs.job[i].follower || restoreJobs.job[i].status != RESTORE_JOB_WAIT)
+				continue;
+
+			for(job = &restoreJobs.job[i]; job != NULL; job = job->tee ? &restoreJobs.job[job->tee] : NULL)
+				job->status = RESTORE_JOB_RUN;
+			}
+
+		pthread_mutex_unlock(&restoreJobs.lock);
+		if(d == NULL)
+			break;
+
+		failed = (readImageArchive(name, &arch) != 1);
+		if(failed)
+			debug(INFO, 0,"Unable to read archive %s\n", name);
+
+		while(1)
+			{
+			// this thread alone moves the disk's jobs on from RUN
+			for(i = 0, job = NULL; i < restoreJobs.count; i++)
+				{
+				tee = &restoreJobs.job[i];
+				if(tee->d == d && !tee->follower && tee->status == RESTORE_JOB_RUN && (job == NULL || tee->order < job->order))
+					job = tee;
+				}
+
+			if(job == NULL)
+				break;
+
+			if(!failed)
+				{
+				if((job->state & ST_BLOCK) == ST_CLONE)
+					failed = pcloneRestore(job->target, job->major, job->minor, job->type & TYPE_MASK, &arch, job);
+				else
+					failed = ddRestore(job->target, job->major, job->minor, job->type & TYPE_MASK, &arch, job);
+				}
+
+			pthread_mutex_lock(&restoreJobs.lock);
+			for(tee = job; tee != NULL; tee = tee->tee ? &restoreJobs.job[tee->tee] : NULL)
+				tee->status = (failed || tee->failed) ? RESTORE_JOB_FAIL : RESTORE_JOB_DONE;
+
+			pthread_cond_broadcast(&restoreJobs.cond);
+			pthread_mutex_unlock(&restoreJobs.lock);
+			}
+
+		if(arch.currentFD != -1)
+			closeArchive(&arch);
+		}
+
+	free(name);
+
+	return(NULL);
+	}
+
+/*----------------------------------------------------------------------------
+** Restore the queue. The calling thread walks the archive for its jobs;
+** then workers, if any, write the partitions while this thread shows each
+** job until it's done. With --tee a failed target doesn't stop the others.
+** Returns true on failure or cancel.
+*/
+static bool restoreQueued(archive *arch)
+	{
+	bool           rCode = false;
+	pthread_t      tid[JOBSMAX];
+	int            i, threads = 0, disks = 0, failed = 0;
+	disk          *d = NULL;
+	unsigned long  total = 0, original;
+	char           status;
+	restoreJob    *job;
+	struct timespec ts;
+
+	restoreJobs.planning = false;
+	for(i = 0; i < restoreJobs.count; i++)
+		{
+		job = &restoreJobs.job[i];
+		if(job->order < restoreCatalog.count)
+			total += job->expected = restoreCatalog.entry[job->order].originalBytes;
+
+		if(!restoreSerial(job) && !job->follower && job->d != d)
+			{
+			d = job->d;
+			disks++; // disks with something of their own to read
+			}
+		}
+
+	if(restoreJobs.count > 1)
+		progressBar(total,CLR_YB,PROGRESS_INIT | 1);  // OTHER (global) progress bar
+	else
+		progressBar(0,0,PROGRESS_INIT | 1); // reset global total
+
+	if(restoreOrdered(arch))
+		{
+		restoreDrop();
+		return(true);
+		}
+
+	if(!disks)
+		{
+		restoreDrop();
+		return(restoreFlush());
+		}
+
+	restoreJobs.stop = false;
+	for(i = 0; i < diskJobs && i < disks; i++)
+		{
+		if(!pthread_create(&tid[threads], NULL, restoreWorker, NULL))
+			threads++;
+		}
+
+	if(!threads)
+		debug(EXIT, 0,"Unable to start restore jobs\n");
+
+	debug(INFO, 2,"Parallel restore: %i files on %i disks, %i threads\n", restoreJobs.count, disks, threads);
+	for(i = 0; i < restoreJobs.count && !rCode; i++)
+		{
+		job = &restoreJobs.job[i];
+		if(restoreSerial(job))
+			continue; // already restored
+
+		setProgress(PROGRESS_RESTORE,job->source,job->target,job->major,job->minor,job->type,job->label,0,job->state,NULL);
+		progressBar(job->expected,PROGRESS_RED,PROGRESS_INIT);
+		while(1)
+			{
+			pthread_mutex_lock(&restoreJobs.lock);
+			if(job->status == RESTORE_JOB_WAIT || job->status == RESTORE_JOB_RUN)
+				{
+				clock_gettime(CLOCK_REALTIME, &ts);
+				if((ts.tv_nsec += RESTORE_JOB_POLL * 1000000L) >= 1000000000L)
+					{
+					ts.tv_sec++;
+					ts.tv_nsec -= 1000000000L;
+					}
+
+				pthread_cond_timedwait(&restoreJobs.cond, &restoreJobs.lock, &ts);
+				}
+
+			original = job->originalBytes;
+			status = job->status;
+			pthread_mutex_unlock(&restoreJobs.lock);
+
+			if(status == RESTORE_JOB_FAIL && !has_interrupted && (options & OPT_TEE))
+				{
+				debug(INFO, 0,"Unable to restore %s\n", job->target);
+				failed++;
+				break;
+				}
+
+			if(status == RESTORE_JOB_FAIL)
+				{
+				if(!has_interrupted)
+					debug(ABORT, 1,"Unable to restore %s", job->target);
+
+				rCode = true;
+				break;
+				}
+
+			if(progressBar(original,original,PROGRESS_UPDATE))
+				{
+				feedbackComplete("*** CANCELLED ***");
+				rCode = true;
+				break;
+				}
 
-	if(scanSingleDrive(path,&d->deviceName[5],d))
-		return 1;
+			progressBar(original,original,PROGRESS_UPDATE | 1); // update global count
+			if(status == RESTORE_JOB_DONE)
+				break;
+			}
 
-	if(!readFromDisk(d,0,0,NULL,0))
-		checkIfLoop(d);
+		if(!rCode && status == RESTORE_JOB_DONE)
+			{
+			progressBar(0,original,PROGRESS_OK);
+			progressBar(original,original,PROGRESS_OK | 1); // update global count
+			}
+		}
 
-	if(syncTable(d))
-		return 1;
+	if(failed && !rCode)
+		{
+		debug(ABORT, 1,"Unable to restore %i of %i partitions", failed, restoreJobs.count);
+		rCode = true;
+		}
 
-	if(hasMountMismatch(NULL,d))
-		return 1;
+	pthread_mutex_lock(&restoreJobs.lock);
+	restoreJobs.stop = true;
+	pthread_cond_broadcast(&restoreJobs.cond);
+	pthread_mutex_unlock(&restoreJobs.lock);
+	for(i = 0; i < threads; i++)
+		pthread_join(tid[i], NULL);
 
-	return 0;
+	if(rCode)
+		syncTargets();
+	else
+		rCode = restoreFlush();
+
+	restoreDrop();
+
+	return(rCode);
 	}
 
 /*----------------------------------------------------------------------------
-**
+** Restore a file, or queue it while the plan is being made.
 */
 static bool restore(
 		char *device,
@@ -254,78 +1584,11 @@ static bool restore(
 		archive *arch
 		)
 	{
-	if(major == loopDrive + 1)
-		major = 0;
-
-	setProgress(PROGRESS_RESTORE,device,target,major,minor,type,label,0,state,arch);
-// sprintf(&globalBuf[30],"%-4s => %-4s %6s %-5s %-16s",device,&target[5],getEngine(type & TYPE_MASK,state),(type & DISK_MASK)?"disk":types[type & TYPE_MASK],(label != NULL && *label)?label:"");
-	if(testMode)
-		{
-		if(!ui_mode)
-			printf("%s\n",&globalBuf[40]);
-
-		return false;
-		}
-
-	if(type & DISK_TABLE)
-		{ // gpt or msdos
-		if((state & BUFFERED) == BUFFERED)
-			{
-			arch->state |= BUFFERED;
-			arch->fileBytes = 0;
-			}
-    else if(readSpecificFile(arch, major, minor,1) != 1)
-			{
-			// debug(EXIT, 0,"Damaged archive");  // test for fatal error
-			debug(ABORT, 0,"Damaged archive");
-			return true;
-			}
-
-    if(!readFromDisk(target,0,0,arch,0))
-			{
-			debug(ABORT, 0,"Restore write error");
-			return true;
-			}
-
-		if(((state & BUFFERED) != BUFFERED) && writeExtraBlocks(target,arch))
-			return true;
-
-		return false;
-		}
-  switch(state & ST_BLOCK)
-		{
-		// case ST_IMG: printf("Engine is Image.\n"); break;
+	if(restoreJobs.planning && ((type & DISK_TABLE) || (state & ST_BLOCK) == ST_CLONE || (state & ST_BLOCK) == ST_FULL || (state & ST_BLOCK) == ST_SWAP))
+		return(restoreQueue(device,label,(major == loopDrive + 1) ? 0 : major,minor,target,state,type));
 
-		case ST_CLONE:
-			return pcloneRestore(target, major, minor, type & TYPE_MASK, arch);
-			break;
-
-		case ST_FULL:
-			return ddRestore(target, major, minor, type & TYPE_MASK, arch);
-			break;
-
-		// case ST_FILE: printf("Engine is fsarchiver.\n"); break;
-
-		case ST_SWAP:
-			if(readSpecificFile(arch,major,minor,1) != 1)
-				{
-				debug(ABORT, 0,"Damaged archive");
-				return true;
-				}
-
-			return restoreSwap(target,arch);
-			break;
-
-		default:
-			if(!ui_mode)
-			printf("No known engine.\n");
-			break;
-    }
-
-	// type determine the engine, as well
-	return false;
+	return(restoreNow(device,label,major,minor,target,state,type,arch));
 	}
-
 /*----------------------------------------------------------------------------
 ** unmount/remount image mount if we're restoring onto an image space and the
 ** partition is different than the original partition
@@ -453,6 +1716,468 @@ void renameImage(void)
 	printf("Image title updated.\n");
 	}
 
+/*----------------------------------------------------------------------------
+** Library verify. verify source=<directory|list> checks every archive under
+** a directory, or named one per line in a list file, with a pool of jobs=
+** workers. Each worker hashes its archive file by file through a reader of
+** its own, as verify detail does (and decodes it with --deep), read ahead
+** on streams= streams like any other. reads= bounds the reads in flight
+** across all the workers, and rate= throttles each share, the filesystem or
+** http:// host an archive is on, to that many Mbit/s, so one NAS isn't
+** flooded while another sits idle. A report of every archive follows.
+*/
+#define LIBRARY_WAIT      0
+#define LIBRARY_OK        1
+#define LIBRARY_FAIL      2
+#define LIBRARY_MISSING   3
+#define LIBRARY_CANCEL    4
+#define LIBRARY_POLL      1000             // ms between progress updates
+#define LIBRARY_DEPTH     16               // directory levels searched
+#define LIBRARY_WIDTH     50               // archive name column of the report
+
+typedef struct
+	{
+	char          *path;
+	int            share;
+	int            files;
+	unsigned long  bytes;                  // stored bytes read
+	unsigned long  nanos;
+	char           status;
+	} libraryImage;
+
+typedef struct
+	{
+	char           key[64];
+	char          *label;                  // where its first archive is
+	unsigned long  due;                    // nanoTime() its next read may start
+	unsigned long  bytes;
+	int            images;
+	} libraryShare;
+
+static struct
+	{
+	libraryImage   *image;
+	int             count;
+	int             next;                  // next archive a worker takes
+	int             done;
+	libraryShare   *share;
+	int             shares;
+	int             reading;               // reads in flight
+	int             reads;                 // most reads in flight
+	int             rate;                  // Mbit/s per share; 0 = no limit
+	char            inflate;
+	pthread_mutex_t lock;
+	pthread_cond_t  cond;
+	} library = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+/*----------------------------------------------------------------------------
+** The share an archive is on. Returns -1 when it isn't there.
+*/
+static int libraryShareOf(char *path)
+	{
+	char          key[64];
+	char         *end;
+	struct stat64 st;
+	int           i;
+
+	if(!strncmp(path,"http://",7))
+		{
+		snprintf(key, sizeof(key), "%s", path);
+		if((end = strchr(&key[7],'/')) != NULL)
+			*end = 0;
+		}
+	else if(!stat64(path, &st))
+		snprintf(key, sizeof(key), "dev %lx", (unsigned long)st.st_dev);
+	else
+		return(-1);
+
+	for(i = 0; i < library.shares; i++)
+		{
+		if(!strcmp(library.share[i].key, key))
+			return(i);
+		}
+
+	if(NULL == (library.share = realloc(library.share, (library.shares + 1) * sizeof(libraryShare))))
+		debug(EXIT, 0,"Unable to allocate library shares\n");
+
+	memset(&library.share[i], 0, sizeof(libraryShare));
+	strcpy(library.share[i].key, key);
+	if(!strncmp(path,"http://",7))
+		end = strdup(key);
+	else if((end = strdup(path)) != NULL && strrchr(end,'/') != NULL)
+		strrchr(end,'/')[1] = 0;
+
+	library.share[i].label = end;
+	library.shares++;
+
+	return(i);
+	}
+
+/*----------------------------------------------------------------------------
+**
+*/
+static void libraryAdd(char *path)
+	{
+	libraryImage *img;
+
+	if(NULL == (library.image = realloc(library.image, (library.count + 1) * sizeof(libraryImage))) || NULL == (path = strdup(path)))
+		debug(EXIT, 0,"Unable to allocate library archives\n");
+
+	img = &library.image[library.count++];
+	memset(img, 0, sizeof(libraryImage));
+	img->path = path;
+	if((img->share = libraryShareOf(path)) != -1)
+		library.share[img->share].images++;
+	}
+
+/*----------------------------------------------------------------------------
+** Whether a file is the first segment of an archive.
+*/
+static bool libraryArchive(char *path)
+	{
+	unsigned char hdr[VSIZE + ISIZE];
+	unsigned int  segment = 0;
+	int           fd, n;
+
+	if((fd = open(path, O_RDONLY | O_LARGEFILE)) < 0)
+		return(false);
+
+	n = read(fd, hdr, sizeof(hdr));
+	close(fd);
+	if(n == sizeof(hdr))
+		memcpy(&segment, &hdr[VSIZE], ISIZE);
+
+	return(n == sizeof(hdr) && !memcmp(VERSTRING, hdr, VSIZE) && !segment);
+	}
+
+/*----------------------------------------------------------------------------
+** Adds the archives under a directory; later segments are found by the
+** readers.
+*/
+static void libraryScan(char *dir, int depth)
+	{
+	DIR           *dp;
+	struct dirent *de;
+	struct stat64  st;
+	char          *path;
+
+	if(depth > LIBRARY_DEPTH || NULL == (dp = opendir(dir)))
+		return;
+
+	while(NULL != (de = readdir(dp)))
+		{
+		if(*de->d_name == '.')
+			continue; // ., .. and hidden entries
+
+		if(NULL == (path = malloc(strlen(dir) + strlen(de->d_name) + 2)))
+			debug(EXIT, 0,"Unable to allocate library path\n");
+
+		sprintf(path, "%s%s%s", dir, (dir[strlen(dir) - 1] == '/') ? "" : "/", de->d_name);
+		if(stat64(path, &st))
+			;
+		else if(S_ISDIR(st.st_mode))
+			libraryScan(path, depth + 1);
+		else if(S_ISREG(st.st_mode) && libraryArchive(path))
+			libraryAdd(path);
+
+		free(path);
+		}
+
+	closedir(dp);
+	}
+
+/*----------------------------------------------------------------------------
+** Adds the archives and directories a list names, one per line; relative
+** names are taken from where the list is. Blank lines and # comments are
+** skipped.
+*/
+static void libraryList(char *list)
+	{
+	FILE          *fp;
+	char           line[MAX_PATH], path[MAX_PATH * 2];
+	char          *name, *end;
+	char          *slash = strrchr(list, '/');
+	struct stat64  st;
+
+	if(NULL == (fp = fopen(list, "r")))
+		debug(EXIT, 1,"Unable to read %s\n", list);
+
+	while(fgets(line, sizeof(line), fp) != NULL)
+		{
+		for(name = line; *name == ' ' || *name == '\t'; name++)
+			;
+
+		for(end = &name[strlen(name)]; end > name && (end[-1] == '\n' || end[-1] == '\r' || end[-1] == ' ' || end[-1] == '\t'); end--)
+			end[-1] = 0;
+
+		if(!*name || *name == '#')
+			continue;
+
+		if(*name == '/' || !strncmp(name,"http://",7) || slash == NULL)
+			strcpy(path, name);
+		else
+			sprintf(path, "%.*s%s", (int)(slash - list + 1), list, name);
+
+		if(!stat64(path, &st) && S_ISDIR(st.st_mode))
+			libraryScan(path, 0);
+		else
+			libraryAdd(path); // a missing one is reported as such
+		}
+
+	fclose(fp);
+	}
+
+/*----------------------------------------------------------------------------
+**
+*/
+static int libraryOrder(const void *a, const void *b)
+	{
+	return(strcmp(((libraryImage *)a)->path, ((libraryImage *)b)->path));
+	}
+
+/*----------------------------------------------------------------------------
+** One read for a worker, once its share is under its rate and there's room
+** among the reads in flight. Returns what readFile() does.
+*/
+static int libraryRead(libraryImage *img, archive *arch, unsigned char *buf)
+	{
+	libraryShare   *share = (img->share != -1) ? &library.share[img->share] : NULL;
+	unsigned long   now, wait = 0, stored = arch->fileBytes;
+	struct timespec ts;
+	int             n;
+
+	pthread_mutex_lock(&library.lock);
+	now = nanoTime();
+	if(library.rate && share != NULL && share->due > now)
+		wait = share->due - now;
+
+	pthread_mutex_unlock(&library.lock);
+	if(wait)
+		{
+		ts.tv_sec = wait / 1000000000UL;
+		ts.tv_nsec = wait % 1000000000UL;
+		nanosleep(&ts, NULL);
+		}
+
+	pthread_mutex_lock(&library.lock);
+	while(library.reading >= library.reads)
+		pthread_cond_wait(&library.cond, &library.lock);
+
+	library.reading++;
+	pthread_mutex_unlock(&library.lock);
+
+	now = nanoTime();
+	n = (has_interrupted) ? -1 : readFile(buf, IOBUFSIZE, arch, library.inflate);
+
+	pthread_mutex_lock(&library.lock);
+	library.reading--;
+	stored = arch->fileBytes - stored;
+	img->bytes += stored;
+	if(share != NULL)
+		{ // the share owes the time its bytes take at rate=, from when they were asked for
+		share->bytes += stored;
+		if(library.rate)
+			share->due = ((share->due > now) ? share->due : now) + stored * 8000UL / library.rate;
+		}
+
+	pthread_cond_broadcast(&library.cond);
+	pthread_mutex_unlock(&library.lock);
+
+	return(n);
+	}
+
+/*----------------------------------------------------------------------------
+** Verifies the next archive nobody has taken until there are none left.
+*/
+static void *libraryWorker(void *I__arg)
+	{
+	archive        arch;
+	libraryImage  *img;
+	unsigned char *buf = ioBuffer();
+	char          *name;
+	char           status;
+	int            n;
+
+	while(1)
+		{
+		pthread_mutex_lock(&library.lock);
+		img = (library.next < library.count && !has_interrupted) ? &library.image[library.next++] : NULL;
+		pthread_mutex_unlock(&library.lock);
+		if(img == NULL)
+			break;
+
+		if(NULL == (name = malloc(strlen(img->path) + 16)))
+			debug(EXIT, 0,"Unable to allocate library path\n");
+
+		strcpy(name, img->path); // segment names are built in place
+		img->nanos = nanoTime();
+		if((n = readImageArchive(name, &arch)) == 1)
+			{
+			while((n = readNextFile(&arch, library.inflate)) == 1)
+				{
+				img->files++;
+				while((n = libraryRead(img, &arch, buf)) > 0)
+					;
+
+				if(n)
+					break; // it didn't match its sha1sum
+				}
+
+			status = (has_interrupted) ? LIBRARY_CANCEL : (n) ? LIBRARY_FAIL : LIBRARY_OK;
+			}
+		else
+			status = (n) ? LIBRARY_FAIL : LIBRARY_MISSING;
+
+		if(arch.currentFD != -1)
+			closeArchive(&arch);
+
+		free(name);
+		if(status == LIBRARY_FAIL)
+			debug(INFO, 1,"Archive %s failed to verify\n", img->path);
+
+		pthread_mutex_lock(&library.lock);
+		img->nanos = nanoTime() - img->nanos;
+		img->status = status;
+		library.done++;
+		pthread_cond_broadcast(&library.cond);
+		pthread_mutex_unlock(&library.lock);
+		}
+
+	return(NULL);
+	}
+
+/*----------------------------------------------------------------------------
+** The report: every archive, every share, then the totals.
+*/
+static int libraryReport(unsigned long elapsed)
+	{
+	libraryImage  *img;
+	unsigned long  bytes = 0;
+	int            i, failed = 0;
+	char          *status, *name;
+
+	printf("\r\033[K\n\033[4m%-*s %5s %9s %10s %9s\033[0m\n", LIBRARY_WIDTH, "archive", "files", "size", "rate", "status");
+	for(i = 0; i < library.count; i++)
+		{
+		img = &library.image[i];
+		switch(img->status)
+			{
+			case LIBRARY_OK:      status = "       \033[32mOK\033[0m"; break;
+			case LIBRARY_FAIL:    status = "   \033[31mFAILED\033[0m"; break;
+			case LIBRARY_MISSING: status = "  \033[31mMISSING\033[0m"; break;
+			case LIBRARY_CANCEL:  status = "\033[33mCANCELLED\033[0m"; break;
+			default:              status = "  \033[33mSKIPPED\033[0m"; break;
+			}
+
+		if(img->status != LIBRARY_OK)
+			failed++;
+
+		bytes += img->bytes;
+		name = img->path;
+		if(strlen(name) > LIBRARY_WIDTH)
+			name = &name[strlen(name) - LIBRARY_WIDTH + 3];
+
+		readableSize(img->bytes);
+		printf("%s%-*s %5i %9s %6.0fMB/s %s\n", (name != img->path) ? "..." : "", (name != img->path) ? LIBRARY_WIDTH - 3 : LIBRARY_WIDTH, name, img->files, readable, (img->nanos) ? img->bytes * 1000.0 / img->nanos : 0.0, status);
+		}
+
+	printf("\n");
+	for(i = 0; i < library.shares; i++)
+		{
+		readableSize(library.share[i].bytes);
+		printf("Share %-44s %5i %9s\n", library.share[i].label, library.share[i].images, readable);
+		}
+
+	readableSize(bytes);
+	printf("\n%i of %i archives verified, %s in %s (%.0fMB/s)\n", library.count - failed, library.count, readable, readableTime(elapsed / 1000000000UL, 0), (elapsed) ? bytes * 1000.0 / elapsed : 0.0);
+
+	return(failed);
+	}
+
+/*----------------------------------------------------------------------------
+** Verifies a library of archives with rate= Mbit/s on each share. Returns
+** -1 when source is a single archive rather than a library, otherwise
+** whether everything verified.
+*/
+int verifyLibrary(char *source, int rate, int reads)
+	{
+	pthread_t        tid[JOBSMAX];
+	struct stat64    st;
+	struct timespec  ts;
+	unsigned long    start;
+	int              i, threads = 0, failed, done = -1;
+
+	if(!strncmp(source,"http://",7) || isStreamName(source) || stat64(source, &st))
+		return(-1); // not there, or nothing to search
+
+	if(S_ISDIR(st.st_mode))
+		libraryScan(source, 0);
+	else if(S_ISREG(st.st_mode) && !libraryArchive(source))
+		libraryList(source);
+	else
+		return(-1);
+
+	if(!library.count)
+		{
+		debug(INFO, 0,"No archives found in %s\n", source);
+		return(0);
+		}
+
+	qsort(library.image, library.count, sizeof(libraryImage), libraryOrder);
+	library.inflate = (options & OPT_DEEP) ? 1 : 0;
+	library.rate = rate;
+	library.reads = (reads) ? reads : diskJobs; // a read per worker unless reads= says otherwise
+	start = nanoTime();
+	for(i = 0; i < diskJobs && i < library.count; i++)
+		{
+		if(!pthread_create(&tid[threads], NULL, libraryWorker, NULL))
+			threads++;
+		}
+
+	if(!threads)
+		debug(EXIT, 0,"Unable to start verify jobs\n");
+
+	debug(INFO, 2,"Library verify: %i archives on %i shares, %i threads, %i reads at once\n", library.count, library.shares, threads, library.reads);
+	pthread_mutex_lock(&library.lock);
+	while(library.done < library.count && !has_interrupted)
+		{
+		if(done != library.done)
+			{
+			done = library.done;
+			printf("\rVerifying %i of %i archives\033[K", done + 1, library.count);
+			fflush(stdout);
+			}
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		if((ts.tv_nsec += LIBRARY_POLL * 1000000L) >= 1000000000L)
+			{
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+			}
+
+		pthread_cond_timedwait(&library.cond, &library.lock, &ts);
+		}
+
+	pthread_mutex_unlock(&library.lock);
+	for(i = 0; i < threads; i++)
+		pthread_join(tid[i], NULL);
+
+	failed = libraryReport(nanoTime() - start);
+	for(i = 0; i < library.count; i++)
+		free(library.image[i].path);
+
+	for(i = 0; i < library.shares; i++)
+		free(library.share[i].label);
+
+	free(library.image);
+	free(library.share);
+	library.image = NULL;
+	library.share = NULL;
+	library.count = library.shares = library.next = library.done = 0;
+
+	return(!failed);
+	}
+
 /*----------------------------------------------------------------------------
 **
 */
@@ -593,14 +2318,14 @@ static bool reloadPartition(
 		return true;
 		}
 
-	nogo = restore(&devName[5],"",major,minor,d->deviceName,state,type,arch); // no label for MBR
+	nogo = restoreNow(&devName[5],"",major,minor,d->deviceName,state,type,arch); // no label for MBR
 	if(mbrBuf != NULL)
 		{
 		free(mbrBuf);
 		mbrBuf = NULL;
 		}
 
-	if(nogo)
+	if(nogo || restoreFlush())
 		return true;
 
 	if(testMode)
@@ -635,7 +2360,7 @@ static bool reloadPartition(
 		state &= ST_BLOCK;
 		if(state != ST_IMG)
 			{ // write entire MBR bits here, since the buffer would only have done the primary table
-			return restore(&devName[5],"",major,minor,d->deviceName,state,type,arch);
+			return restoreNow(&devName[5],"",major,minor,d->deviceName,state,type,arch);
 			}
 		}
 
@@ -643,17 +2368,19 @@ static bool reloadPartition(
 	}
 
 /*----------------------------------------------------------------------------
-**
+** Restored size of a file, from the catalog.
 */
-static unsigned long findExpectedSize(int major, int minor, archive *arch)
+static unsigned long findExpectedSize(int major, int minor)
 	{
+	int i;
+
 	if(major == loopDrive + 1)
 		major = 0;
 
-	if(readSpecificFile(arch,major,minor,1) != 1)
-		return 0; // couldn't find this
+	if((i = catalogFind(major,minor)) == -1)
+		return 0; // not catalogued, or a stream
 
-	return arch->expectedOriginalBytes;
+	return restoreCatalog.entry[i].originalBytes;
 	}
 
 /*----------------------------------------------------------------------------
@@ -686,6 +2413,7 @@ static bool restoreDisk(disk *d, archive *arch, unsigned long archSize)
 		}
 
 	validOperation = 1;
+	restoreJobs.d = d;
 	for(pass = 0; pass < 2; pass++)
 		{ // first pass is for figuring out total size of disk image for feedback purposes
 		if(pass)
@@ -756,7 +2484,7 @@ static bool restoreDisk(disk *d, archive *arch, unsigned long archSize)
 			if(!(reloadCondition & 8) && add_img && !(type & DISK_MASK) && !strcmp(label,SYSLABEL))
 				restoreLocation = d->deviceName; // add to totalSize
 
-			totalSize += findExpectedSize(major,minor,arch);
+			totalSize += findExpectedSize(major,minor);
 			}
 		}
 	else if(pass)
@@ -794,12 +2522,20 @@ static bool restoreDisk(disk *d, archive *arch, unsigned long archSize)
 				return true; // interrupted
 			}
 		else
-			totalSize += findExpectedSize(major,minor,arch);
+			totalSize += findExpectedSize(major,minor);
 			}
 		}
 
+	if(restoreFlush())
+		return true;
+
 // one restore partition allowed per disk, onto which we restore the image
-	if(restoreLocation != NULL && !testMode)
+	if(restoreLocation != NULL && arch->stream)
+		{
+		if(!ui_mode)
+			printf("Stream archive not copied to %s.\n",&restoreLocation[5]);
+		}
+	else if(restoreLocation != NULL && !testMode)
 		{
 		if(!mountLocation(restoreLocation,restoreType,0))
 			{
@@ -866,6 +2602,10 @@ char performRestore(void)
 		return 1;
 		}
 
+	// plan every disk first, then restore in archive order; the disks' partitions together with jobs=
+	catalogRead(&readArch);
+	restoreJobs.planning = (!testMode && !add_img);
+	restoreJobs.workers = ((diskJobs > 1 || (options & OPT_TEE)) && !readArch.stream && strncmp(globalPath,"http://",7));
 	for(i=0;i<sel->count;i++)
 		{
     if(i == sel->position || sel->sources[i].state & ST_SEL)
@@ -875,6 +2615,9 @@ char performRestore(void)
 				{ // implies d->map
 				if(restoreDisk(d,&readArch,archSize))
 					{
+					restoreDrop();
+					catalogDrop();
+					syncTargets();
 					closeArchive(&readArch);
 					if(ui_mode)
 						return 1;
@@ -892,6 +2635,9 @@ char performRestore(void)
 						{
 						if(restoreDisk(d,&readArch,archSize))
 							{
+							restoreDrop();
+							catalogDrop();
+							syncTargets();
 							closeArchive(&readArch);
 							if(ui_mode)
 								return 1;
@@ -905,6 +2651,19 @@ char performRestore(void)
         }
       }
     }
+	if(restoreJobs.count && restoreQueued(&readArch))
+		{
+		catalogDrop();
+		syncTargets();
+		closeArchive(&readArch);
+		if(ui_mode)
+			return 1;
+
+		exit(1);
+		}
+
+	restoreDrop();
+	catalogDrop();
 	if(ui_mode)
 		progressBar(0,readArch.originalBytes,PROGRESS_COMPLETE);
 
@@ -31,6 +31,7 @@ extern char globalPath2[];
 */
 extern void locateImage(void);
 extern void renameImage(void);
+extern int verifyLibrary(char *source, int rate, int reads);
 extern char performRestore(void);
 
 #endif /* _RESTORE_H_ */
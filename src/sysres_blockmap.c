@@ -0,0 +1,382 @@
+/*****************************************************************************
+* sysres "System Restore" Partition backup and restore utility.
+* Copyright © 2019-2020 Micro Focus or one of its affiliates.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along
+* with this program; if not, write to the Free Software Foundation, Inc.,
+* 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/*----------------------------------------------------------------------------
+** Used-block map of a partition, kept the way roaring bitmaps keep theirs:
+** one container per SYSRES_BLOCKMAP_CHUNK_D blocks, each either empty, full,
+** a list of runs, or (only when it has too many runs for that to be smaller)
+** the plain 8 KB of bits. A flat bitmap of a 16 TB volume at 4 KB blocks is
+** 512 MB; mostly contiguous allocation keeps this down to a few MB, and
+** walking it goes run by run instead of bit by bit.
+**
+** Containers are loaded from partclone's bitmap layout (bit n of the volume
+** is bit n % 8 of byte n / 8) and can give it back, so the image stream and
+** its crc are unchanged.
+*/
+
+/*----------------------------------------------------------------------------
+** Compiler setup.
+*/
+  /* ANSI/POSIX */
+  #include <errno.h>             // ENOMEM
+  #include <stdlib.h>            // malloc()
+  #include <string.h>            // memcpy()
+
+  /* System Restore */
+  #include "sysres_blockmap.h"   // Validate self-compatibility.
+
+/*----------------------------------------------------------------------------
+** Storage
+*/
+#define SYSRES_BLOCKMAP_WORDS_D  (SYSRES_BLOCKMAP_CHUNK_D/64)
+
+/*----------------------------------------------------------------------------
+** Blocks covered by a container; only the last one can be short.
+*/
+static unsigned long SYSRES_BLOCKMAP_Span(
+		SYSRES_BLOCKMAP_T *I__map,
+		unsigned long      I__chunk
+		)
+	{
+	unsigned long long left = I__map->blocks - (unsigned long long)I__chunk * SYSRES_BLOCKMAP_CHUNK_D;
+
+	return((left < SYSRES_BLOCKMAP_CHUNK_D) ? left : SYSRES_BLOCKMAP_CHUNK_D);
+	}
+
+/*----------------------------------------------------------------------------
+** First run of used blocks in a container at or after I__from; offsets are
+** within the container, *O_end is one past the run.
+*/
+static bool SYSRES_BLOCKMAP_Run(
+		SYSRES_BLOCKMAP_CHUNK_T *I__chunk,
+		unsigned long            I__span,
+		unsigned long            I__from,
+		unsigned long           *O_first,
+		unsigned long           *O_end
+		)
+	{
+	unsigned long long *word;
+	unsigned long long  bits;
+	unsigned short     *pair;
+	unsigned int        lo, hi, mid;
+	unsigned long       i;
+
+	if(I__from >= I__span)
+		return(false);
+
+	switch(I__chunk->kind)
+		{
+		case SYSRES_BLOCKMAP_FULL:
+			*O_first = I__from;
+			*O_end = I__span;
+			return(true);
+
+		case SYSRES_BLOCKMAP_RUNS:
+			pair = I__chunk->data;
+			for(lo = 0, hi = I__chunk->runs; lo < hi; )
+				{ // the first run that ends at or after I__from
+				mid = (lo + hi) / 2;
+				if(pair[2*mid+1] < I__from)
+					lo = mid + 1;
+				else
+					hi = mid;
+				}
+
+			if(lo == I__chunk->runs)
+				return(false);
+
+			*O_first = (pair[2*lo] > I__from) ? pair[2*lo] : I__from;
+			*O_end = pair[2*lo+1] + 1UL;
+			return(true);
+
+		case SYSRES_BLOCKMAP_BITS:
+			word = I__chunk->data;
+			i = I__from / 64;
+			for(bits = word[i] & (~0ULL << (I__from % 64)); !bits && ++i < SYSRES_BLOCKMAP_WORDS_D; )
+				bits = word[i];
+
+			if(i >= SYSRES_BLOCKMAP_WORDS_D)
+				return(false);
+
+			*O_first = i * 64 + __builtin_ctzll(bits);
+			for(bits = ~word[i] & (~0ULL << (*O_first % 64)); !bits && ++i < SYSRES_BLOCKMAP_WORDS_D; )
+				bits = ~word[i];
+
+			*O_end = (i >= SYSRES_BLOCKMAP_WORDS_D) ? SYSRES_BLOCKMAP_CHUNK_D : i * 64 + __builtin_ctzll(bits);
+			return(true);
+		}
+
+	return(false);
+	}
+
+/*----------------------------------------------------------------------------
+** An empty map of I__blocks blocks.
+*/
+int SYSRES_BLOCKMAP_Init(
+		SYSRES_BLOCKMAP_T  *O_map,
+		unsigned long long  I__blocks
+		)
+	{
+	O_map->blocks = I__blocks;
+	O_map->used   = 0;
+	O_map->chunks = (I__blocks + SYSRES_BLOCKMAP_CHUNK_D - 1) / SYSRES_BLOCKMAP_CHUNK_D;
+	if(NULL == (O_map->chunk = calloc(O_map->chunks ? O_map->chunks : 1, sizeof(SYSRES_BLOCKMAP_CHUNK_T))))
+		return(ENOMEM);
+
+	return(0);
+	}
+
+/*----------------------------------------------------------------------------
+** Set one container from SYSRES_BLOCKMAP_BYTES_D bytes of bitmap (fewer for
+** the last container: as many as its blocks need). Bits past the end of the
+** volume are ignored.
+*/
+int SYSRES_BLOCKMAP_Load(
+		SYSRES_BLOCKMAP_T   *IO_map,
+		unsigned long        I__chunk,
+		const unsigned char *I__bits
+		)
+	{
+	SYSRES_BLOCKMAP_CHUNK_T *chunk = &IO_map->chunk[I__chunk];
+	unsigned long long       word[SYSRES_BLOCKMAP_WORDS_D] = { 0 };
+	unsigned long            span = SYSRES_BLOCKMAP_Span(IO_map, I__chunk);
+	unsigned long            first, end, i;
+	unsigned int             count = 0, runs = 0;
+	unsigned short          *pair;
+
+	memcpy(word, I__bits, (span + 7) / 8); // little-endian, like partclone's unsigned long bitmap
+	if(span % 64)
+		word[span / 64] &= (1ULL << (span % 64)) - 1;
+
+	for(i = 0; i < (span + 63) / 64; i++)
+		{
+		count += __builtin_popcountll(word[i]);
+		runs += __builtin_popcountll(word[i] & ~(word[i] << 1 | (i ? word[i-1] >> 63 : 0))); // run starts
+		}
+
+	IO_map->used -= chunk->count;
+	free(chunk->data);
+	chunk->data = NULL;
+	chunk->count = count;
+	chunk->runs = 0;
+	IO_map->used += count;
+	if(!count)
+		chunk->kind = SYSRES_BLOCKMAP_EMPTY;
+	else if(count == span)
+		chunk->kind = SYSRES_BLOCKMAP_FULL;
+	else if(runs <= SYSRES_BLOCKMAP_RUNS_D)
+		{
+		chunk->kind = SYSRES_BLOCKMAP_BITS; // so Run() can walk word[] for us
+		chunk->data = word;
+		if(NULL == (pair = malloc(runs * 2 * sizeof(unsigned short))))
+			goto NOMEM;
+
+		for(first = 0; SYSRES_BLOCKMAP_Run(chunk, span, first, &first, &end); first = end)
+			{
+			pair[2*chunk->runs]   = first;
+			pair[2*chunk->runs+1] = end - 1;
+			chunk->runs++;
+			}
+
+		chunk->kind = SYSRES_BLOCKMAP_RUNS;
+		chunk->data = pair;
+		}
+	else
+		{
+		chunk->kind = SYSRES_BLOCKMAP_BITS;
+		if(NULL == (chunk->data = malloc(sizeof(word))))
+			goto NOMEM;
+
+		memcpy(chunk->data, word, sizeof(word));
+		}
+
+	return(0);
+
+NOMEM:
+
+	chunk->kind = SYSRES_BLOCKMAP_EMPTY;
+	chunk->data = NULL;
+	IO_map->used -= count;
+	chunk->count = 0;
+
+	return(ENOMEM);
+	}
+
+/*----------------------------------------------------------------------------
+** The first run of used blocks at or after *IO_block, which is moved to its
+** start; *O_end is one past its end. Runs carry on across containers.
+*/
+bool SYSRES_BLOCKMAP_Next(
+		SYSRES_BLOCKMAP_T  *I__map,
+		unsigned long long *IO_block,
+		unsigned long long *O_end
+		)
+	{
+	unsigned long long base;
+	unsigned long      c, first, end, from;
+
+	if(*IO_block >= I__map->blocks)
+		return(false);
+
+	from = *IO_block % SYSRES_BLOCKMAP_CHUNK_D;
+	for(c = *IO_block / SYSRES_BLOCKMAP_CHUNK_D; c < I__map->chunks; c++, from = 0)
+		{
+		if(SYSRES_BLOCKMAP_Run(&I__map->chunk[c], SYSRES_BLOCKMAP_Span(I__map, c), from, &first, &end))
+			break;
+		}
+
+	if(c >= I__map->chunks)
+		return(false);
+
+	base = (unsigned long long)c * SYSRES_BLOCKMAP_CHUNK_D;
+	*IO_block = base + first;
+	*O_end = base + end;
+	while(end == SYSRES_BLOCKMAP_CHUNK_D && ++c < I__map->chunks)
+		{
+		if(!SYSRES_BLOCKMAP_Run(&I__map->chunk[c], SYSRES_BLOCKMAP_Span(I__map, c), 0, &first, &end) || first)
+			break;
+
+		*O_end = (unsigned long long)c * SYSRES_BLOCKMAP_CHUNK_D + end;
+		}
+
+	return(true);
+	}
+
+/*----------------------------------------------------------------------------
+** A container back in bitmap form; returns the bytes written to O_bits.
+*/
+size_t SYSRES_BLOCKMAP_Bits(
+		SYSRES_BLOCKMAP_T *I__map,
+		unsigned long      I__chunk,
+		unsigned char     *O_bits
+		)
+	{
+	SYSRES_BLOCKMAP_CHUNK_T *chunk = &I__map->chunk[I__chunk];
+	unsigned long            span = SYSRES_BLOCKMAP_Span(I__map, I__chunk);
+	size_t                   bytes = (span + 7) / 8;
+	unsigned short          *pair;
+	unsigned long            b;
+	unsigned int             i;
+
+	memset(O_bits, (chunk->kind == SYSRES_BLOCKMAP_FULL) ? 0xFF : 0, bytes);
+	switch(chunk->kind)
+		{
+		case SYSRES_BLOCKMAP_FULL:
+			if(span % 8)
+				O_bits[bytes-1] = (1 << (span % 8)) - 1;
+
+			break;
+
+		case SYSRES_BLOCKMAP_RUNS:
+			pair = chunk->data;
+			for(i = 0; i < chunk->runs; i++)
+				{
+				for(b = pair[2*i]; b <= pair[2*i+1] && b % 8; b++)
+					O_bits[b / 8] |= 1 << (b % 8);
+
+				if(pair[2*i+1] + 1UL - b >= 8)
+					{
+					memset(&O_bits[b / 8], 0xFF, (pair[2*i+1] + 1UL - b) / 8);
+					b += (pair[2*i+1] + 1UL - b) & ~7UL;
+					}
+
+				for(; b <= pair[2*i+1]; b++)
+					O_bits[b / 8] |= 1 << (b % 8);
+				}
+
+			break;
+
+		case SYSRES_BLOCKMAP_BITS:
+			memcpy(O_bits, chunk->data, bytes);
+			break;
+		}
+
+	return(bytes);
+	}
+
+/*----------------------------------------------------------------------------
+** The used block of rank I__rank (counting from 0 in block order).
+*/
+bool SYSRES_BLOCKMAP_Select(
+		SYSRES_BLOCKMAP_T  *I__map,
+		unsigned long long  I__rank,
+		unsigned long long *O_block
+		)
+	{
+	SYSRES_BLOCKMAP_CHUNK_T *chunk;
+	unsigned long long      *word, bits;
+	unsigned short          *pair;
+	unsigned long            c, i, n;
+
+	for(c = 0; c < I__map->chunks && I__rank >= I__map->chunk[c].count; c++)
+		I__rank -= I__map->chunk[c].count;
+
+	if(c >= I__map->chunks)
+		return(false);
+
+	chunk = &I__map->chunk[c];
+	*O_block = (unsigned long long)c * SYSRES_BLOCKMAP_CHUNK_D;
+	switch(chunk->kind)
+		{
+		case SYSRES_BLOCKMAP_FULL:
+			*O_block += I__rank;
+			break;
+
+		case SYSRES_BLOCKMAP_RUNS:
+			pair = chunk->data;
+			for(i = 0; I__rank >= (n = pair[2*i+1] - pair[2*i] + 1UL); i++)
+				I__rank -= n;
+
+			*O_block += pair[2*i] + I__rank;
+			break;
+
+		case SYSRES_BLOCKMAP_BITS:
+			word = chunk->data;
+			for(i = 0; I__rank >= (n = __builtin_popcountll(word[i])); i++)
+				I__rank -= n;
+
+			for(bits = word[i]; I__rank--; )
+				bits &= bits - 1;
+
+			*O_block += i * 64 + __builtin_ctzll(bits);
+			break;
+		}
+
+	return(true);
+	}
+
+/*----------------------------------------------------------------------------
+**
+*/
+void SYSRES_BLOCKMAP_Free(
+		SYSRES_BLOCKMAP_T *IO_map
+		)
+	{
+	unsigned long c;
+
+	for(c = 0; IO_map->chunk != NULL && c < IO_map->chunks; c++)
+		free(IO_map->chunk[c].data);
+
+	free(IO_map->chunk);
+	IO_map->chunk = NULL;
+	IO_map->chunks = 0;
+	IO_map->blocks = IO_map->used = 0;
+
+	return;
+	}
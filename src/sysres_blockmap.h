@@ -0,0 +1,96 @@
+/*****************************************************************************
+* sysres "System Restore" Partition backup and restore utility.
+* Copyright © 2019-2020 Micro Focus or one of its affiliates.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along
+* with this program; if not, write to the Free Software Foundation, Inc.,
+* 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef _SYSRES_BLOCKMAP_H_
+ #define _SYSRES_BLOCKMAP_H_
+
+/*----------------------------------------------------------------------------
+** Compiler setup.
+*/
+#include <stdbool.h>   // bool
+#include <stddef.h>    // size_t
+
+/*----------------------------------------------------------------------------
+** Macro values
+*/
+#define SYSRES_BLOCKMAP_CHUNK_D  65536                      // blocks per container
+#define SYSRES_BLOCKMAP_BYTES_D  (SYSRES_BLOCKMAP_CHUNK_D/8) // bitmap bytes per container
+#define SYSRES_BLOCKMAP_RUNS_D   (SYSRES_BLOCKMAP_BYTES_D/4) // more runs than this are kept as bits
+
+#define SYSRES_BLOCKMAP_EMPTY    0
+#define SYSRES_BLOCKMAP_FULL     1
+#define SYSRES_BLOCKMAP_RUNS     2
+#define SYSRES_BLOCKMAP_BITS     3
+
+/*----------------------------------------------------------------------------
+** Storage
+*/
+typedef struct
+	{
+	unsigned char       kind;              // SYSRES_BLOCKMAP_EMPTY..BITS
+	unsigned int        count;             // used blocks in the container
+	unsigned int        runs;              // RUNS: first/last pairs in data
+	void               *data;              // RUNS: unsigned short pairs, BITS: SYSRES_BLOCKMAP_BYTES_D bytes
+	} SYSRES_BLOCKMAP_CHUNK_T;
+
+typedef struct
+	{
+	unsigned long long       blocks;
+	unsigned long long       used;
+	unsigned long            chunks;
+	SYSRES_BLOCKMAP_CHUNK_T *chunk;
+	} SYSRES_BLOCKMAP_T;
+
+/*----------------------------------------------------------------------------
+** Function prototypes.
+*/
+extern int SYSRES_BLOCKMAP_Init(
+		SYSRES_BLOCKMAP_T  *O_map,
+		unsigned long long  I__blocks
+		);
+
+extern int SYSRES_BLOCKMAP_Load(
+		SYSRES_BLOCKMAP_T   *IO_map,
+		unsigned long        I__chunk,
+		const unsigned char *I__bits
+		);
+
+extern bool SYSRES_BLOCKMAP_Next(
+		SYSRES_BLOCKMAP_T  *I__map,
+		unsigned long long *IO_block,
+		unsigned long long *O_end
+		);
+
+extern size_t SYSRES_BLOCKMAP_Bits(
+		SYSRES_BLOCKMAP_T *I__map,
+		unsigned long      I__chunk,
+		unsigned char     *O_bits
+		);
+
+extern bool SYSRES_BLOCKMAP_Select(
+		SYSRES_BLOCKMAP_T  *I__map,
+		unsigned long long  I__rank,
+		unsigned long long *O_block
+		);
+
+extern void SYSRES_BLOCKMAP_Free(
+		SYSRES_BLOCKMAP_T *IO_map
+		);
+
+#endif /* _SYSRES_BLOCKMAP_H_ */
@@ -0,0 +1,929 @@
+/*****************************************************************************
+* sysres "System Restore" Partition backup and restore utility.
+* Copyright © 2019-2020 Micro Focus or one of its affiliates.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along
+* with this program; if not, write to the Free Software Foundation, Inc.,
+* 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/*----------------------------------------------------------------------------
+** One sender multicasts a stream archive to any number of receivers, which
+** feed it to the normal restore engines through source=mcast://...
+**
+** Receivers JOIN while the sender announces, then send ACKs (packets handed
+** to the restore) as they consume data and NAKs for gaps. The sender never
+** runs more than SYSRES_MULTICAST_WINDOW_D packets ahead of the slowest
+** receiver, so every NAK can be repaired from its window. Receivers that go
+** silent for SYSRES_MULTICAST_TIMEOUT_D seconds are dropped so they can't
+** stall the rest.
+**
+** Repairs are multicast, so one receiver's NAK usually fixes the same gap for
+** the others: receivers wait a random moment before NAKing a gap and back off
+** while it stays open, and the sender resends a packet at most once per
+** SYSRES_MULTICAST_REPAIRGAP_D ms however many NAKs name it.
+**
+** Headers go on the wire as fixed-width fields in network byte order, so
+** senders and receivers of different word size or endianness interoperate.
+*/
+
+/*----------------------------------------------------------------------------
+** Compiler setup.
+*/
+  /* ANSI/POSIX */
+  #include <arpa/inet.h>         // inet_aton(), inet_ntoa()
+  #include <endian.h>            // htobe64()
+  #include <errno.h>             // errno
+  #include <netinet/in.h>        // sockaddr_in, ip_mreq
+  #include <poll.h>              // poll()
+  #include <pthread.h>           // pthread_create()
+  #include <signal.h>            // sigset_t
+  #include <stdint.h>            // uint32_t
+  #include <stdio.h>             // printf()
+  #include <stdlib.h>            // EXIT_SUCCESS, malloc()
+  #include <string.h>            // memcpy()
+  #include <sys/socket.h>        // socket()
+  #include <sys/time.h>          // gettimeofday()
+  #include <sys/wait.h>          // waitpid()
+  #include <time.h>              // time()
+  #include <unistd.h>            // fork(), pipe()
+
+  /* System Restore */
+  #include "backup.h"            // backupPID
+  #include "fileEngine.h"        // streamImage(), STREAMNAME
+  #include "partition.h"         // INFO
+  #include "partutil.h"          // readableSize(), readable
+  #include "sysres_debug.h"      // debug()
+  #include "sysres_multicast.h"  // Validate self-compatibility.
+  #include "sysres_signal.h"     // SYSRES_SIGNAL_hasInterrupted
+
+/*----------------------------------------------------------------------------
+** Macro values
+*/
+#define SYSRES_MULTICAST_MAGIC_D    "SRMC"
+#define SYSRES_MULTICAST_ANNOUNCE_T 1  // sender: looking for receivers
+#define SYSRES_MULTICAST_DATA_T     2  // sender: seq = packet number, count = bytes
+#define SYSRES_MULTICAST_END_T      3  // sender: seq = total packets
+#define SYSRES_MULTICAST_JOIN_T     4  // receiver: include me
+#define SYSRES_MULTICAST_ACK_T      5  // receiver: seq = packets consumed, its window starts there
+#define SYSRES_MULTICAST_NAK_T      6  // receiver: resend count packets from seq
+#define SYSRES_MULTICAST_DONE_T     7  // receiver: everything received
+#define SYSRES_MULTICAST_NAKMAX_D   64 // packets repaired per NAK
+#define SYSRES_MULTICAST_ACKEVERY_D 256
+#define SYSRES_MULTICAST_NAKWAIT_D  20  // ms; a gap is NAKed after a random wait up to this
+#define SYSRES_MULTICAST_NAKMAXWAIT_D 640 // ms; longest backoff while a NAKed gap stays open
+#define SYSRES_MULTICAST_REPAIRGAP_D 10 // ms; a packet isn't resent again sooner than this
+
+/*----------------------------------------------------------------------------
+** Storage
+*/
+typedef struct
+	{ // on the wire: network byte order, 24 bytes with no padding
+	char     magic[4];
+	uint32_t session;  // sender start time; other sessions on the group are ignored
+	uint64_t seq;
+	uint32_t type;
+	uint32_t count;
+	} SYSRES_MULTICAST_HDR_T;
+
+typedef struct
+	{
+	SYSRES_MULTICAST_HDR_T hdr;
+	unsigned char          data[SYSRES_MULTICAST_PAYLOAD_D];
+	} SYSRES_MULTICAST_PACKET_T;
+
+typedef struct
+	{
+	struct sockaddr_in addr;
+	unsigned long      ack;   // next packet this receiver needs
+	time_t             last;  // last time we heard from it
+	char               state; // 0 = active, 1 = done, 2 = dropped
+	} SYSRES_MULTICAST_CLIENT_T;
+
+typedef struct
+	{ // receiver: the network thread fills the window, the writer drains it
+	SYSRES_MULTICAST_PACKET_T *window;
+	unsigned char             *present;
+	unsigned long              next;    // first packet not yet received in order
+	unsigned long              written; // packets handed to the stream reader
+	char                       end;     // no more packets will arrive
+	char                       failed;  // the stream reader went away
+	pthread_mutex_t            lock;
+	pthread_cond_t             cond;
+	} SYSRES_MULTICAST_RECV_T;
+
+static int SYSRES_MULTICAST_recvSock = -1;
+static int SYSRES_MULTICAST_recvFD   = -1;
+
+/*----------------------------------------------------------------------------
+** Parse <group>[:<port>] into a multicast address.
+*/
+static int SYSRES_MULTICAST_Address(
+		const char         *I__group,
+		struct sockaddr_in *O_addr
+		)
+	{
+	int  rCode = EXIT_SUCCESS;
+	char host[64];
+	char *port;
+
+	if(strlen(I__group) >= sizeof(host))
+		{
+		rCode = EINVAL;
+		goto CLEANUP;
+		}
+
+	strcpy(host, I__group);
+	bzero(O_addr, sizeof(struct sockaddr_in));
+	O_addr->sin_family = AF_INET;
+	O_addr->sin_port = htons(SYSRES_MULTICAST_PORT_D);
+	if((port = strchr(host, ':')) != NULL)
+		{
+		*port++ = 0;
+		if(atoi(port) <= 0 || atoi(port) > 65535)
+			{
+			rCode = EINVAL;
+			goto CLEANUP;
+			}
+
+		O_addr->sin_port = htons(atoi(port));
+		}
+
+	if(!inet_aton(host, &O_addr->sin_addr) || !IN_MULTICAST(ntohl(O_addr->sin_addr.s_addr)))
+		rCode = EINVAL;
+
+CLEANUP:
+
+	if(rCode)
+		debug(INFO, 0, "Invalid multicast group %s\n", I__group);
+
+	return(rCode);
+	}
+
+/*----------------------------------------------------------------------------
+** Fill in a header for the wire.
+*/
+static void SYSRES_MULTICAST_Header(
+		SYSRES_MULTICAST_HDR_T *O_hdr,
+		unsigned int            I__session,
+		unsigned int            I__type,
+		unsigned long           I__seq,
+		unsigned int            I__count
+		)
+	{
+	memcpy(O_hdr->magic, SYSRES_MULTICAST_MAGIC_D, 4);
+	O_hdr->session = htonl(I__session);
+	O_hdr->type = htonl(I__type);
+	O_hdr->seq = htobe64(I__seq);
+	O_hdr->count = htonl(I__count);
+
+	return;
+	}
+
+/*----------------------------------------------------------------------------
+** Take a received header into host byte order; false if it isn't ours.
+*/
+static int SYSRES_MULTICAST_Decode(
+		SYSRES_MULTICAST_HDR_T *IO_hdr
+		)
+	{
+	if(memcmp(IO_hdr->magic, SYSRES_MULTICAST_MAGIC_D, 4))
+		return(0);
+
+	IO_hdr->session = ntohl(IO_hdr->session);
+	IO_hdr->type = ntohl(IO_hdr->type);
+	IO_hdr->seq = be64toh(IO_hdr->seq);
+	IO_hdr->count = ntohl(IO_hdr->count);
+
+	return(1);
+	}
+
+/*----------------------------------------------------------------------------
+** Send a control packet (no payload).
+*/
+static void SYSRES_MULTICAST_Control(
+		int                 I__sock,
+		struct sockaddr_in *I__to,
+		unsigned int        I__session,
+		unsigned int        I__type,
+		unsigned long       I__seq,
+		unsigned int        I__count
+		)
+	{
+	SYSRES_MULTICAST_HDR_T hdr;
+
+	SYSRES_MULTICAST_Header(&hdr, I__session, I__type, I__seq, I__count);
+	sendto(I__sock, &hdr, sizeof(hdr), 0, (struct sockaddr *)I__to, sizeof(struct sockaddr_in));
+
+	return;
+	}
+
+/*----------------------------------------------------------------------------
+** Read until size bytes or EOF (pipes return short reads).
+*/
+static int SYSRES_MULTICAST_Fill(
+		int            I__fd,
+		unsigned char *O_buf,
+		int            I__size
+		)
+	{
+	int n, offset = 0;
+
+	while(offset < I__size && (n = read(I__fd, &O_buf[offset], I__size - offset)) > 0)
+		offset += n;
+
+	return(offset);
+	}
+
+/*----------------------------------------------------------------------------
+** Milliseconds since the epoch.
+*/
+static unsigned long SYSRES_MULTICAST_Now(void)
+	{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return((unsigned long)tv.tv_sec * 1000 + tv.tv_usec / 1000);
+	}
+
+/*----------------------------------------------------------------------------
+** Handle one receiver message on the sender side.
+*/
+static void SYSRES_MULTICAST_Service(
+		int                        I__sock,
+		struct sockaddr_in        *I__group,
+		unsigned int               I__session,
+		SYSRES_MULTICAST_PACKET_T *I__window,
+		unsigned long             *IO_resent,
+		unsigned long              I__sent,
+		SYSRES_MULTICAST_CLIENT_T *IO_clients,
+		int                       *IO_clientCount,
+		char                       I__joining
+		)
+	{
+	SYSRES_MULTICAST_HDR_T hdr;
+	struct sockaddr_in from;
+	socklen_t fromLen = sizeof(from);
+	SYSRES_MULTICAST_CLIENT_T *c = NULL;
+	unsigned long seq, now;
+	int i;
+
+	while(recvfrom(I__sock, &hdr, sizeof(hdr), MSG_DONTWAIT, (struct sockaddr *)&from, &fromLen) == sizeof(hdr))
+		{
+		fromLen = sizeof(from);
+		if(!SYSRES_MULTICAST_Decode(&hdr) || hdr.session != I__session)
+			continue;
+
+		for(i = 0, c = NULL; i < *IO_clientCount; i++)
+			{
+			if(IO_clients[i].addr.sin_addr.s_addr == from.sin_addr.s_addr && IO_clients[i].addr.sin_port == from.sin_port)
+				{
+				c = &IO_clients[i];
+				break;
+				}
+			}
+
+		if(c == NULL)
+			{
+			if(hdr.type != SYSRES_MULTICAST_JOIN_T)
+				continue;
+
+			if(!I__joining || *IO_clientCount >= SYSRES_MULTICAST_CLIENTS_D)
+				{
+				debug(INFO, 1, "Ignoring late receiver %s\n", inet_ntoa(from.sin_addr));
+				continue;
+				}
+
+			c = &IO_clients[(*IO_clientCount)++];
+			bzero(c, sizeof(SYSRES_MULTICAST_CLIENT_T));
+			c->addr = from;
+			printf("Receiver %s joined (%i).\n", inet_ntoa(from.sin_addr), *IO_clientCount);
+			}
+
+		c->last = time(NULL);
+		if(c->state == 2)
+			continue; // already dropped
+
+		switch(hdr.type)
+			{
+			case SYSRES_MULTICAST_DONE_T:
+				c->state = 1;
+				c->ack = I__sent;
+				break;
+
+			case SYSRES_MULTICAST_ACK_T:
+				if(hdr.seq > c->ack)
+					c->ack = hdr.seq;
+				break;
+
+			case SYSRES_MULTICAST_NAK_T:
+				if(hdr.count > SYSRES_MULTICAST_NAKMAX_D)
+					hdr.count = SYSRES_MULTICAST_NAKMAX_D;
+
+				now = SYSRES_MULTICAST_Now();
+				for(seq = hdr.seq; seq < hdr.seq + hdr.count && seq < I__sent; seq++)
+					{
+					if(seq + SYSRES_MULTICAST_WINDOW_D < I__sent)
+						{ // can't happen while flow control holds
+						debug(INFO, 1, "Receiver %s fell out of the repair window\n", inet_ntoa(from.sin_addr));
+						c->state = 2;
+						break;
+						}
+
+					i = seq % SYSRES_MULTICAST_WINDOW_D;
+					if(now - IO_resent[i] < SYSRES_MULTICAST_REPAIRGAP_D)
+						continue; // another receiver's NAK just repaired it for everyone
+
+					IO_resent[i] = now;
+					sendto(I__sock, &I__window[i], sizeof(SYSRES_MULTICAST_HDR_T) + ntohl(I__window[i].hdr.count), 0, (struct sockaddr *)I__group, sizeof(struct sockaddr_in));
+					}
+				break;
+			}
+		}
+
+	return;
+	}
+
+/*----------------------------------------------------------------------------
+** Multicast an archive to every receiver that joins the group. Segmented
+** archives are converted to the stream layout on the fly.
+**
+** I__clients: start as soon as this many receivers joined (0 = wait
+**             SYSRES_MULTICAST_ANNOUNCE_D seconds and take whoever joined)
+** I__rate:    Mbit/s limit (0 = unlimited, flow control only)
+*/
+int SYSRES_MULTICAST_Send(
+		char       *I__source,
+		const char *I__group,
+		int         I__clients,
+		int         I__rate
+		)
+	{
+	int rCode = EXIT_SUCCESS;
+	struct sockaddr_in group;
+	SYSRES_MULTICAST_PACKET_T *window = NULL;
+	unsigned long *resent = NULL;
+	SYSRES_MULTICAST_CLIENT_T clients[SYSRES_MULTICAST_CLIENTS_D];
+	SYSRES_MULTICAST_PACKET_T *p;
+	struct pollfd pfd;
+	int clientCount = 0;
+	int sock = -1;
+	int dataFD = -1;
+	int pipeFD[2];
+	int status, i, n;
+	pid_t pid = 0;
+	unsigned char ttl = 1, loop = 1;
+	unsigned int session = time(NULL);
+	unsigned long sent = 0, total = 0, bytes = 0, minAck;
+	unsigned long start, lastControl = 0;
+	char eof = 0, active;
+	time_t now, announceEnd;
+
+	if((rCode = SYSRES_MULTICAST_Address(I__group, &group)))
+		goto CLEANUP;
+
+	errno = EXIT_SUCCESS;
+	if((window = malloc(SYSRES_MULTICAST_WINDOW_D * sizeof(SYSRES_MULTICAST_PACKET_T))) == NULL
+		|| (resent = calloc(SYSRES_MULTICAST_WINDOW_D, sizeof(unsigned long))) == NULL)
+		{
+		rCode = errno;
+		goto CLEANUP;
+		}
+
+	if((sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+		{
+		rCode = errno;
+		debug(INFO, 0, "Unable to open multicast socket\n");
+		goto CLEANUP;
+		}
+
+	setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)); // stay on the local segment
+	setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)); // receivers on this host (loopback testing)
+
+	/* convert (or re-frame a stream) in a child so the SHA1 state isn't shared */
+	if(pipe(pipeFD))
+		{
+		rCode = errno;
+		goto CLEANUP;
+		}
+
+	if((pid = fork()) == 0)
+		{
+		close(pipeFD[0]);
+		n = streamImage(I__source, pipeFD[1]);
+		close(pipeFD[1]);
+		_exit((n == 1)?0:1);
+		}
+	else if(pid < 0)
+		{
+		rCode = errno;
+		pid = 0;
+		close(pipeFD[0]);
+		close(pipeFD[1]);
+		goto CLEANUP;
+		}
+
+	close(pipeFD[1]);
+	dataFD = pipeFD[0];
+	backupPID = pid; // ctrl-c stops the conversion too
+
+	/* ANNOUNCE: collect receivers */
+	printf("Announcing %s on %s:%i\n", I__source, inet_ntoa(group.sin_addr), ntohs(group.sin_port));
+	announceEnd = time(NULL) + ((I__clients)?SYSRES_MULTICAST_TIMEOUT_D * 10:SYSRES_MULTICAST_ANNOUNCE_D);
+	pfd.fd = sock;
+	pfd.events = POLLIN;
+	while((!I__clients || clientCount < I__clients) && time(NULL) < announceEnd)
+		{
+		if(SYSRES_SIGNAL_hasInterrupted)
+			{
+			rCode = EINTR;
+			goto CLEANUP;
+			}
+
+		SYSRES_MULTICAST_Control(sock, &group, session, SYSRES_MULTICAST_ANNOUNCE_T, 0, 0);
+		poll(&pfd, 1, 500);
+		SYSRES_MULTICAST_Service(sock, &group, session, window, resent, sent, clients, &clientCount, 1);
+		}
+
+	if(!clientCount)
+		{
+		rCode = ENOENT;
+		debug(INFO, 0, "No receivers joined %s\n", I__group);
+		goto CLEANUP;
+		}
+
+	if(I__clients && clientCount < I__clients)
+		printf("Only %i of %i receivers joined; starting anyway.\n", clientCount, I__clients);
+
+	/* DATA: send within the window of the slowest receiver, repair on NAK */
+	start = SYSRES_MULTICAST_Now();
+	for(now = time(NULL), i = 0; i < clientCount; i++)
+		clients[i].last = now;
+
+	while(1)
+		{
+		if(SYSRES_SIGNAL_hasInterrupted)
+			{
+			rCode = EINTR;
+			goto CLEANUP;
+			}
+
+		SYSRES_MULTICAST_Service(sock, &group, session, window, resent, sent, clients, &clientCount, 0);
+		now = time(NULL);
+		minAck = sent;
+		active = 0;
+		for(i = 0; i < clientCount; i++)
+			{
+			if(clients[i].state)
+				continue;
+
+			if(now - clients[i].last > SYSRES_MULTICAST_TIMEOUT_D)
+				{
+				printf("Receiver %s stopped responding; dropped.\n", inet_ntoa(clients[i].addr.sin_addr));
+				clients[i].state = 2;
+				continue;
+				}
+
+			active = 1;
+			if(clients[i].ack < minAck)
+				minAck = clients[i].ack;
+			}
+
+		if(!active)
+			{ // everyone finished, or nobody is left
+			for(i = 0; i < clientCount && clients[i].state != 1; i++)
+				;
+
+			if(i == clientCount || !eof)
+				{
+				rCode = EIO;
+				debug(INFO, 0, "All multicast receivers were lost\n");
+				}
+
+			break;
+			}
+
+		if(!eof && sent < minAck + SYSRES_MULTICAST_WINDOW_D)
+			{
+			p = &window[sent % SYSRES_MULTICAST_WINDOW_D];
+			if((n = SYSRES_MULTICAST_Fill(dataFD, p->data, SYSRES_MULTICAST_PAYLOAD_D)) <= 0)
+				{
+				eof = 1;
+				total = sent;
+				continue;
+				}
+
+			SYSRES_MULTICAST_Header(&p->hdr, session, SYSRES_MULTICAST_DATA_T, sent, n);
+			resent[sent++ % SYSRES_MULTICAST_WINDOW_D] = 0;
+			sendto(sock, p, sizeof(SYSRES_MULTICAST_HDR_T) + n, 0, (struct sockaddr *)&group, sizeof(group));
+			bytes += n;
+			if(I__rate)
+				{ // bytes / (Mbit/s * 125000 bytes) = seconds that should have elapsed
+				unsigned long due = bytes / ((unsigned long)I__rate * 125);
+				unsigned long elapsed = SYSRES_MULTICAST_Now() - start;
+				if(due > elapsed)
+					usleep((due - elapsed) * 1000);
+				}
+			continue;
+			}
+
+		/* window full or all sent: wait for ACK/NAK/DONE, prodding stragglers */
+		pfd.fd = sock;
+		poll(&pfd, 1, 100);
+		if(SYSRES_MULTICAST_Now() - lastControl >= 500)
+			{
+			lastControl = SYSRES_MULTICAST_Now();
+			if(eof)
+				SYSRES_MULTICAST_Control(sock, &group, session, SYSRES_MULTICAST_END_T, total, 0);
+			else
+				{ // resend the oldest outstanding packet so a stalled receiver NAKs/ACKs
+				p = &window[minAck % SYSRES_MULTICAST_WINDOW_D];
+				sendto(sock, p, sizeof(SYSRES_MULTICAST_HDR_T) + ntohl(p->hdr.count), 0, (struct sockaddr *)&group, sizeof(group));
+				}
+			}
+		}
+
+	if(pid)
+		{
+		waitpid(pid, &status, 0);
+		pid = backupPID = 0;
+		if(!WIFEXITED(status) || WEXITSTATUS(status))
+			{
+			rCode = EIO;
+			debug(INFO, 0, "Unable to read archive %s\n", I__source);
+			}
+		}
+
+	if(!rCode)
+		{
+		readableSize(bytes);
+		for(i = 0, n = 0; i < clientCount; i++)
+			if(clients[i].state == 1)
+				n++;
+
+		printf("Multicast %s complete: %s to %i receiver%s in %lus.\n", I__source, readable, n, (n == 1)?"":"s", (SYSRES_MULTICAST_Now() - start) / 1000);
+		}
+
+CLEANUP:
+
+	if(dataFD != -1)
+		close(dataFD); // the converter mustn't be left blocked on a pipe nobody drains
+
+	if(pid)
+		{
+		kill(pid, SIGKILL); // it inherits SIGQUIT ignored
+		waitpid(pid, &status, 0);
+		backupPID = 0;
+		}
+
+	if(sock != -1)
+		close(sock);
+
+	if(window)
+		free(window);
+
+	if(resent)
+		free(resent);
+
+	return(rCode);
+	}
+
+/*----------------------------------------------------------------------------
+** Writer thread: hand the received packets, in order, to the pipe the stream
+** reader consumes. The pipe blocks whenever the restore falls behind, so this
+** is kept off the network thread, which goes on ACKing and NAKing meanwhile.
+*/
+static void *SYSRES_MULTICAST_Writer(void *I__arg)
+	{
+	SYSRES_MULTICAST_RECV_T *rx = I__arg;
+	SYSRES_MULTICAST_PACKET_T *pkt;
+	int n, offset;
+
+	while(1)
+		{
+		pthread_mutex_lock(&rx->lock);
+		while(rx->written == rx->next && !rx->end)
+			pthread_cond_wait(&rx->cond, &rx->lock);
+
+		if(rx->written == rx->next)
+			{ // ended and drained
+			pthread_mutex_unlock(&rx->lock);
+			break;
+			}
+
+		pkt = &rx->window[rx->written % SYSRES_MULTICAST_WINDOW_D];
+		pthread_mutex_unlock(&rx->lock);
+
+		/* the slot is ours until written moves past it */
+		offset = 0;
+		while(offset < pkt->hdr.count && (n = write(SYSRES_MULTICAST_recvFD, &pkt->data[offset], pkt->hdr.count - offset)) > 0)
+			offset += n;
+
+		pthread_mutex_lock(&rx->lock);
+		if(offset != pkt->hdr.count)
+			{ // reader went away
+			rx->failed = 1;
+			pthread_mutex_unlock(&rx->lock);
+			break;
+			}
+
+		rx->present[rx->written++ % SYSRES_MULTICAST_WINDOW_D] = 0;
+		pthread_mutex_unlock(&rx->lock);
+		}
+
+	close(SYSRES_MULTICAST_recvFD); // EOF for the reader; a short stream is caught as truncated
+	SYSRES_MULTICAST_recvFD = -1;
+
+	return(NULL);
+	}
+
+/*----------------------------------------------------------------------------
+** Receiver thread: reorder/repair packets into the window the writer drains,
+** ACKing what has been consumed and NAKing gaps.
+*/
+static void *SYSRES_MULTICAST_Receiver(void *I__arg)
+	{
+	SYSRES_MULTICAST_RECV_T rx = { NULL, NULL, 0, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+	SYSRES_MULTICAST_PACKET_T pkt;
+	struct sockaddr_in sender, from;
+	socklen_t fromLen;
+	struct pollfd pfd;
+	pthread_t writer;
+	unsigned int session = 0, seed = time(NULL) ^ getpid();
+	unsigned long next, written, high = 0, lastAck = 0, lastControl = 0;
+	unsigned long gap = STREAMEND, nakAt = 0, nakWait = 0;
+	unsigned long total = STREAMEND;
+	time_t last = time(NULL);
+	int n, i;
+	char joined = 0, writing = 0, failed;
+	sigset_t mask;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL); // the restore thread handles ctrl-c
+
+	rx.window = malloc(SYSRES_MULTICAST_WINDOW_D * sizeof(SYSRES_MULTICAST_PACKET_T));
+	rx.present = calloc(SYSRES_MULTICAST_WINDOW_D, 1);
+	if(rx.window == NULL || rx.present == NULL)
+		{
+		debug(INFO, 0, "Unable to allocate multicast window\n");
+		goto CLEANUP;
+		}
+
+	if(pthread_create(&writer, NULL, SYSRES_MULTICAST_Writer, &rx))
+		{
+		debug(INFO, 0, "Unable to start multicast writer\n");
+		goto CLEANUP;
+		}
+
+	writing = 1;
+	pfd.fd = SYSRES_MULTICAST_recvSock;
+	pfd.events = POLLIN;
+	while(1)
+		{
+		n = poll(&pfd, 1, 20);
+		pthread_mutex_lock(&rx.lock);
+		next = rx.next;
+		written = rx.written;
+		failed = rx.failed;
+		pthread_mutex_unlock(&rx.lock);
+		if(failed)
+			break;
+
+		while(n > 0)
+			{
+			fromLen = sizeof(from);
+			n = recvfrom(SYSRES_MULTICAST_recvSock, &pkt, sizeof(pkt), MSG_DONTWAIT, (struct sockaddr *)&from, &fromLen);
+			if(n < (int)sizeof(SYSRES_MULTICAST_HDR_T) || !SYSRES_MULTICAST_Decode(&pkt.hdr))
+				continue;
+
+			if(!joined)
+				{
+				if(pkt.hdr.type != SYSRES_MULTICAST_ANNOUNCE_T)
+					continue; // a transfer already under way can't be joined
+
+				sender = from;
+				session = pkt.hdr.session;
+				joined = 1;
+				debug(INFO, 1, "Joining multicast from %s\n", inet_ntoa(sender.sin_addr));
+				}
+
+			if(pkt.hdr.session != session)
+				continue;
+
+			last = time(NULL);
+			switch(pkt.hdr.type)
+				{
+				case SYSRES_MULTICAST_ANNOUNCE_T:
+					SYSRES_MULTICAST_Control(SYSRES_MULTICAST_recvSock, &sender, session, SYSRES_MULTICAST_JOIN_T, 0, 0);
+					break;
+
+				case SYSRES_MULTICAST_END_T:
+					total = pkt.hdr.seq;
+					break;
+
+				case SYSRES_MULTICAST_DATA_T:
+					/* slots from written on are free; the writer still owns those before it */
+					if(pkt.hdr.seq < next || pkt.hdr.seq >= written + SYSRES_MULTICAST_WINDOW_D || pkt.hdr.count > SYSRES_MULTICAST_PAYLOAD_D
+						|| n != (int)(sizeof(SYSRES_MULTICAST_HDR_T) + pkt.hdr.count))
+						break;
+
+					i = pkt.hdr.seq % SYSRES_MULTICAST_WINDOW_D;
+					if(!rx.present[i])
+						{
+						memcpy(&rx.window[i], &pkt, n);
+						rx.present[i] = 1;
+						}
+
+					if(pkt.hdr.seq >= high)
+						high = pkt.hdr.seq + 1;
+					break;
+				}
+			}
+
+		/* everything contiguous goes to the writer */
+		if(next < written + SYSRES_MULTICAST_WINDOW_D && rx.present[next % SYSRES_MULTICAST_WINDOW_D])
+			{
+			while(next < written + SYSRES_MULTICAST_WINDOW_D && rx.present[next % SYSRES_MULTICAST_WINDOW_D])
+				next++;
+
+			pthread_mutex_lock(&rx.lock);
+			rx.next = next;
+			pthread_cond_signal(&rx.cond);
+			pthread_mutex_unlock(&rx.lock);
+			}
+
+		if(!joined)
+			{
+			if(time(NULL) - last > SYSRES_MULTICAST_TIMEOUT_D * 10)
+				{
+				debug(INFO, 0, "No multicast sender found\n");
+				goto CLEANUP;
+				}
+			continue;
+			}
+
+		if(next == total)
+			{
+			for(i = 0; i < 3; i++)
+				SYSRES_MULTICAST_Control(SYSRES_MULTICAST_recvSock, &sender, session, SYSRES_MULTICAST_DONE_T, next, 0);
+
+			debug(INFO, 1, "Multicast receive complete (%lu packets)\n", next);
+			break;
+			}
+
+		if(time(NULL) - last > SYSRES_MULTICAST_TIMEOUT_D)
+			{
+			debug(INFO, 0, "Multicast sender stopped responding\n");
+			break;
+			}
+
+		if(high > next || (total != STREAMEND && total > next))
+			{ // gap, or the tail is missing: NAK it after a random wait, backing off while it stays open
+			if(gap != next)
+				{
+				gap = next;
+				nakWait = SYSRES_MULTICAST_NAKWAIT_D;
+				nakAt = SYSRES_MULTICAST_Now() + rand_r(&seed) % nakWait;
+				}
+			else if(SYSRES_MULTICAST_Now() >= nakAt)
+				{
+				n = ((total != STREAMEND && total > high)?total:high) - next;
+				SYSRES_MULTICAST_Control(SYSRES_MULTICAST_recvSock, &sender, session, SYSRES_MULTICAST_NAK_T, next, (n > SYSRES_MULTICAST_NAKMAX_D)?SYSRES_MULTICAST_NAKMAX_D:n);
+				nakAt = SYSRES_MULTICAST_Now() + nakWait + rand_r(&seed) % nakWait;
+				if(nakWait < SYSRES_MULTICAST_NAKMAXWAIT_D)
+					nakWait *= 2;
+				}
+			}
+
+		if(written - lastAck >= SYSRES_MULTICAST_ACKEVERY_D || SYSRES_MULTICAST_Now() - lastControl >= 500)
+			{
+			lastControl = SYSRES_MULTICAST_Now();
+			SYSRES_MULTICAST_Control(SYSRES_MULTICAST_recvSock, &sender, session, SYSRES_MULTICAST_ACK_T, written, 0);
+			lastAck = written;
+			}
+		}
+
+CLEANUP:
+
+	if(writing)
+		{ // let the writer drain what arrived, then it closes the pipe
+		pthread_mutex_lock(&rx.lock);
+		rx.end = 1;
+		pthread_cond_signal(&rx.cond);
+		pthread_mutex_unlock(&rx.lock);
+		pthread_join(writer, NULL);
+		}
+	else
+		{
+		close(SYSRES_MULTICAST_recvFD); // EOF for the reader; a short stream is caught as truncated
+		SYSRES_MULTICAST_recvFD = -1;
+		}
+
+	close(SYSRES_MULTICAST_recvSock);
+	SYSRES_MULTICAST_recvSock = -1;
+	if(rx.window)
+		free(rx.window);
+
+	if(rx.present)
+		free(rx.present);
+
+	pthread_mutex_destroy(&rx.lock);
+	pthread_cond_destroy(&rx.cond);
+
+	return(NULL);
+	}
+
+/*----------------------------------------------------------------------------
+** Join a multicast group and return a descriptor the archive can be read
+** from sequentially (see readStream()).
+*/
+int SYSRES_MULTICAST_Receive(
+		const char *I__group,
+		int        *O_fd
+		)
+	{
+	int rCode = EXIT_SUCCESS;
+	struct sockaddr_in group, local;
+	struct ip_mreq mreq;
+	int pipeFD[2] = { -1, -1 };
+	int reuse = 1;
+	int bufSize = SYSRES_MULTICAST_WINDOW_D * SYSRES_MULTICAST_PAYLOAD_D;
+	pthread_t tid;
+
+	if((rCode = SYSRES_MULTICAST_Address(I__group, &group)))
+		goto CLEANUP;
+
+	errno = EXIT_SUCCESS;
+	if((SYSRES_MULTICAST_recvSock = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+		{
+		rCode = errno;
+		goto CLEANUP;
+		}
+
+	setsockopt(SYSRES_MULTICAST_recvSock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+	setsockopt(SYSRES_MULTICAST_recvSock, SOL_SOCKET, SO_RCVBUF, &bufSize, sizeof(bufSize)); // ride out slow pipe writes
+	bzero(&local, sizeof(local));
+	local.sin_family = AF_INET;
+	local.sin_addr.s_addr = htonl(INADDR_ANY);
+	local.sin_port = group.sin_port;
+	if(bind(SYSRES_MULTICAST_recvSock, (struct sockaddr *)&local, sizeof(local)))
+		{
+		rCode = errno;
+		goto CLEANUP;
+		}
+
+	mreq.imr_multiaddr = group.sin_addr;
+	mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+	if(setsockopt(SYSRES_MULTICAST_recvSock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)))
+		{
+		rCode = errno;
+		goto CLEANUP;
+		}
+
+	if(pipe(pipeFD))
+		{
+		rCode = errno;
+		goto CLEANUP;
+		}
+
+	SYSRES_MULTICAST_recvFD = pipeFD[1];
+	if((rCode = pthread_create(&tid, NULL, SYSRES_MULTICAST_Receiver, NULL)))
+		goto CLEANUP;
+
+	pthread_detach(tid);
+	debug(INFO, 1, "Listening for multicast on %s\n", I__group);
+
+//RESULTS:
+	*O_fd = pipeFD[0];
+	pipeFD[0] = pipeFD[1] = -1;
+
+CLEANUP:
+
+	if(rCode)
+		{
+		debug(INFO, 0, "Unable to join multicast group %s [%i]\n", I__group, rCode);
+		if(SYSRES_MULTICAST_recvSock != -1)
+			close(SYSRES_MULTICAST_recvSock);
+
+		SYSRES_MULTICAST_recvSock = SYSRES_MULTICAST_recvFD = -1;
+		if(pipeFD[0] != -1)
+			{
+			close(pipeFD[0]);
+			close(pipeFD[1]);
+			}
+		}
+
+	return(rCode);
+	}
@@ -0,0 +1,49 @@
+/*****************************************************************************
+* sysres "System Restore" Partition backup and restore utility.
+* Copyright © 2019-2020 Micro Focus or one of its affiliates.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along
+* with this program; if not, write to the Free Software Foundation, Inc.,
+* 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef _SYSRES_MULTICAST_H_
+ #define _SYSRES_MULTICAST_H_
+
+/*----------------------------------------------------------------------------
+** Macro values
+*/
+#define SYSRES_MULTICAST_PREFIX_D   "mcast://"  // source=mcast://<group>[:<port>]
+#define SYSRES_MULTICAST_PORT_D     9000        // default port
+#define SYSRES_MULTICAST_PAYLOAD_D  1400        // archive bytes per datagram (fits a 1500 MTU)
+#define SYSRES_MULTICAST_WINDOW_D   8192        // packets kept for repair; also the flow-control window
+#define SYSRES_MULTICAST_CLIENTS_D  64          // receivers tracked by one sender
+#define SYSRES_MULTICAST_ANNOUNCE_D 10          // seconds to wait for receivers when clients= isn't given
+#define SYSRES_MULTICAST_TIMEOUT_D  30          // seconds of silence before a peer is given up on
+
+/*----------------------------------------------------------------------------
+** Function prototypes.
+*/
+extern int SYSRES_MULTICAST_Send(
+		char       *I__source,
+		const char *I__group,
+		int         I__clients,
+		int         I__rate
+		);
+
+extern int SYSRES_MULTICAST_Receive(
+		const char *I__group,
+		int        *O_fd
+		);
+
+#endif /* _SYSRES_MULTICAST_H_ */
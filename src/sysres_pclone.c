@@ -0,0 +1,1001 @@
+/*****************************************************************************
+* sysres "System Restore" Partition backup and restore utility.
+* Copyright © 2019-2020 Micro Focus or one of its affiliates.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along
+* with this program; if not, write to the Free Software Foundation, Inc.,
+* 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/*----------------------------------------------------------------------------
+** Runs the partclone engine on a thread of this process rather than in a
+** forked child, so it costs no fork/exec/waitpid and the engine's failure
+** comes back as a pthread_join() value.
+**
+** A backup only has partclone read the filesystem: SYSRES_PCLONE_Map() runs
+** the engine until it has built its used-block bitmap and written its image
+** descriptor, takes both (the bitmap as a block map) and lets it end there.
+** sysres then sends the image stream itself, byte for byte what partclone
+** would have sent: the descriptor, the bitmap and its crc, then the used
+** blocks in order with partclone's checksums between them. Several readers
+** pull coalesced extents of used blocks into pool buffers ahead of the
+** stream, so the device sees several large requests in flight and the data
+** reaches the archive with one copy and no pipe.
+**
+** A restore whose image sysres doesn't parse itself (see restore.c) is still
+** fed to partclone through a pipe.
+**
+** partclone keeps its options and state in globals, so only one engine may
+** run on a thread at a time: Map() calls take turns, and parallel restore jobs
+** run their engines in child processes.
+*/
+
+/*----------------------------------------------------------------------------
+** Compiler setup.
+*/
+  /* ANSI/POSIX */
+  #define _GNU_SOURCE            // F_SETPIPE_SZ, memfd_create(), pthread_timedjoin_np()
+  #include <errno.h>             // errno
+  #include <fcntl.h>             // F_SETPIPE_SZ
+  #include <stdio.h>             // NULL
+  #include <signal.h>            // sigset_t
+  #include <stdlib.h>            // EXIT_SUCCESS
+  #include <string.h>            // memcpy()
+  #include <time.h>              // clock_gettime()
+  #include <unistd.h>            // pipe(), pread64(), fork()
+  #include <sys/mman.h>          // memfd_create()
+  #include <sys/wait.h>          // waitpid()
+#if defined(__x86_64__)
+  #include <nmmintrin.h>         // _mm_crc32_u64()
+#endif
+
+  /* partclone */
+#ifdef PARTCLONE
+  #include <libpartclone.h>      // LIBPARTCLONE_MainEntry()
+#endif
+
+  /* System Restore */
+  #include "partition.h"         // INFO
+  #include "sysres_debug.h"      // debug()
+  #include "sysres_pclone.h"     // Validate self-compatibility.
+  #include "sysres_signal.h"     // SYSRES_SIGNAL_hasInterrupted
+
+/*----------------------------------------------------------------------------
+** Storage
+*/
+extern volatile sig_atomic_t has_interrupted;
+
+#define SYSRES_PCLONE_HEAD_S   0       // stream stages: descriptor and bitmap,
+#define SYSRES_PCLONE_DATA_S   1       // used blocks and their checksums,
+#define SYSRES_PCLONE_END_S    2       // all sent
+
+#define SYSRES_PCLONE_STOP(v) __atomic_store_n(&LIBPARTCLONE_stop,v,__ATOMIC_RELEASE) // the engine polls it
+
+static pthread_mutex_t        SYSRES_PCLONE_engineLock = PTHREAD_MUTEX_INITIALIZER;
+static SYSRES_PCLONE_IMAGE_T *SYSRES_PCLONE_image;   // what the running Map() fills in
+static int                    SYSRES_PCLONE_hooked;  // 0 once the hook has its bitmap
+static pthread_once_t         SYSRES_PCLONE_once = PTHREAD_ONCE_INIT;
+static unsigned int           SYSRES_PCLONE_table[256];   // CRC32
+static unsigned int           SYSRES_PCLONE_tableC[256];  // CRC32C, when the CPU has no crc32 instruction
+static bool                   SYSRES_PCLONE_sse42;
+
+/*----------------------------------------------------------------------------
+** partclone's CRC32: reflected 0xEDB88320, started at 0xFFFFFFFF, no final
+** xor. It covers the descriptor and the bitmap, and the blocks of images
+** partclone checksummed itself. Blocks that sysres checksums use CRC32C
+** (reflected 0x82F63B78, seeded and reseeded the same way), which SSE4.2 does
+** 8 bytes per instruction; the descriptor says which (checksum_mode).
+*/
+static void SYSRES_PCLONE_Table(void)
+	{
+	unsigned int i, j, crc, crcC;
+
+	for(i = 0; i < 256; i++)
+		{
+		for(crc = crcC = i, j = 0; j < 8; j++)
+			{
+			crc  = (crc & 1) ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+			crcC = (crcC & 1) ? (crcC >> 1) ^ 0x82F63B78 : crcC >> 1;
+			}
+
+		SYSRES_PCLONE_table[i]  = crc;
+		SYSRES_PCLONE_tableC[i] = crcC;
+		}
+
+#if defined(__x86_64__)
+	SYSRES_PCLONE_sse42 = __builtin_cpu_supports("sse4.2");
+#endif
+
+	return;
+	}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static unsigned int SYSRES_PCLONE_Crc32cHw(
+		unsigned int         I__crc,
+		const unsigned char *I__buf,
+		size_t               I__size
+		)
+	{
+	unsigned long long crc = I__crc, word;
+
+	for(; I__size >= 8; I__size -= 8, I__buf += 8)
+		{
+		memcpy(&word, I__buf, 8);
+		crc = _mm_crc32_u64(crc, word);
+		}
+
+	while(I__size--)
+		crc = _mm_crc32_u8(crc, *I__buf++);
+
+	return(crc);
+	}
+#endif
+
+unsigned int SYSRES_PCLONE_Crc32c(
+		unsigned int         I__crc,
+		const unsigned char *I__buf,
+		size_t               I__size
+		)
+	{
+	pthread_once(&SYSRES_PCLONE_once, SYSRES_PCLONE_Table);
+#if defined(__x86_64__)
+	if(SYSRES_PCLONE_sse42)
+		return(SYSRES_PCLONE_Crc32cHw(I__crc, I__buf, I__size));
+#endif
+
+	while(I__size--)
+		I__crc = SYSRES_PCLONE_tableC[(I__crc ^ *I__buf++) & 0xFF] ^ (I__crc >> 8);
+
+	return(I__crc);
+	}
+
+unsigned int SYSRES_PCLONE_Crc32(
+		unsigned int         I__crc,
+		const unsigned char *I__buf,
+		size_t               I__size
+		)
+	{
+	pthread_once(&SYSRES_PCLONE_once, SYSRES_PCLONE_Table);
+	while(I__size--)
+		I__crc = SYSRES_PCLONE_table[(I__crc ^ *I__buf++) & 0xFF] ^ (I__crc >> 8);
+
+	return(I__crc);
+	}
+
+#ifdef PARTCLONE
+/*----------------------------------------------------------------------------
+** libpartclone bitmap hook, on the engine thread: keep the bitmap as a block
+** map. The engine writes its descriptor and ends once this returns.
+*/
+static void SYSRES_PCLONE_Hook(
+		unsigned long      *I__bitmap,
+		unsigned long long  I__blocks,
+		unsigned int        I__blockSize
+		)
+	{
+	SYSRES_PCLONE_IMAGE_T *image = SYSRES_PCLONE_image;
+	unsigned long          c;
+
+	image->totalBlocks = I__blocks;
+	image->blockSize   = I__blockSize;
+	if((SYSRES_PCLONE_hooked = SYSRES_BLOCKMAP_Init(&image->map, I__blocks)))
+		return;
+
+	for(c = 0; c < image->map.chunks; c++)
+		{
+		if((SYSRES_PCLONE_hooked = SYSRES_BLOCKMAP_Load(&image->map, c, (unsigned char *)I__bitmap + c * SYSRES_BLOCKMAP_BYTES_D)))
+			return;
+		}
+
+	return;
+	}
+#endif
+
+/*----------------------------------------------------------------------------
+** Engine thread.
+*/
+static void *SYSRES_PCLONE_Engine(void *I__arg)
+	{
+#ifdef PARTCLONE
+	SYSRES_PCLONE_ENGINE_T *engine = I__arg;
+#endif
+	long     rCode = EXIT_SUCCESS;
+	sigset_t mask;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL); // the calling thread handles ctrl-c
+
+#ifdef PARTCLONE
+	rCode = LIBPARTCLONE_MainEntry(engine->type, engine->fd, engine->argc, engine->argv);
+#endif
+
+	return((void *)rCode);
+	}
+
+/*----------------------------------------------------------------------------
+** Check the descriptor partclone wrote against the bitmap it handed over,
+** and take the image layout from it.
+*/
+static int SYSRES_PCLONE_Describe(
+		SYSRES_PCLONE_IMAGE_T *IO_image
+		)
+	{
+	unsigned char      *desc = IO_image->desc;
+	unsigned long long  total;
+	unsigned int        crc, blockSize, span;
+	unsigned short      magic, mode, size;
+
+	memcpy(&magic, &desc[34], 2);
+	memcpy(&crc, &desc[106], 4);
+	if(memcmp(desc, "partclone-image", 15) || memcmp(&desc[30], "0002", 4) || magic != 0xC0DE
+		|| crc != SYSRES_PCLONE_Crc32(0xFFFFFFFF, desc, 106))
+		return(EINVAL);
+
+	memcpy(&IO_image->deviceSize, &desc[52], 8);
+	memcpy(&total, &desc[60], 8);
+	memcpy(&IO_image->usedBlocks, &desc[68], 8);
+	memcpy(&blockSize, &desc[84], 4);
+	memcpy(&mode, &desc[96], 2);
+	memcpy(&size, &desc[98], 2);
+	memcpy(&span, &desc[100], 4);
+	if(total != IO_image->totalBlocks || blockSize != IO_image->blockSize || !blockSize
+		|| IO_image->usedBlocks != IO_image->map.used || desc[105] != SYSRES_PCLONE_BM_BIT_D)
+		return(EINVAL);
+
+	if(mode == SYSRES_PCLONE_CSM_NONE_D)
+		IO_image->sumBlocks = 0;
+	else if(mode == SYSRES_PCLONE_CSM_CRC32_D && size == SYSRES_PCLONE_CRC_D && span && desc[104])
+		IO_image->sumBlocks = span; // reseeded per span, as partclone does by default
+	else
+		return(EINVAL);
+
+	return(0);
+	}
+
+/*----------------------------------------------------------------------------
+** Run the engine for a backup of I__argv's device until it has the used-block
+** bitmap and the image descriptor. Waits its turn behind any other Map() and
+** polls for ctrl-c (and I__cancel, when given) while the engine scans.
+*/
+int SYSRES_PCLONE_Map(
+		int                     I__type,
+		int                     I__argc,
+		char                  **I__argv,
+		bool                  (*I__cancel)(void),
+		SYSRES_PCLONE_IMAGE_T  *O_image
+		)
+	{
+	SYSRES_PCLONE_ENGINE_T engine;
+	struct timespec        deadline;
+	void                  *result = NULL;
+	bool                   cancelled = false;
+	unsigned int           crc;
+	unsigned short         mode;
+	int                    rCode;
+
+	memset(O_image, 0, sizeof(SYSRES_PCLONE_IMAGE_T));
+	if((engine.fd = memfd_create("pclone", 0)) == -1)
+		return(errno);
+
+	engine.pid  = 0;
+	engine.type = I__type;
+	engine.argc = I__argc;
+	engine.argv = I__argv;
+
+	pthread_mutex_lock(&SYSRES_PCLONE_engineLock);
+	SYSRES_PCLONE_image  = O_image;
+	SYSRES_PCLONE_hooked = -1;
+#ifdef PARTCLONE
+	LIBPARTCLONE_threaded = 1;
+	SYSRES_PCLONE_STOP(0);
+	LIBPARTCLONE_SetBitmapHook(SYSRES_PCLONE_Hook);
+#endif
+	if((rCode = pthread_create(&engine.tid, NULL, SYSRES_PCLONE_Engine, &engine)))
+		goto UNLOCK;
+
+	do
+		{
+		if(!cancelled && (SYSRES_SIGNAL_hasInterrupted || has_interrupted || (I__cancel && I__cancel())))
+			{
+			if(SYSRES_SIGNAL_hasInterrupted)
+				has_interrupted = 1;
+
+#ifdef PARTCLONE
+			SYSRES_PCLONE_STOP(1); // it ends at its next bitmap group
+#endif
+			cancelled = true;
+			}
+
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += SYSRES_PCLONE_POLL_D * 1000000L;
+		deadline.tv_sec  += deadline.tv_nsec / 1000000000L;
+		deadline.tv_nsec %= 1000000000L;
+		}
+	while((rCode = pthread_timedjoin_np(engine.tid, &result, &deadline)) == ETIMEDOUT);
+
+	if(!rCode && cancelled)
+		rCode = EINTR;
+	else if(!rCode && result != NULL)
+		rCode = EIO; // partclone's own exit code; it has logged why
+	else if(!rCode && SYSRES_PCLONE_hooked)
+		rCode = (SYSRES_PCLONE_hooked == -1) ? EPROTO : SYSRES_PCLONE_hooked;
+
+UNLOCK:
+
+#ifdef PARTCLONE
+	LIBPARTCLONE_SetBitmapHook(NULL);
+#endif
+	SYSRES_PCLONE_image = NULL;
+	pthread_mutex_unlock(&SYSRES_PCLONE_engineLock);
+
+	if(!rCode && pread64(engine.fd, O_image->desc, SYSRES_PCLONE_DESC_D, 0) != SYSRES_PCLONE_DESC_D)
+		rCode = EPROTO;
+
+	if(!rCode && (rCode = SYSRES_PCLONE_Describe(O_image)))
+		debug(INFO, 1, "Unrecognized partclone image descriptor\n");
+
+	if(!rCode && O_image->sumBlocks)
+		{ // we checksum the blocks, in CRC32C; the descriptor says so
+		mode = SYSRES_PCLONE_CSM_CRC32C_D;
+		memcpy(&O_image->desc[96], &mode, 2);
+		crc = SYSRES_PCLONE_Crc32(0xFFFFFFFF, O_image->desc, 106);
+		memcpy(&O_image->desc[106], &crc, 4);
+		}
+
+	close(engine.fd);
+	if(rCode)
+		SYSRES_PCLONE_Release(O_image);
+
+	return(rCode);
+	}
+
+/*----------------------------------------------------------------------------
+** Size of the image stream.
+*/
+unsigned long long SYSRES_PCLONE_Bytes(
+		SYSRES_PCLONE_IMAGE_T *I__image
+		)
+	{
+	unsigned long long sums = 0;
+
+	if(I__image->sumBlocks)
+		sums = (I__image->usedBlocks + I__image->sumBlocks - 1) / I__image->sumBlocks;
+
+	return(SYSRES_PCLONE_DESC_D + (I__image->totalBlocks + 7) / 8 + SYSRES_PCLONE_CRC_D
+		+ I__image->usedBlocks * I__image->blockSize + sums * SYSRES_PCLONE_CRC_D);
+	}
+
+/*----------------------------------------------------------------------------
+**
+*/
+void SYSRES_PCLONE_Release(
+		SYSRES_PCLONE_IMAGE_T *IO_image
+		)
+	{
+	SYSRES_BLOCKMAP_Free(&IO_image->map);
+
+	return;
+	}
+
+/*----------------------------------------------------------------------------
+** Claim the next run of used blocks, reading through free gaps shorter than
+** SYSRES_PCLONE_GAP_D rather than splitting the request. Called locked.
+*/
+static bool SYSRES_PCLONE_Claim(
+		SYSRES_PCLONE_STREAM_T *IO_stream,
+		unsigned long long     *O_start,
+		unsigned long long     *O_end
+		)
+	{
+	SYSRES_BLOCKMAP_T  *map   = &IO_stream->image->map;
+	unsigned long long  limit = SYSRES_PCLONE_EXTENT_D / IO_stream->image->blockSize;
+	unsigned long long  gap   = SYSRES_PCLONE_GAP_D / IO_stream->image->blockSize;
+	unsigned long long  n = IO_stream->next, end, used;
+
+	if(!SYSRES_BLOCKMAP_Next(map, &n, &end))
+		return(false);
+
+	*O_start = n;
+	used = (end - n > limit) ? n + limit : end;
+	while(used - *O_start < limit)
+		{
+		n = used;
+		if(!SYSRES_BLOCKMAP_Next(map, &n, &end) || n - used > gap)
+			break;
+
+		used = (end - *O_start > limit) ? *O_start + limit : end;
+		}
+
+	*O_end = used;
+	IO_stream->next = used;
+
+	return(true);
+	}
+
+/*----------------------------------------------------------------------------
+** One queue of the used-block reader: claims extents in block order, each
+** into the next free slot, while the stream is fewer than SLOTS_D behind.
+*/
+static void *SYSRES_PCLONE_Reader(void *I__arg)
+	{
+	SYSRES_PCLONE_STREAM_T *stream = I__arg;
+	SYSRES_PCLONE_SLOT_T   *slot;
+	unsigned long long      start, end;
+	unsigned int            size = stream->image->blockSize;
+	size_t                  done, length;
+	ssize_t                 n = 0;
+	sigset_t                mask;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL); // the calling thread handles ctrl-c
+
+	pthread_mutex_lock(&stream->lock);
+	while(!stream->stop)
+		{
+		if(stream->claimed - stream->taken >= (unsigned long)stream->slots)
+			{
+			pthread_cond_wait(&stream->cond, &stream->lock);
+			continue;
+			}
+
+		if(!SYSRES_PCLONE_Claim(stream, &start, &end))
+			break;
+
+		slot = &stream->slot[stream->claimed++ % stream->slots];
+		slot->start = start;
+		slot->end   = end;
+		slot->error = -1;
+		pthread_mutex_unlock(&stream->lock);
+
+		length = (end - start) * size;
+		for(done = 0; done < length; done += n)
+			{
+			if((n = pread64(stream->fd, slot->io->data + done, length - done, start * size + done)) <= 0)
+				break;
+			}
+
+		posix_fadvise(stream->fd, start * size, length, POSIX_FADV_DONTNEED); // it's in the slot now
+
+		pthread_mutex_lock(&stream->lock);
+		slot->error = (done == length) ? 0 : (n < 0) ? errno : EIO;
+		pthread_cond_broadcast(&stream->cond);
+		}
+
+	stream->threads--; // the last one out tells the stream there's nothing more
+	pthread_cond_broadcast(&stream->cond);
+	pthread_mutex_unlock(&stream->lock);
+
+	return(NULL);
+	}
+
+/*----------------------------------------------------------------------------
+** Start the readers of a backup stream of I__image from I__device.
+*/
+int SYSRES_PCLONE_Open(
+		SYSRES_PCLONE_IMAGE_T  *I__image,
+		char                   *I__device,
+		SYSRES_PCLONE_STREAM_T *O_stream
+		)
+	{
+	int i;
+
+	memset(O_stream, 0, sizeof(SYSRES_PCLONE_STREAM_T));
+	O_stream->image = I__image;
+	if((O_stream->fd = open(I__device, O_RDONLY | O_LARGEFILE)) == -1)
+		return(errno);
+
+	for(O_stream->slots = 0; O_stream->slots < SYSRES_PCLONE_SLOTS_D; O_stream->slots++)
+		{ // waits for the first; the others only if the pool has them to spare
+		if(NULL == (O_stream->slot[O_stream->slots].io = poolGet(!O_stream->slots)))
+			break;
+		}
+
+	memcpy(O_stream->pend, I__image->desc, SYSRES_PCLONE_DESC_D);
+	O_stream->pendLen = SYSRES_PCLONE_DESC_D;
+	O_stream->crc     = 0xFFFFFFFF;
+	O_stream->stage   = SYSRES_PCLONE_HEAD_S;
+
+	pthread_mutex_init(&O_stream->lock, NULL);
+	pthread_cond_init(&O_stream->cond, NULL);
+	pthread_mutex_lock(&O_stream->lock);
+	for(i = 0; i < SYSRES_PCLONE_QUEUES_D && i < O_stream->slots; i++)
+		{
+		if(!pthread_create(&O_stream->tid[i], NULL, SYSRES_PCLONE_Reader, O_stream))
+			O_stream->threads++;
+		}
+
+	i = O_stream->threads;
+	pthread_mutex_unlock(&O_stream->lock);
+	if(!i)
+		{
+		SYSRES_PCLONE_Close(O_stream);
+		return(EAGAIN);
+		}
+
+	debug(INFO, 3, "Used-block reader: %i queues, %i slots, %llu of %llu blocks of %u\n", i, O_stream->slots, I__image->usedBlocks, I__image->totalBlocks, I__image->blockSize);
+
+	return(0);
+	}
+
+/*----------------------------------------------------------------------------
+** Move to the next run of used blocks, waiting for its slot to be read.
+** Returns 1 with a run, 0 at the end of the blocks, -1 on error (errno EINTR,
+** with has_interrupted set, for ctrl-c).
+*/
+static int SYSRES_PCLONE_Advance(
+		SYSRES_PCLONE_STREAM_T *IO_stream
+		)
+	{
+	SYSRES_PCLONE_SLOT_T *slot;
+	unsigned long long    block, end;
+	unsigned int          size = IO_stream->image->blockSize;
+	struct timespec       deadline;
+	int                   error;
+
+	while(1)
+		{
+		slot = &IO_stream->slot[IO_stream->taken % IO_stream->slots];
+		if(IO_stream->runEnd)
+			{ // in a slot: its next run, if any
+			block = slot->start + IO_stream->pos / size;
+			if(SYSRES_BLOCKMAP_Next(&IO_stream->image->map, &block, &end) && block < slot->end)
+				{
+				IO_stream->pos    = (block - slot->start) * size;
+				IO_stream->runEnd = (((end < slot->end) ? end : slot->end) - slot->start) * size;
+				return(1);
+				}
+
+			pthread_mutex_lock(&IO_stream->lock);
+			IO_stream->taken++;
+			IO_stream->pos = IO_stream->runEnd = 0;
+			pthread_cond_broadcast(&IO_stream->cond);
+			pthread_mutex_unlock(&IO_stream->lock);
+			continue;
+			}
+
+		pthread_mutex_lock(&IO_stream->lock);
+		while((IO_stream->taken == IO_stream->claimed && IO_stream->threads)
+			|| (IO_stream->taken < IO_stream->claimed && slot->error == -1))
+			{
+			if(SYSRES_SIGNAL_hasInterrupted || has_interrupted)
+				{
+				pthread_mutex_unlock(&IO_stream->lock);
+				has_interrupted = 1;
+				errno = EINTR;
+				return(-1);
+				}
+
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_nsec += SYSRES_PCLONE_POLL_D * 1000000L;
+			deadline.tv_sec  += deadline.tv_nsec / 1000000000L;
+			deadline.tv_nsec %= 1000000000L;
+			pthread_cond_timedwait(&IO_stream->cond, &IO_stream->lock, &deadline);
+			}
+
+		error = (IO_stream->taken == IO_stream->claimed) ? -1 : slot->error;
+		pthread_mutex_unlock(&IO_stream->lock);
+		if(error == -1)
+			return(0); // every extent has been sent
+
+		if(error)
+			{
+			errno = error;
+			return(-1);
+			}
+
+		// a slot starts on a used block, so its first run starts there
+		block = slot->start;
+		SYSRES_BLOCKMAP_Next(&IO_stream->image->map, &block, &end);
+		IO_stream->pos    = 0;
+		IO_stream->runEnd = (((end < slot->end) ? end : slot->end) - slot->start) * size;
+		return(1);
+		}
+	}
+
+/*----------------------------------------------------------------------------
+** Fill O_buf with the next I__size bytes of the image stream (fewer only at
+** its end). Returns the bytes filled, or -1 with errno set.
+*/
+int SYSRES_PCLONE_Stream(
+		SYSRES_PCLONE_STREAM_T *IO_stream,
+		unsigned char          *O_buf,
+		size_t                  I__size
+		)
+	{
+	SYSRES_PCLONE_IMAGE_T *image = IO_stream->image;
+	unsigned long long     span = (unsigned long long)image->sumBlocks * image->blockSize;
+	size_t                 done = 0, n;
+	int                    run;
+
+	while(done < I__size)
+		{
+		if(IO_stream->pendOff < IO_stream->pendLen)
+			{ // descriptor, bitmap or a checksum
+			n = IO_stream->pendLen - IO_stream->pendOff;
+			if(n > I__size - done)
+				n = I__size - done;
+
+			memcpy(&O_buf[done], &IO_stream->pend[IO_stream->pendOff], n);
+			IO_stream->pendOff += n;
+			done += n;
+			continue;
+			}
+
+		IO_stream->pendOff = IO_stream->pendLen = 0;
+		if(IO_stream->stage == SYSRES_PCLONE_END_S)
+			break;
+
+		if(IO_stream->stage == SYSRES_PCLONE_HEAD_S)
+			{
+			if(IO_stream->chunk < image->map.chunks)
+				{
+				IO_stream->pendLen = SYSRES_BLOCKMAP_Bits(&image->map, IO_stream->chunk++, IO_stream->pend);
+				IO_stream->crc = SYSRES_PCLONE_Crc32(IO_stream->crc, IO_stream->pend, IO_stream->pendLen);
+				continue;
+				}
+
+			memcpy(IO_stream->pend, &IO_stream->crc, SYSRES_PCLONE_CRC_D);
+			IO_stream->pendLen = SYSRES_PCLONE_CRC_D;
+			IO_stream->crc     = 0xFFFFFFFF;
+			IO_stream->stage   = SYSRES_PCLONE_DATA_S;
+			continue;
+			}
+
+		if(IO_stream->pos == IO_stream->runEnd)
+			{
+			if((run = SYSRES_PCLONE_Advance(IO_stream)) < 0)
+				return(-1);
+
+			if(!run)
+				{ // the last blocks' checksum, when they didn't fill a span
+				if(IO_stream->spanBytes)
+					{
+					memcpy(IO_stream->pend, &IO_stream->crc, SYSRES_PCLONE_CRC_D);
+					IO_stream->pendLen = SYSRES_PCLONE_CRC_D;
+					}
+
+				IO_stream->stage = SYSRES_PCLONE_END_S;
+				continue;
+				}
+			}
+
+		n = IO_stream->runEnd - IO_stream->pos;
+		if(n > I__size - done)
+			n = I__size - done;
+
+		if(span && n > span - IO_stream->spanBytes)
+			n = span - IO_stream->spanBytes;
+
+		memcpy(&O_buf[done], IO_stream->slot[IO_stream->taken % IO_stream->slots].io->data + IO_stream->pos, n);
+		IO_stream->pos += n;
+		if(span)
+			{
+			IO_stream->crc = SYSRES_PCLONE_Crc32c(IO_stream->crc, &O_buf[done], n);
+			if((IO_stream->spanBytes += n) == span)
+				{
+				memcpy(IO_stream->pend, &IO_stream->crc, SYSRES_PCLONE_CRC_D);
+				IO_stream->pendLen   = SYSRES_PCLONE_CRC_D;
+				IO_stream->crc       = 0xFFFFFFFF;
+				IO_stream->spanBytes = 0;
+				}
+			}
+
+		done += n;
+		}
+
+	return(done);
+	}
+
+/*----------------------------------------------------------------------------
+** Stop the readers and give back the slots.
+*/
+void SYSRES_PCLONE_Close(
+		SYSRES_PCLONE_STREAM_T *IO_stream
+		)
+	{
+	int i;
+
+	pthread_mutex_lock(&IO_stream->lock);
+	IO_stream->stop = true;
+	pthread_cond_broadcast(&IO_stream->cond);
+	pthread_mutex_unlock(&IO_stream->lock);
+	for(i = 0; i < SYSRES_PCLONE_QUEUES_D && i < IO_stream->slots; i++)
+		{
+		if(IO_stream->tid[i])
+			pthread_join(IO_stream->tid[i], NULL);
+		}
+
+	for(i = 0; i < IO_stream->slots; i++)
+		poolPut(IO_stream->slot[i].io);
+
+	IO_stream->slots = 0;
+	pthread_mutex_destroy(&IO_stream->lock);
+	pthread_cond_destroy(&IO_stream->cond);
+	close(IO_stream->fd);
+
+	return;
+	}
+
+/*----------------------------------------------------------------------------
+** partclone only knows CRC32 block checksums. For a CRC32C image that it has
+** to restore, StripStart() marks the descriptor (IO_desc, as read from the
+** archive) as carrying none, and Strip() checks each span's checksum and
+** takes it out of the stream. False when the image isn't one of those.
+*/
+bool SYSRES_PCLONE_StripStart(
+		unsigned char         *IO_desc,
+		SYSRES_PCLONE_STRIP_T *O_strip
+		)
+	{
+	unsigned long long total, used;
+	unsigned int       blockSize, span, crc;
+	unsigned short     mode;
+
+	memcpy(&mode, &IO_desc[96], 2);
+	memcpy(&crc, &IO_desc[106], 4);
+	memcpy(&total, &IO_desc[60], 8);
+	memcpy(&used, &IO_desc[68], 8);
+	memcpy(&blockSize, &IO_desc[84], 4);
+	memcpy(&span, &IO_desc[100], 4);
+	if(mode != SYSRES_PCLONE_CSM_CRC32C_D || !span || crc != SYSRES_PCLONE_Crc32(0xFFFFFFFF, IO_desc, 106))
+		return(false);
+	O_strip->skip      = (total + 7) / 8 + SYSRES_PCLONE_CRC_D;
+	O_strip->left      = used * blockSize;
+	O_strip->span      = (unsigned long long)span * blockSize;
+	O_strip->spanBytes = 0;
+	O_strip->crc       = 0xFFFFFFFF;
+	O_strip->sumLen    = -1;
+
+	mode = SYSRES_PCLONE_CSM_NONE_D;
+	memset(&IO_desc[96], 0, 8); // mode, size and span
+	crc = SYSRES_PCLONE_Crc32(0xFFFFFFFF, IO_desc, 106);
+	memcpy(&IO_desc[106], &crc, 4);
+
+	return(true);
+	}
+
+/*----------------------------------------------------------------------------
+** Returns the bytes left in IO_buf, or -1 when a checksum doesn't match.
+*/
+int SYSRES_PCLONE_Strip(
+		SYSRES_PCLONE_STRIP_T *IO_strip,
+		unsigned char         *IO_buf,
+		int                    I__len
+		)
+	{
+	unsigned long long n;
+	int                in = 0, out = 0;
+
+	while(in < I__len)
+		{
+		if(IO_strip->sumLen >= 0)
+			{ // a checksum, maybe split between buffers
+			while(in < I__len && IO_strip->sumLen < SYSRES_PCLONE_CRC_D)
+				IO_strip->sum[IO_strip->sumLen++] = IO_buf[in++];
+
+			if(IO_strip->sumLen < SYSRES_PCLONE_CRC_D)
+				break;
+
+			if(memcmp(IO_strip->sum, &IO_strip->crc, SYSRES_PCLONE_CRC_D))
+				return(-1);
+
+			IO_strip->crc       = 0xFFFFFFFF;
+			IO_strip->spanBytes = 0;
+			IO_strip->sumLen    = -1;
+			continue;
+			}
+
+		n = I__len - in;
+		if(IO_strip->skip)
+			{
+			if(n > IO_strip->skip)
+				n = IO_strip->skip;
+
+			IO_strip->skip -= n;
+			}
+		else if(IO_strip->left)
+			{
+			if(n > IO_strip->left)
+				n = IO_strip->left;
+
+			if(n > IO_strip->span - IO_strip->spanBytes)
+				n = IO_strip->span - IO_strip->spanBytes;
+
+			IO_strip->crc = SYSRES_PCLONE_Crc32c(IO_strip->crc, &IO_buf[in], n);
+			IO_strip->left -= n;
+			if((IO_strip->spanBytes += n) == IO_strip->span || !IO_strip->left)
+				IO_strip->sumLen = 0;
+			}
+
+		memmove(&IO_buf[out], &IO_buf[in], n);
+		in  += n;
+		out += n;
+		}
+
+	return(out);
+	}
+
+/*----------------------------------------------------------------------------
+** Start a restore engine on a thread; *O_fd is our end of its pipe.
+*/
+int SYSRES_PCLONE_Start(
+		int                     I__argc,
+		char                  **I__argv,
+		SYSRES_PCLONE_ENGINE_T *O_engine,
+		int                    *O_fd
+		)
+	{
+	int rCode = EXIT_SUCCESS;
+	int pipeFD[2] = { -1, -1 };
+
+	if(pipe(pipeFD))
+		{
+		rCode = errno;
+		goto CLEANUP;
+		}
+
+	if(fcntl(pipeFD[0], F_SETPIPE_SZ, SYSRES_PCLONE_PIPE_D) == -1)
+		debug(INFO, 3, "Pipe left at default size [%i]\n", errno);
+
+	O_engine->pid  = 0;
+	O_engine->type = 0; // a restore takes the filesystem from the image
+	O_engine->argc = I__argc;
+	O_engine->argv = I__argv;
+	O_engine->fd   = pipeFD[0];
+
+#ifdef PARTCLONE
+	LIBPARTCLONE_threaded = 1;
+	SYSRES_PCLONE_STOP(0);
+#endif
+	SYSRES_SIGNAL_hasInterrupted = 0;
+	if((rCode = pthread_create(&O_engine->tid, NULL, SYSRES_PCLONE_Engine, O_engine)))
+		goto CLEANUP;
+
+//RESULTS:
+	*O_fd = pipeFD[1];
+	pipeFD[0] = pipeFD[1] = -1;
+
+CLEANUP:
+
+	if(pipeFD[0] != -1)
+		close(pipeFD[0]);
+
+	if(pipeFD[1] != -1)
+		close(pipeFD[1]);
+
+	return(rCode);
+	}
+
+/*----------------------------------------------------------------------------
+** Start a restore engine in a child process. partclone keeps its state in
+** globals, so only one engine can run as a thread; parallel restore jobs run
+** theirs here. The child leaves ctrl-c to us.
+*/
+int SYSRES_PCLONE_Spawn(
+		int                     I__argc,
+		char                  **I__argv,
+		SYSRES_PCLONE_ENGINE_T *O_engine,
+		int                    *O_fd
+		)
+	{
+	int rCode = EXIT_SUCCESS;
+	int pipeFD[2] = { -1, -1 };
+	int fd;
+
+	if(pipe(pipeFD))
+		{
+		rCode = errno;
+		goto CLEANUP;
+		}
+
+	if(fcntl(pipeFD[0], F_SETPIPE_SZ, SYSRES_PCLONE_PIPE_D) == -1)
+		debug(INFO, 3, "Pipe left at default size [%i]\n", errno);
+
+	O_engine->type = 0;
+	O_engine->argc = I__argc;
+	O_engine->argv = I__argv;
+	O_engine->fd   = pipeFD[0];
+
+	fflush(NULL); // the child must not repeat our buffered output
+	if((O_engine->pid = fork()) == -1)
+		{
+		O_engine->pid = 0;
+		rCode = errno;
+		goto CLEANUP;
+		}
+
+	if(!O_engine->pid)
+		{
+		signal(SIGINT, SIG_IGN);
+		for(fd = getdtablesize() - 1; fd > STDERR_FILENO; fd--)
+			{
+			if(fd != O_engine->fd)
+				close(fd); // other engines' pipes must see EOF when those engines end
+			}
+
+#ifdef PARTCLONE
+		LIBPARTCLONE_threaded = 0;
+		_exit(LIBPARTCLONE_MainEntry(0, O_engine->fd, I__argc, I__argv));
+#else
+		_exit(EXIT_FAILURE);
+#endif
+		}
+
+//RESULTS:
+	*O_fd = pipeFD[1];
+	pipeFD[1] = -1;
+
+CLEANUP:
+
+	if(pipeFD[0] != -1)
+		close(pipeFD[0]);
+
+	if(pipeFD[1] != -1)
+		close(pipeFD[1]);
+
+	return(rCode);
+	}
+
+/*----------------------------------------------------------------------------
+** Wait for a restore engine and return its exit code. The caller closes its
+** own end of the pipe first, which ends the engine at its next read; I__cancel
+** also stops a threaded engine before its next buffer, through
+** LIBPARTCLONE_stop, and kills a child one.
+*/
+int SYSRES_PCLONE_Finish(
+		SYSRES_PCLONE_ENGINE_T *I__engine,
+		bool                    I__cancel
+		)
+	{
+	int   rCode = EXIT_SUCCESS;
+	void *result = NULL;
+	int   status;
+
+	if(I__engine->pid)
+		{
+		if(I__cancel)
+			kill(I__engine->pid, SIGKILL);
+
+		while(waitpid(I__engine->pid, &status, 0) == -1)
+			{
+			if(errno != EINTR)
+				return(-1);
+			}
+
+		I__engine->pid = 0;
+		if(WIFEXITED(status))
+			return(WEXITSTATUS(status));
+
+		return(-1);
+		}
+
+#ifdef PARTCLONE
+	if(I__cancel)
+		SYSRES_PCLONE_STOP(1);
+#endif
+
+	if((rCode = pthread_join(I__engine->tid, &result)))
+		goto CLEANUP;
+
+	rCode = (int)(long)result;
+
+CLEANUP:
+
+	if(rCode)
+		close(I__engine->fd); // partclone only closes it on success
+
+	return(rCode);
+	}
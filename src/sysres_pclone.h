@@ -0,0 +1,194 @@
+/*****************************************************************************
+* sysres "System Restore" Partition backup and restore utility.
+* Copyright © 2019-2020 Micro Focus or one of its affiliates.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along
+* with this program; if not, write to the Free Software Foundation, Inc.,
+* 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef _SYSRES_PCLONE_H_
+ #define _SYSRES_PCLONE_H_
+
+/*----------------------------------------------------------------------------
+** Compiler setup.
+*/
+#include <pthread.h>   // pthread_t
+#include <stdbool.h>   // bool
+#include <stddef.h>    // size_t
+#include <sys/types.h> // pid_t
+
+#include "fileEngine.h"        // ioBuf
+#include "sysres_blockmap.h"   // SYSRES_BLOCKMAP_T
+
+/*----------------------------------------------------------------------------
+** Macro values
+*/
+#define SYSRES_PCLONE_PIPE_D   (1024*1024)        // requested pipe capacity between sysres and a restore engine
+#define SYSRES_PCLONE_BATCH_D  (256*1024)         // bytes moved per read/write on our side of the pipe
+#define SYSRES_PCLONE_POLL_D   250                // ms between ctrl-c checks while the engine is quiet
+#define SYSRES_PCLONE_QUEUES_D 4                  // used-block readers of a backup stream
+#define SYSRES_PCLONE_SLOTS_D  (2*SYSRES_PCLONE_QUEUES_D) // extents read ahead of the stream
+#define SYSRES_PCLONE_EXTENT_D IOBUFSIZE          // largest single read of coalesced used blocks
+#define SYSRES_PCLONE_GAP_D    (256*1024)         // free gaps smaller than this are read through
+#define SYSRES_PCLONE_DESC_D   110                // partclone image_desc_v2: head, fs_info, options, crc
+#define SYSRES_PCLONE_CRC_D    4                  // bitmap crc and block checksums
+
+#define SYSRES_PCLONE_CSM_NONE_D   0x00           // image_options checksum_mode: no block checksums,
+#define SYSRES_PCLONE_CSM_CRC32_D  0x20           // partclone's CRC32,
+#define SYSRES_PCLONE_CSM_CRC32C_D 0x21           // CRC32C, written by sysres since pcsum spans
+#define SYSRES_PCLONE_BM_BIT_D     0x01           // image_options bitmap_mode
+
+/*----------------------------------------------------------------------------
+** Storage
+*/
+typedef struct
+	{
+	pthread_t  tid;
+	pid_t      pid;     // set when the engine runs in a child process instead of a thread
+	int        fd;      // engine's end of the pipe; partclone closes it when it succeeds
+	int        type;    // PART_* for a backup, 0 for a restore
+	int        argc;
+	char     **argv;
+	} SYSRES_PCLONE_ENGINE_T;
+
+typedef struct
+	{
+	unsigned char       desc[SYSRES_PCLONE_DESC_D]; // as partclone wrote it
+	unsigned long long  totalBlocks;
+	unsigned long long  usedBlocks;
+	unsigned long long  deviceSize;
+	unsigned int        blockSize;
+	unsigned int        sumBlocks;         // blocks per checksum, 0 when the image has none
+	SYSRES_BLOCKMAP_T   map;
+	} SYSRES_PCLONE_IMAGE_T;
+
+typedef struct
+	{
+	unsigned long long  skip;              // bitmap and its crc, passed as they are
+	unsigned long long  left;              // block bytes still to come
+	unsigned long long  span;              // block bytes per checksum
+	unsigned long long  spanBytes;
+	unsigned int        crc;
+	unsigned char       sum[SYSRES_PCLONE_CRC_D];
+	int                 sumLen;            // -1 between checksums
+	} SYSRES_PCLONE_STRIP_T;
+
+typedef struct
+	{
+	ioBuf              *io;
+	unsigned long long  start, end;        // blocks read into io, used or not
+	int                 error;             // -1 while the read is in flight
+	} SYSRES_PCLONE_SLOT_T;
+
+typedef struct
+	{
+	SYSRES_PCLONE_IMAGE_T *image;
+	int                    fd;             // the device
+	SYSRES_PCLONE_SLOT_T   slot[SYSRES_PCLONE_SLOTS_D];
+	int                    slots;          // as many as the pool spares
+	unsigned long          claimed;        // slots handed to readers
+	unsigned long          taken;          // slots the stream has moved past
+	unsigned long long     next;           // first block not yet claimed
+	bool                   stop;
+	pthread_t              tid[SYSRES_PCLONE_QUEUES_D];
+	int                    threads;
+	pthread_mutex_t        lock;
+	pthread_cond_t         cond;
+	int                    stage;          // what the stream is sending
+	unsigned long          chunk;          // bitmap container sent next
+	unsigned char          pend[SYSRES_BLOCKMAP_BYTES_D]; // descriptor, bitmap or a checksum, being sent
+	size_t                 pendLen, pendOff;
+	size_t                 pos, runEnd;    // bytes into the current slot
+	unsigned int           crc;
+	unsigned long long     spanBytes;      // block bytes under the running checksum
+	} SYSRES_PCLONE_STREAM_T;
+
+/*----------------------------------------------------------------------------
+** Function prototypes.
+*/
+extern unsigned int SYSRES_PCLONE_Crc32(
+		unsigned int         I__crc,
+		const unsigned char *I__buf,
+		size_t               I__size
+		);
+
+extern unsigned int SYSRES_PCLONE_Crc32c(
+		unsigned int         I__crc,
+		const unsigned char *I__buf,
+		size_t               I__size
+		);
+
+extern int SYSRES_PCLONE_Map(
+		int                     I__type,
+		int                     I__argc,
+		char                  **I__argv,
+		bool                  (*I__cancel)(void),
+		SYSRES_PCLONE_IMAGE_T  *O_image
+		);
+
+extern unsigned long long SYSRES_PCLONE_Bytes(
+		SYSRES_PCLONE_IMAGE_T *I__image
+		);
+
+extern void SYSRES_PCLONE_Release(
+		SYSRES_PCLONE_IMAGE_T *IO_image
+		);
+
+extern int SYSRES_PCLONE_Open(
+		SYSRES_PCLONE_IMAGE_T  *I__image,
+		char                   *I__device,
+		SYSRES_PCLONE_STREAM_T *O_stream
+		);
+
+extern int SYSRES_PCLONE_Stream(
+		SYSRES_PCLONE_STREAM_T *IO_stream,
+		unsigned char          *O_buf,
+		size_t                  I__size
+		);
+
+extern void SYSRES_PCLONE_Close(
+		SYSRES_PCLONE_STREAM_T *IO_stream
+		);
+
+extern bool SYSRES_PCLONE_StripStart(
+		unsigned char         *IO_desc,
+		SYSRES_PCLONE_STRIP_T *O_strip
+		);
+
+extern int SYSRES_PCLONE_Strip(
+		SYSRES_PCLONE_STRIP_T *IO_strip,
+		unsigned char         *IO_buf,
+		int                    I__len
+		);
+
+extern int SYSRES_PCLONE_Start(
+		int                     I__argc,
+		char                  **I__argv,
+		SYSRES_PCLONE_ENGINE_T *O_engine,
+		int                    *O_fd
+		);
+
+extern int SYSRES_PCLONE_Spawn(
+		int                     I__argc,
+		char                  **I__argv,
+		SYSRES_PCLONE_ENGINE_T *O_engine,
+		int                    *O_fd
+		);
+
+extern int SYSRES_PCLONE_Finish(
+		SYSRES_PCLONE_ENGINE_T *I__engine,
+		bool                    I__cancel
+		);
+
+#endif /* _SYSRES_PCLONE_H_ */
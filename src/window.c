@@ -37,6 +37,7 @@
 #include <sys/stat.h>
 #include <sys/statfs.h>
 #include "window.h"
+#include "backup.h"				// estimateBackup
 #include "cli.h"					// add_img
 #include "frame.h"				// expert
 #include "image.h" 				// iset, imageSize
@@ -325,7 +326,7 @@ void showFunctionMenu(int action) {
 			if (action == 10) {
 				prepareOperation("VERIFYING ARCHIVE INTEGRITY");
 				locateImage(); // set globalPath
-				verifyImage(globalPath);
+				verifyImage(globalPath,(options & OPT_DEEP)?1:0);
 				}
 //			}
 		if (action == 98) {
@@ -364,6 +365,11 @@ else
 					createBackup(0);
 					}
 				else showFunction(10,"F2","BACKUP",action);
+				if (action == 4) {
+					prepareOperation("ESTIMATING DRIVE ARCHIVE");
+					estimateBackup();
+					}
+				else showFunction(20,"F4","ESTIMATE",action);
 				}
 			}
 		else if (sels[LIST_DRIVE].count) {
@@ -719,6 +725,8 @@ void debugCurrentDrive(void) {
 /*----------------------------------------------------------------------------
 **
 */
+#define PREFETCH_POLL 250 // ms between prefetch checks while waiting for a key
+
 void navigator(void)
 	{
 	bool toosmall = false;
@@ -835,7 +843,10 @@ void navigator(void)
 	/* END OF AUTO MODES */
 
 	while(1) {  // use [F1]shell to exit, or ctrl-backslash
+		timeout(PREFETCH_POLL); // wake up now and then to pick up a finished index prefetch
 		ch = getch(); // getNextAuto();
+		timeout(-1);
+		if (ch == ERR) { if (pollImagePrefetch()) doupdate(); continue; }
 		sel = currentWindowSelection();
 		selMap = getSelMap(sel);
 
@@ -953,6 +964,7 @@ void navigator(void)
 			case KEY_F(6): showFunctionMenu(6); break; // new/cancel
 			case KEY_F(1): case 1: showFunctionMenu(1); break; // autosel/select/clear (ctrl-A)
 			case KEY_F(2): case 2: showFunctionMenu(2); break; // backup/restore (ctrl-B)
+			case KEY_F(4): showFunctionMenu(4); break; // estimate a backup
 			case KEY_F(7): showFunctionMenu(7); break; // rmdir, remove pending archive, buffer archive
 			case KEY_F(8):
 				if (modeset) { nextMode(); sel = currentWindowSelection(); selMap = getSelMap(sel); }
@@ -103,6 +103,10 @@
 #define OPT_POST 2048
 #define OPT_BUFFER 4096
 #define OPT_APPEND 8192
+#define OPT_TEE 16384
+#define OPT_DIRECT 32768
+#define OPT_ESTIMATE 65536
+#define OPT_DEEP 131072
 
 // colors (1-7 are part of item state)
 #define CLR_BUSY 1	// used to identify occupied MBRs (actual color is default)